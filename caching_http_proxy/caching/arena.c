@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include "arena.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../third_party/log.h"
+
+// maps size bytes aligned to ARENA_PAGE_SIZE with transparent huge pages requested
+// the kernel only hands out huge pages for aligned ranges, so the mapping is made larger and trimmed
+static uint8_t *map_thp(size_t size) {
+    size_t len = size + ARENA_PAGE_SIZE;
+    uint8_t *raw = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+
+    uint8_t *base = (uint8_t *)(((uintptr_t)raw + ARENA_PAGE_SIZE - 1) & ~((uintptr_t)ARENA_PAGE_SIZE - 1));
+    if (base > raw) munmap(raw, base - raw);
+    if (raw + len > base + size) munmap(base + size, raw + len - (base + size));
+
+    if (madvise(base, size, MADV_HUGEPAGE) == -1)
+        log_warn("transparent huge pages unavailable, body arena uses normal pages: %s", strerror(errno));
+    return base;
+}
+
+// size is rounded up to whole huge pages
+// returns NULL if nothing could be mapped, the cache then keeps all bodies on the heap
+body_arena_t *arena_init(size_t size, size_t slot_size) {
+    if (slot_size == 0 || ARENA_PAGE_SIZE % slot_size != 0) {
+        log_error("body arena slot size %zu does not divide a huge page", slot_size);
+        return NULL;
+    }
+    size = (size + ARENA_PAGE_SIZE - 1) / ARENA_PAGE_SIZE * ARENA_PAGE_SIZE;
+    if (size == 0 || size / slot_size > UINT32_MAX) {
+        log_error("body arena of %zu bytes is out of range", size);
+        return NULL;
+    }
+
+    body_arena_t *arena = calloc(1, sizeof(body_arena_t));
+    if (!arena) {
+        log_error("could not allocate body arena");
+        return NULL;
+    }
+    arena->size = size;
+    arena->slot_size = slot_size;
+    arena->num_slots = size / slot_size;
+    arena->free_slots = malloc(arena->num_slots * sizeof(uint32_t));
+    arena->state = calloc(arena->num_slots, 1);
+    if (!arena->free_slots || !arena->state) {
+        log_error("could not allocate body arena slot tables");
+        free(arena->free_slots);
+        free(arena->state);
+        free(arena);
+        return NULL;
+    }
+
+    // explicit huge pages first, that only works if the administrator reserved enough of them
+    arena->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena->base != MAP_FAILED) {
+        arena->hugetlb = 1;
+    } else {
+        log_debug("no hugetlbfs pages for the body arena: %s", strerror(errno));
+        arena->base = map_thp(size);
+    }
+    if (!arena->base) {
+        log_error("could not map body arena of %zu bytes: %s", size, strerror(errno));
+        free(arena->free_slots);
+        free(arena->state);
+        free(arena);
+        return NULL;
+    }
+
+    // pushed in reverse so the lowest slots are handed out first
+    for (size_t i = 0; i < arena->num_slots; i++)
+        arena->free_slots[i] = arena->num_slots - 1 - i;
+    arena->num_free = arena->num_slots;
+    pthread_mutex_init(&arena->lock, NULL);
+
+    log_info("body arena: %zu MB in %zu KB slots, %s", size / (1024 * 1024), slot_size / 1024,
+             arena->hugetlb ? "hugetlbfs pages" : "transparent huge pages");
+    return arena;
+}
+
+// the cache must not hold any slot any more
+void arena_destroy(body_arena_t **arena_ptr) {
+    if (!arena_ptr || !*arena_ptr) return;
+    body_arena_t *arena = *arena_ptr;
+
+    munmap(arena->base, arena->size);
+    pthread_mutex_destroy(&arena->lock);
+    free(arena->free_slots);
+    free(arena->state);
+    free(arena);
+    *arena_ptr = NULL;
+}
+
+// returns a slot_size buffer, NULL once the arena is full
+void *arena_alloc(body_arena_t *arena) {
+    pthread_mutex_lock(&arena->lock);
+    if (arena->num_free == 0) {
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+    uint32_t slot = arena->free_slots[--arena->num_free];
+    arena->state[slot] = ARENA_SLOT_USED;
+    pthread_mutex_unlock(&arena->lock);
+    return arena->base + (size_t)slot * arena->slot_size;
+}
+
+int arena_owns(body_arena_t *arena, const void *ptr) {
+    return (const uint8_t *)ptr >= arena->base && (const uint8_t *)ptr < arena->base + arena->size;
+}
+
+void arena_free(body_arena_t *arena, void *ptr) {
+    uint32_t slot = ((uint8_t *)ptr - arena->base) / arena->slot_size;
+    pthread_mutex_lock(&arena->lock);
+    arena->state[slot] = ARENA_SLOT_FREE;
+    arena->free_slots[arena->num_free++] = slot;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// hands every huge page without a used slot back to the kernel
+// pages with a used slot are kept whole, dropping part of one would split it into small pages
+// returns the number of bytes released
+size_t arena_trim(body_arena_t *arena) {
+    size_t per_page = ARENA_PAGE_SIZE / arena->slot_size;
+    size_t released = 0;
+
+    pthread_mutex_lock(&arena->lock);
+    for (size_t first = 0; first < arena->num_slots; first += per_page) {
+        int used = 0, resident = 0;
+        for (size_t i = first; i < first + per_page; i++) {
+            used |= arena->state[i] == ARENA_SLOT_USED;
+            resident |= arena->state[i] == ARENA_SLOT_FREE;
+        }
+        if (used || !resident) continue;
+        if (madvise(arena->base + first * arena->slot_size, ARENA_PAGE_SIZE, MADV_DONTNEED) == -1) {
+            log_debug("could not trim body arena: %s", strerror(errno));
+            break;
+        }
+        memset(arena->state + first, ARENA_SLOT_TRIMMED, per_page);
+        released += ARENA_PAGE_SIZE;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    return released;
+}
@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_PAGE_SIZE (2 * 1024 * 1024) // huge page size, the mapping and every page of slots are aligned to it
+
+typedef enum _arena_slot_t {
+    ARENA_SLOT_FREE = 0,
+    ARENA_SLOT_USED = 1,
+    ARENA_SLOT_TRIMMED = 2,  // free and handed back to the kernel, faulted in again on the next use
+} arena_slot_t;
+
+// fixed size slots for the extents of compacted bodies, carved out of one mapping
+// the mapping comes from the hugetlbfs pool if it is large enough, otherwise transparent huge pages are asked for
+// so streaming a large object walks a handful of TLB entries instead of one per 4KB page
+typedef struct body_arena {
+    uint8_t *base;
+    size_t size;             // bytes mapped, a multiple of ARENA_PAGE_SIZE
+    size_t slot_size;        // divides ARENA_PAGE_SIZE
+    size_t num_slots;
+    uint32_t *free_slots;    // stack of free slot indexes, recently freed and still resident ones come first
+    size_t num_free;
+    uint8_t *state;          // arena_slot_t per slot
+    pthread_mutex_t lock;
+    int hugetlb;             // 1 if backed by the hugetlbfs pool
+} body_arena_t;
+
+body_arena_t *arena_init(size_t size, size_t slot_size);
+void arena_destroy(body_arena_t **arena);
+void *arena_alloc(body_arena_t *arena);
+int arena_owns(body_arena_t *arena, const void *ptr);
+void arena_free(body_arena_t *arena, void *ptr);
+size_t arena_trim(body_arena_t *arena);
+
+#endif // ARENA_H
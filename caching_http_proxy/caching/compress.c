@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "../third_party/log.h"
+
+static data_chunk_t *new_chunk(size_t capacity) {
+    data_chunk_t *chunk = malloc(sizeof(data_chunk_t));
+    uint8_t *data = malloc(capacity ? capacity : 1);
+    if (!chunk || !data) {
+        free(chunk);
+        free(data);
+        log_error("could not allocate memory for a compressed chunk");
+        return NULL;
+    }
+    chunk->data = data;
+    chunk->size = 0;
+    chunk->next = NULL;
+    return chunk;
+}
+
+static void free_chunk_list(data_chunk_t *chunk) {
+    while (chunk) {
+        data_chunk_t *next = chunk->next;
+        free(chunk->data);
+        free(chunk);
+        chunk = next;
+    }
+}
+
+static int contains_nocase(const char *s, size_t len, const char *needle) {
+    size_t needle_len = strlen(needle);
+    for (size_t i = 0; i + needle_len <= len; i++) {
+        if (strncasecmp(s + i, needle, needle_len) == 0) return 1;
+    }
+    return 0;
+}
+
+static int header_is(const char *line, size_t len, const char *name) {
+    size_t name_len = strlen(name);
+    return len > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0;
+}
+
+// rewrites the header block of an identity response for its gzip variant
+// Content-Length is replaced, a strong ETag is weakened since the bytes differ and Vary gains Accept-Encoding
+// returns the length written to out, -1 if it does not fit
+static ssize_t gzip_headers(const char *in, size_t in_len, size_t body_len, char *out, size_t out_size) {
+    size_t out_len = 0;
+    int has_vary = 0;
+    const char *end = in + in_len - 2; // the empty line ending the block is added back below
+
+    for (const char *line = in; line < end; ) {
+        const char *eol = memmem(line, end - line, "\r\n", 2);
+        if (!eol) return -1;
+        size_t len = eol - line;
+        int n;
+
+        if (header_is(line, len, "Content-Length")) {
+            n = 0;
+        } else if (header_is(line, len, "ETag")) {
+            const char *value = line + 5;
+            while (*value == ' ') value++;
+            n = snprintf(out + out_len, out_size - out_len, "ETag: %s%.*s\r\n", *value == '"' ? "W/" : "",
+                         (int)(eol - value), value);
+        } else if (header_is(line, len, "Vary")) {
+            has_vary = 1;
+            if (contains_nocase(line, len, "Accept-Encoding"))
+                n = snprintf(out + out_len, out_size - out_len, "%.*s\r\n", (int)len, line);
+            else
+                n = snprintf(out + out_len, out_size - out_len, "%.*s, Accept-Encoding\r\n", (int)len, line);
+        } else {
+            n = snprintf(out + out_len, out_size - out_len, "%.*s\r\n", (int)len, line);
+        }
+        if (n < 0 || (size_t)n >= out_size - out_len) return -1;
+        out_len += n;
+        line = eol + 2;
+    }
+
+    int n = snprintf(out + out_len, out_size - out_len, "Content-Encoding: gzip\r\n%sContent-Length: %zu\r\n\r\n",
+                     has_vary ? "" : "Vary: Accept-Encoding\r\n", body_len);
+    if (n < 0 || (size_t)n >= out_size - out_len) return -1;
+    return out_len + n;
+}
+
+// deflates the body of a complete entry into chunks of at most COMPACT_EXTENT_SIZE
+// returns 0 with the list in *head and its length in *size, 1 if the result would be larger than limit, -1 on failure
+static int deflate_body(cache_entry_t *entry, size_t offset, size_t limit, data_chunk_t **head, size_t *size) {
+    size_t total = entry->total_size;
+    z_stream zs = {0};
+    if (deflateInit2(&zs, COMPRESS_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        log_error("could not initialise deflate for %s", entry->url);
+        return -1;
+    }
+
+    size_t extent = deflateBound(&zs, total - offset);
+    if (extent > COMPACT_EXTENT_SIZE) extent = COMPACT_EXTENT_SIZE;
+
+    uint8_t *in = malloc(COMPRESS_INPUT_SIZE);
+    data_chunk_t *tail = new_chunk(extent);
+    *head = tail;
+    *size = 0;
+    int ret = -1;
+    if (!in || !tail) goto out;
+    zs.next_out = tail->data;
+    zs.avail_out = extent;
+
+    int status = Z_OK;
+    while (status != Z_STREAM_END) {
+        int flush = Z_NO_FLUSH;
+        if (zs.avail_in == 0) {
+            if (offset < total) {
+                size_t want = total - offset < COMPRESS_INPUT_SIZE ? total - offset : COMPRESS_INPUT_SIZE;
+                ssize_t got = cache_entry_read_nowait(entry, in, offset, want);
+                if (got != (ssize_t)want) goto out;
+                offset += got;
+                zs.next_in = in;
+                zs.avail_in = got;
+            }
+        }
+        if (offset == total) flush = Z_FINISH;
+
+        if (zs.avail_out == 0) {
+            tail->size = extent;
+            tail->next = new_chunk(extent);
+            if (!tail->next) goto out;
+            tail = tail->next;
+            zs.next_out = tail->data;
+            zs.avail_out = extent;
+        }
+
+        status = deflate(&zs, flush);
+        if (status == Z_STREAM_ERROR) {
+            log_error("deflate failed for %s", entry->url);
+            goto out;
+        }
+        if (zs.total_out > limit) {
+            ret = 1;
+            goto out;
+        }
+    }
+    tail->size = extent - zs.avail_out;
+    *size = zs.total_out;
+    ret = 0;
+
+out:
+    deflateEnd(&zs);
+    free(in);
+    if (ret != 0) {
+        free_chunk_list(*head);
+        *head = NULL;
+    }
+    return ret;
+}
+
+// replaces a complete identity response with its gzip variant
+// returns 0 if the entry is done with, compressed or not, 1 if readers were in the way, -1 on failure
+static int compress_entry(compress_pool_t *pool, cache_entry_t *entry) {
+    size_t total = entry->total_size;
+    size_t header_len = entry->compress_header_len;
+    if (entry->state != ENTRY_COMPLETE || header_len == 0 || total < header_len + COMPRESS_MIN_SIZE) return 0;
+    // swapping needs the job's reference to be the only one, no point in compressing before that
+    if (entry->refcount != 1) return 1;
+
+    char head_in[8192], head_out[8192 + 256];
+    if (header_len > sizeof(head_in) || cache_entry_read_nowait(entry, head_in, 0, header_len) != (ssize_t)header_len)
+        return -1;
+
+    size_t limit = total * (100 - COMPRESS_MIN_SAVING) / 100;
+    data_chunk_t *body;
+    size_t body_len;
+    int ret = deflate_body(entry, header_len, limit, &body, &body_len);
+    if (ret != 0) {
+        if (ret == 1) log_debug("%s does not compress well, keeping it as received", entry->url);
+        return ret == 1 ? 0 : -1;
+    }
+
+    ssize_t out_len = gzip_headers(head_in, header_len, body_len, head_out, sizeof(head_out));
+    if (out_len < 0 || out_len + body_len > limit) {
+        free_chunk_list(body);
+        return 0;
+    }
+    size_t size = out_len + body_len;
+
+    // small responses stay a single allocation, larger ones get a chunk for the headers in front of the extents
+    data_chunk_t *first = new_chunk(size <= SMALL_OBJECT_SIZE ? size : (size_t)out_len);
+    if (!first) {
+        free_chunk_list(body);
+        return -1;
+    }
+    memcpy(first->data, head_out, out_len);
+    first->size = out_len;
+    data_chunk_t *tail = first;
+    if (size <= SMALL_OBJECT_SIZE) {
+        for (data_chunk_t *chunk = body; chunk; chunk = chunk->next) {
+            memcpy(first->data + first->size, chunk->data, chunk->size);
+            first->size += chunk->size;
+        }
+        free_chunk_list(body);
+    } else {
+        first->next = body;
+        while (tail->next) tail = tail->next;
+        // the last extent is rarely full, give the slack back
+        uint8_t *shrunk = realloc(tail->data, tail->size ? tail->size : 1);
+        if (shrunk) tail->data = shrunk;
+    }
+
+    if (cache_entry_replace_data(entry, first, tail, size, CACHE_ENCODING_GZIP) != 0) {
+        free_chunk_list(first);
+        return 1;
+    }
+
+    pthread_mutex_lock(&pool->jobs_lock);
+    pool->saved_bytes += total - size;
+    pthread_mutex_unlock(&pool->jobs_lock);
+    log_debug("compressed %s from %zu to %zu bytes", entry->url, total, size);
+    return 0;
+}
+
+// appends a job, caller holds jobs_lock
+static void push_job(compress_pool_t *pool, compress_job_t *job) {
+    job->next = NULL;
+    if (pool->jobs_tail)
+        pool->jobs_tail->next = job;
+    else
+        pool->jobs_head = job;
+    pool->jobs_tail = job;
+}
+
+// unlinks and returns the first job that is due, or NULL and the time the next one becomes due (0 if none)
+// caller holds jobs_lock
+static compress_job_t *pop_due_job(compress_pool_t *pool, time_t now, time_t *next) {
+    compress_job_t *prev = NULL;
+    *next = 0;
+    for (compress_job_t *job = pool->jobs_head; job; prev = job, job = job->next) {
+        if (job->not_before > now) {
+            if (!*next || job->not_before < *next) *next = job->not_before;
+            continue;
+        }
+        if (prev)
+            prev->next = job->next;
+        else
+            pool->jobs_head = job->next;
+        if (pool->jobs_tail == job)
+            pool->jobs_tail = prev;
+        return job;
+    }
+    return NULL;
+}
+
+static void *compress_thread_func(void *arg) {
+    compress_pool_t *pool = (compress_pool_t *)arg;
+
+    pthread_mutex_lock(&pool->jobs_lock);
+    while (pool->running) {
+        time_t now = time(NULL), next;
+        compress_job_t *job = pop_due_job(pool, now, &next);
+        if (!job) {
+            if (next) {
+                struct timespec wait_time = {.tv_sec = next, .tv_nsec = 0};
+                pthread_cond_timedwait(&pool->jobs_cond, &pool->jobs_lock, &wait_time);
+            } else {
+                pthread_cond_wait(&pool->jobs_cond, &pool->jobs_lock);
+            }
+            continue;
+        }
+        pthread_mutex_unlock(&pool->jobs_lock);
+
+        // an entry evicted while it waited needs neither compressing nor settling
+        cache_entry_t *entry = cache_entry_claim(job->cache, job->entry, job->hash);
+        int ret = entry ? compress_entry(pool, entry) : 0;
+
+        if (ret == 1 && ++job->tries < COMPACT_MAX_TRIES) {
+            cache_entry_release(entry);
+            pthread_mutex_lock(&pool->jobs_lock);
+            job->not_before = now + SWEEP_RETRY;
+            push_job(pool, job);
+            continue;
+        }
+
+        // whatever came of it, the entry now goes on to compaction and the disk tier
+        if (entry) {
+            cache_entry_settle(entry);
+            cache_entry_release(entry);
+        }
+        free(job);
+        pthread_mutex_lock(&pool->jobs_lock);
+    }
+    pthread_mutex_unlock(&pool->jobs_lock);
+    return NULL;
+}
+
+compress_pool_t *compress_pool_init(size_t num_threads) {
+    compress_pool_t *pool = calloc(1, sizeof(compress_pool_t));
+    if (!pool) {
+        log_fatal("could not allocate compression pool");
+        return NULL;
+    }
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        log_fatal("could not allocate compression threads");
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->jobs_lock, NULL);
+    pthread_cond_init(&pool->jobs_cond, NULL);
+    pool->running = 1;
+
+    for (size_t i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, compress_thread_func, pool) != 0) {
+            log_fatal("failed to create compression thread");
+            break;
+        }
+        pool->num_threads++;
+    }
+    if (pool->num_threads == 0) {
+        compress_pool_shutdown(&pool);
+        return NULL;
+    }
+
+    log_info("compressing text responses at rest with %zu threads", pool->num_threads);
+    return pool;
+}
+
+// stops the workers, entries still queued are settled uncompressed
+// must be called while the cache and its disk tier are still fully working
+void compress_pool_shutdown(compress_pool_t **pool_ptr) {
+    if (!pool_ptr || !*pool_ptr) {
+        return;
+    }
+    compress_pool_t *pool = *pool_ptr;
+
+    pthread_mutex_lock(&pool->jobs_lock);
+    pool->running = 0;
+    pthread_cond_broadcast(&pool->jobs_cond);
+    pthread_mutex_unlock(&pool->jobs_lock);
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    while (pool->jobs_head) {
+        compress_job_t *job = pool->jobs_head;
+        pool->jobs_head = job->next;
+        cache_entry_t *entry = cache_entry_claim(job->cache, job->entry, job->hash);
+        if (entry) {
+            cache_entry_settle(entry);
+            cache_entry_release(entry);
+        }
+        free(job);
+    }
+
+    if (pool->saved_bytes)
+        log_info("compression at rest saved %zu bytes", pool->saved_bytes);
+
+    pthread_mutex_destroy(&pool->jobs_lock);
+    pthread_cond_destroy(&pool->jobs_cond);
+    free(pool->threads);
+    free(pool);
+    *pool_ptr = NULL;
+}
+
+// queues a complete entry for compression, it is skipped if it gets evicted before a worker reaches it
+// returns 0 on success, -1 on failure
+int compress_pool_submit(compress_pool_t *pool, cache_entry_t *entry) {
+    compress_job_t *job = malloc(sizeof(compress_job_t));
+    if (!job) {
+        log_error("could not allocate compression job");
+        return -1;
+    }
+    job->entry = entry;
+    job->cache = entry->cache;
+    job->hash = entry->hash;
+    job->not_before = 0;
+    job->tries = 0;
+
+    pthread_mutex_lock(&pool->jobs_lock);
+    push_job(pool, job);
+    pthread_cond_signal(&pool->jobs_cond);
+    pthread_mutex_unlock(&pool->jobs_lock);
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "httpcache.h"
+
+#define COMPRESS_MIN_SIZE 1024         // bodies below this are not worth a gzip header
+#define COMPRESS_MIN_SAVING 10         // percent the stored response has to shrink by to be replaced
+#define COMPRESS_LEVEL 6
+#define COMPRESS_INPUT_SIZE (64 * 1024) // bytes read from the entry per deflate call
+
+// complete entry waiting for a compression worker
+// like a compaction job it holds no reference, the entry is claimed from its bucket each time the job runs
+typedef struct _compress_job_t {
+    cache_entry_t *entry;
+    http_cache_t *cache;
+    uint32_t hash;
+    time_t not_before;
+    int tries;
+    struct _compress_job_t *next;
+} compress_job_t;
+
+// threads that gzip complete text responses at rest, so the workers serving clients never spend time deflating
+typedef struct compress_pool {
+    pthread_t *threads;
+    size_t num_threads;
+    compress_job_t *jobs_head;
+    compress_job_t *jobs_tail;
+    pthread_mutex_t jobs_lock;
+    pthread_cond_t jobs_cond;
+    volatile int running;
+    size_t saved_bytes;           // under jobs_lock
+} compress_pool_t;
+
+compress_pool_t *compress_pool_init(size_t num_threads);
+void compress_pool_shutdown(compress_pool_t **pool);
+int compress_pool_submit(compress_pool_t *pool, cache_entry_t *entry);
+
+#endif // COMPRESS_H
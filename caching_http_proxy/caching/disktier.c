@@ -0,0 +1,838 @@
+#include "disktier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "../third_party/log.h"
+
+static uint64_t hash_key(const char *url) {
+    uint64_t hash = 14695981039346656037ull;
+    while (*url) {
+        hash ^= (uint8_t)*url++;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// writes the whole buffer at the given offset, returns 0 on success, -1 on failure
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t ret = pwrite(fd, (const uint8_t *)buf + written, len - written, offset + written);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            log_error("disk tier pwrite failed: %s", strerror(errno));
+            return -1;
+        }
+        written += ret;
+    }
+    return 0;
+}
+
+// reads exactly len bytes at the given offset, returns 0 on success, -1 on failure or short read
+static int pread_all(int fd, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = pread(fd, (uint8_t *)buf + done, len - done, offset + done);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            log_error("disk tier pread failed: %s", strerror(errno));
+            return -1;
+        }
+        if (ret == 0) {
+            log_error("disk tier record is truncated");
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+// caller must hold index_lock for writing
+static void index_put(disk_tier_t *tier, uint64_t key, const disk_loc_t *loc) {
+    disk_index_entry_t **pp = &tier->index[key % DISK_INDEX_BUCKETS];
+    for (; *pp; pp = &(*pp)->next) {
+        if ((*pp)->key == key) {
+            (*pp)->loc = *loc;
+            return;
+        }
+    }
+
+    disk_index_entry_t *node = malloc(sizeof(disk_index_entry_t));
+    if (!node) {
+        log_error("could not allocate disk index entry");
+        return;
+    }
+    node->key = key;
+    node->loc = *loc;
+    node->next = NULL;
+    *pp = node;
+    tier->index_count++;
+}
+
+// caller must hold index_lock for writing
+static void index_remove(disk_tier_t *tier, uint64_t key) {
+    disk_index_entry_t **pp = &tier->index[key % DISK_INDEX_BUCKETS];
+    for (; *pp; pp = &(*pp)->next) {
+        if ((*pp)->key == key) {
+            disk_index_entry_t *dead = *pp;
+            *pp = dead->next;
+            free(dead);
+            tier->index_count--;
+            return;
+        }
+    }
+}
+
+// drops every index entry that points into the segment about to be overwritten
+static void index_drop_segment(disk_tier_t *tier, uint32_t segment) {
+    pthread_rwlock_wrlock(&tier->index_lock);
+    tier->segment_gens[segment]++;
+    for (size_t i = 0; i < DISK_INDEX_BUCKETS; i++) {
+        disk_index_entry_t **pp = &tier->index[i];
+        while (*pp) {
+            if ((*pp)->loc.segment == segment) {
+                disk_index_entry_t *dead = *pp;
+                *pp = dead->next;
+                free(dead);
+                tier->index_count--;
+            } else {
+                pp = &(*pp)->next;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&tier->index_lock);
+}
+
+static uint32_t header_crc(const disk_record_hdr_t *hdr) {
+    return crc32(0, (const Bytef *)hdr, offsetof(disk_record_hdr_t, hdr_crc));
+}
+
+// writes the in-memory index to index.dat through a temporary file so a crash never leaves a torn index
+// called by the writer thread, or at shutdown once the writer is stopped
+static void save_index(disk_tier_t *tier) {
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", tier->dir, DISK_INDEX_FILE);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", tier->dir, DISK_INDEX_FILE);
+
+    // records must reach the disk before an index pointing at them does
+    for (uint32_t i = 0; i < tier->num_segments; i++) {
+        fdatasync(tier->segment_fds[i]);
+    }
+
+    pthread_rwlock_rdlock(&tier->index_lock);
+    size_t count = tier->index_count;
+    disk_index_rec_t *recs = calloc(count ? count : 1, sizeof(disk_index_rec_t));
+    if (!recs) {
+        pthread_rwlock_unlock(&tier->index_lock);
+        log_error("could not allocate memory to save the disk index");
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < DISK_INDEX_BUCKETS; i++) {
+        for (disk_index_entry_t *node = tier->index[i]; node && n < count; node = node->next) {
+            recs[n].key = node->key;
+            recs[n].loc.segment = node->loc.segment;
+            recs[n].loc.offset = node->loc.offset;
+            recs[n].loc.size = node->loc.size;
+            n++;
+        }
+    }
+    pthread_rwlock_unlock(&tier->index_lock);
+
+    disk_index_hdr_t hdr = {
+        .magic = DISK_INDEX_MAGIC,
+        .num_segments = tier->num_segments,
+        .segment_size = tier->segment_size,
+        .head_offset = tier->head_offset,
+        .next_seq = tier->next_seq,
+        .count = n,
+        .head_segment = tier->head_segment,
+        .crc = crc32(0, (const Bytef *)recs, n * sizeof(disk_index_rec_t)),
+    };
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        log_error("could not create %s: %s", tmp_path, strerror(errno));
+        free(recs);
+        return;
+    }
+    int ok = pwrite_all(fd, &hdr, sizeof(hdr), 0) == 0 &&
+             pwrite_all(fd, recs, n * sizeof(disk_index_rec_t), sizeof(hdr)) == 0 &&
+             fsync(fd) == 0;
+    close(fd);
+    free(recs);
+
+    if (!ok || rename(tmp_path, path) == -1) {
+        log_error("could not save disk index to %s", path);
+        unlink(tmp_path);
+        return;
+    }
+    log_debug("saved disk index with %zu objects", n);
+}
+
+// waits up to DISK_PIN_WAIT_MS for the readers of a segment, then drops its records from the index
+// returns -1 if it is still pinned, a single slow download must not hold up every disk write
+static int recycle_segment(disk_tier_t *tier, uint32_t segment) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += DISK_PIN_WAIT_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&tier->pin_lock);
+    int timed_out = 0;
+    while (tier->segment_pins[segment] > 0 && !timed_out)
+        timed_out = pthread_cond_timedwait(&tier->pin_cond, &tier->pin_lock, &deadline) == ETIMEDOUT;
+    if (tier->segment_pins[segment] > 0) {
+        pthread_mutex_unlock(&tier->pin_lock);
+        return -1;
+    }
+    // new pins fail from here on, the generation is bumped before the lock is let go
+    index_drop_segment(tier, segment);
+    pthread_mutex_unlock(&tier->pin_lock);
+    return 0;
+}
+
+// appends a complete entry to the log at the write head
+static void write_entry(disk_tier_t *tier, cache_entry_t *entry) {
+    // only entries without a ttl are queued, one that has an expiry now was purged while waiting
+    if (entry->expires) return;
+
+    size_t url_len = strlen(entry->url);
+    uint64_t record_size = sizeof(disk_record_hdr_t) + url_len + entry->total_size;
+    if (record_size > tier->segment_size) {
+        log_debug("object %s is larger than a disk segment, not storing", entry->url);
+        return;
+    }
+
+    if (tier->head_offset + record_size > tier->segment_size) {
+        // readers still streaming from the next segment hold pins, the head stays put until they are done
+        uint32_t next = (tier->head_segment + 1) % tier->num_segments;
+        if (recycle_segment(tier, next) == -1) {
+            log_debug("disk tier segment %u is still being read, not storing %s", next, entry->url);
+            return;
+        }
+        // checkpoint before the oldest segment is overwritten, a restart then only has to roll forward
+        save_index(tier);
+        tier->head_segment = next;
+        tier->head_offset = 0;
+        log_debug("disk tier wrapped to segment %u", tier->head_segment);
+    }
+
+    int fd = tier->segment_fds[tier->head_segment];
+    off_t pos = tier->head_offset;
+
+    // complete entries are never modified, so the chunks can be walked without the entry lock
+    uLong crc = crc32(0, (const Bytef *)entry->url, url_len);
+    for (data_chunk_t *chunk = entry->data_head; chunk; chunk = chunk->next) {
+        crc = crc32(crc, chunk->data, chunk->size);
+    }
+
+    disk_record_hdr_t hdr = {
+        .magic = DISK_RECORD_MAGIC,
+        .url_len = url_len,
+        .body_len = entry->total_size,
+        .seq = tier->next_seq++,
+        .crc = crc,
+    };
+    hdr.hdr_crc = header_crc(&hdr);
+
+    if (pwrite_all(fd, &hdr, sizeof(hdr), pos) == -1) return;
+    pos += sizeof(hdr);
+    if (pwrite_all(fd, entry->url, url_len, pos) == -1) return;
+    pos += url_len;
+
+    for (data_chunk_t *chunk = entry->data_head; chunk; chunk = chunk->next) {
+        if (pwrite_all(fd, chunk->data, chunk->size, pos) == -1) return;
+        pos += chunk->size;
+    }
+
+    disk_loc_t loc = {
+        .segment = tier->head_segment,
+        .offset = tier->head_offset,
+        .size = entry->total_size,
+    };
+    tier->head_offset += record_size;
+
+    pthread_rwlock_wrlock(&tier->index_lock);
+    index_put(tier, hash_key(entry->url), &loc);
+    pthread_rwlock_unlock(&tier->index_lock);
+}
+
+static int read_record_header(disk_tier_t *tier, uint32_t segment, uint64_t offset, disk_record_hdr_t *hdr);
+
+static int purge_matches(const disk_purge_t *purge, const char *url, size_t url_len) {
+    if (purge->prefix) return url_len >= purge->len && memcmp(url, purge->key, purge->len) == 0;
+    return url_len == purge->len && memcmp(url, purge->key, url_len) == 0;
+}
+
+// drops every index entry matching the purge, the records become garbage in the log
+// the index holds no urls, so for a prefix each record's url is read back from its segment
+// the writer is the only one adding entries, so nothing new can show up while this runs
+static void apply_purge(disk_tier_t *tier, disk_purge_t *purge) {
+    size_t dropped = 0;
+    if (!purge->prefix) {
+        uint64_t key = hash_key(purge->key);
+        pthread_rwlock_wrlock(&tier->index_lock);
+        size_t before = tier->index_count;
+        index_remove(tier, key);
+        dropped = before - tier->index_count;
+        pthread_rwlock_unlock(&tier->index_lock);
+    } else {
+        disk_index_rec_t *recs = NULL;
+        size_t cap = 0;
+        for (size_t i = 0; i < DISK_INDEX_BUCKETS; i++) {
+            // the bucket is copied out so the records can be read without holding up lookups
+            size_t n = 0;
+            pthread_rwlock_rdlock(&tier->index_lock);
+            for (disk_index_entry_t *node = tier->index[i]; node; node = node->next) {
+                if (n == cap) {
+                    disk_index_rec_t *grown = realloc(recs, (cap ? cap * 2 : 16) * sizeof(disk_index_rec_t));
+                    if (!grown) break;
+                    recs = grown;
+                    cap = cap ? cap * 2 : 16;
+                }
+                recs[n].key = node->key;
+                recs[n].loc = node->loc;
+                n++;
+            }
+            pthread_rwlock_unlock(&tier->index_lock);
+
+            for (size_t j = 0; j < n; j++) {
+                disk_record_hdr_t hdr;
+                char url[MAX_URL_LENGTH];
+                if (read_record_header(tier, recs[j].loc.segment, recs[j].loc.offset, &hdr) == -1 ||
+                    pread_all(tier->segment_fds[recs[j].loc.segment], url, hdr.url_len,
+                              recs[j].loc.offset + sizeof(hdr)) == -1 ||
+                    !purge_matches(purge, url, hdr.url_len)) {
+                    continue;
+                }
+                pthread_rwlock_wrlock(&tier->index_lock);
+                index_remove(tier, recs[j].key);
+                pthread_rwlock_unlock(&tier->index_lock);
+                dropped++;
+            }
+        }
+        free(recs);
+    }
+
+    pthread_rwlock_wrlock(&tier->index_lock);
+    disk_purge_t **pp = &tier->purges;
+    while (*pp && *pp != purge)
+        pp = &(*pp)->next;
+    if (*pp)
+        *pp = purge->next;
+    pthread_rwlock_unlock(&tier->index_lock);
+
+    log_debug("disk tier purged %zu objects for %s%s", dropped, purge->key, purge->prefix ? "*" : "");
+    free(purge->key);
+    free(purge);
+}
+
+static void *writer_thread_func(void *arg) {
+    disk_tier_t *tier = (disk_tier_t *)arg;
+    int purged = 0;
+
+    while (1) {
+        pthread_mutex_lock(&tier->jobs_lock);
+        while (!tier->jobs_head && tier->writer_running) {
+            pthread_cond_wait(&tier->jobs_cond, &tier->jobs_lock);
+        }
+        disk_job_t *job = tier->jobs_head;
+        if (!job) {
+            // only reached when shutting down with an empty queue
+            pthread_mutex_unlock(&tier->jobs_lock);
+            break;
+        }
+        tier->jobs_head = job->next;
+        if (!tier->jobs_head)
+            tier->jobs_tail = NULL;
+        pthread_mutex_unlock(&tier->jobs_lock);
+
+        if (job->purge) {
+            apply_purge(tier, job->purge);
+            // a restart must not bring purged objects back, checkpoint once the burst of purges is over
+            purged = 1;
+        } else {
+            // an entry evicted while it waited is simply not written
+            cache_entry_t *entry = cache_entry_claim(job->cache, job->entry, job->hash);
+            if (entry) {
+                write_entry(tier, entry);
+                cache_entry_release(entry);
+            }
+        }
+        free(job);
+
+        if (purged && !tier->jobs_head) {
+            save_index(tier);
+            purged = 0;
+        }
+    }
+
+    return NULL;
+}
+
+// queues a complete entry to be written to disk, it is skipped if it gets evicted before the writer reaches it
+// returns 0 on success, -1 on failure
+int disk_tier_store(disk_tier_t *tier, cache_entry_t *entry) {
+    disk_job_t *job = malloc(sizeof(disk_job_t));
+    if (!job) {
+        log_error("could not allocate disk tier job");
+        return -1;
+    }
+
+    pthread_mutex_lock(&entry->lock);
+    if (entry->state != ENTRY_COMPLETE || entry->on_disk) {
+        pthread_mutex_unlock(&entry->lock);
+        free(job);
+        return -1;
+    }
+    entry->on_disk = 1;
+    pthread_mutex_unlock(&entry->lock);
+
+    job->entry = entry;
+    job->cache = entry->cache;
+    job->hash = entry->hash;
+    job->purge = NULL;
+    job->next = NULL;
+
+    pthread_mutex_lock(&tier->jobs_lock);
+    if (tier->jobs_tail)
+        tier->jobs_tail->next = job;
+    else
+        tier->jobs_head = job;
+    tier->jobs_tail = job;
+    pthread_cond_signal(&tier->jobs_cond);
+    pthread_mutex_unlock(&tier->jobs_lock);
+    return 0;
+}
+
+// drops a url, or every url under a prefix, from the tier
+// matching records are refused from now on, the index itself is cleaned up by the writer in order with queued writes
+// returns 0 on success, -1 on failure
+int disk_tier_purge(disk_tier_t *tier, const char *key, int prefix) {
+    disk_purge_t *purge = malloc(sizeof(disk_purge_t));
+    disk_job_t *job = malloc(sizeof(disk_job_t));
+    char *copy = strdup(key);
+    if (!purge || !job || !copy) {
+        free(purge);
+        free(job);
+        free(copy);
+        log_error("could not allocate disk tier purge");
+        return -1;
+    }
+    purge->key = copy;
+    purge->len = strlen(copy);
+    purge->prefix = prefix;
+
+    pthread_rwlock_wrlock(&tier->index_lock);
+    purge->next = tier->purges;
+    tier->purges = purge;
+    pthread_rwlock_unlock(&tier->index_lock);
+
+    job->entry = NULL;
+    job->cache = NULL;
+    job->hash = 0;
+    job->purge = purge;
+    job->next = NULL;
+
+    pthread_mutex_lock(&tier->jobs_lock);
+    if (tier->jobs_tail)
+        tier->jobs_tail->next = job;
+    else
+        tier->jobs_head = job;
+    tier->jobs_tail = job;
+    pthread_cond_signal(&tier->jobs_cond);
+    pthread_mutex_unlock(&tier->jobs_lock);
+    return 0;
+}
+
+// returns 0 and fills loc and the segment generation if the url is in the index, -1 otherwise
+static int index_lookup(disk_tier_t *tier, const char *url, disk_loc_t *loc, uint64_t *gen) {
+    uint64_t key = hash_key(url);
+    int ret = -1;
+
+    pthread_rwlock_rdlock(&tier->index_lock);
+    for (disk_index_entry_t *node = tier->index[key % DISK_INDEX_BUCKETS]; node; node = node->next) {
+        if (node->key == key) {
+            *loc = node->loc;
+            *gen = tier->segment_gens[loc->segment];
+            ret = 0;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&tier->index_lock);
+    return ret;
+}
+
+// keeps the writer from wrapping into a segment while somebody reads from it
+// fails if the segment was recycled since gen was observed
+static int pin_segment(disk_tier_t *tier, uint32_t segment, uint64_t gen) {
+    int ret = -1;
+    pthread_mutex_lock(&tier->pin_lock);
+    if (tier->segment_gens[segment] == gen) {
+        tier->segment_pins[segment]++;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&tier->pin_lock);
+    return ret;
+}
+
+static void unpin_segment(disk_tier_t *tier, uint32_t segment) {
+    pthread_mutex_lock(&tier->pin_lock);
+    if (--tier->segment_pins[segment] == 0)
+        pthread_cond_broadcast(&tier->pin_cond);
+    pthread_mutex_unlock(&tier->pin_lock);
+}
+
+// looks the url up and pins its segment so the record stays intact until disk_tier_close
+// the url stored in the record is compared to guard against hash collisions
+// returns 0 and fills the handle on success, -1 if the url is not on disk
+int disk_tier_open(disk_tier_t *tier, const char *url, disk_handle_t *handle) {
+    disk_loc_t loc;
+    uint64_t gen;
+    if (index_lookup(tier, url, &loc, &gen) == -1 || pin_segment(tier, loc.segment, gen) == -1) {
+        return -1;
+    }
+
+    int fd = tier->segment_fds[loc.segment];
+    size_t url_len = strlen(url);
+
+    disk_record_hdr_t hdr;
+    char stored_url[MAX_URL_LENGTH];
+    if (pread_all(fd, &hdr, sizeof(hdr), loc.offset) == -1 ||
+        hdr.magic != DISK_RECORD_MAGIC || hdr.hdr_crc != header_crc(&hdr) ||
+        hdr.url_len != url_len || hdr.body_len != loc.size || url_len >= sizeof(stored_url) ||
+        pread_all(fd, stored_url, url_len, loc.offset + sizeof(hdr)) == -1 ||
+        memcmp(stored_url, url, url_len) != 0) {
+        log_debug("disk tier record for %s does not match the index", url);
+        unpin_segment(tier, loc.segment);
+        return -1;
+    }
+
+    int purged = 0;
+    pthread_rwlock_rdlock(&tier->index_lock);
+    for (disk_purge_t *purge = tier->purges; purge && !purged; purge = purge->next)
+        purged = purge_matches(purge, url, url_len);
+    pthread_rwlock_unlock(&tier->index_lock);
+    if (purged) {
+        unpin_segment(tier, loc.segment);
+        return -1;
+    }
+
+    handle->fd = fd;
+    handle->segment = loc.segment;
+    handle->body_offset = loc.offset + sizeof(hdr) + url_len;
+    handle->size = loc.size;
+    handle->crc = hdr.crc;
+    return 0;
+}
+
+void disk_tier_close(disk_tier_t *tier, disk_handle_t *handle) {
+    if (handle->fd < 0) return;
+    unpin_segment(tier, handle->segment);
+    handle->fd = -1;
+}
+
+// reads the whole body of an open record into buf, which must hold at least handle->size bytes
+// returns the number of bytes read or -1 on failure
+ssize_t disk_tier_read(disk_tier_t *tier, const disk_handle_t *handle, const char *url, void *buf) {
+    if (pread_all(handle->fd, buf, handle->size, handle->body_offset) == -1) return -1;
+
+    uLong crc = crc32(crc32(0, (const Bytef *)url, strlen(url)), buf, handle->size);
+    if (crc != handle->crc) {
+        log_warn("disk tier record for %s is corrupted, dropping it", url);
+        disk_tier_forget(tier, url);
+        return -1;
+    }
+    return handle->size;
+}
+
+// removes a url from the index, its record becomes garbage in the log
+void disk_tier_forget(disk_tier_t *tier, const char *url) {
+    pthread_rwlock_wrlock(&tier->index_lock);
+    index_remove(tier, hash_key(url));
+    pthread_rwlock_unlock(&tier->index_lock);
+}
+
+// reads and validates the record header at offset, returns 0 if it is a sane record
+static int read_record_header(disk_tier_t *tier, uint32_t segment, uint64_t offset, disk_record_hdr_t *hdr) {
+    if (offset + sizeof(*hdr) > tier->segment_size) return -1;
+    if (pread_all(tier->segment_fds[segment], hdr, sizeof(*hdr), offset) == -1) return -1;
+    if (hdr->magic != DISK_RECORD_MAGIC || hdr->hdr_crc != header_crc(hdr)) return -1;
+    if (hdr->url_len == 0 || hdr->url_len >= MAX_URL_LENGTH) return -1;
+    if (offset + sizeof(*hdr) + hdr->url_len + hdr->body_len > tier->segment_size) return -1;
+    return 0;
+}
+
+// streams the url and body of a record through crc32 and compares the result to the header
+// returns 0 if the record made it to disk whole
+static int record_intact(disk_tier_t *tier, uint32_t segment, uint64_t offset, const disk_record_hdr_t *hdr) {
+    uint8_t buf[DISK_VERIFY_CHUNK];
+    uint64_t pos = offset + sizeof(*hdr);
+    uint64_t left = hdr->url_len + hdr->body_len;
+    uLong crc = crc32(0, NULL, 0);
+    while (left > 0) {
+        size_t len = left < sizeof(buf) ? left : sizeof(buf);
+        if (pread_all(tier->segment_fds[segment], buf, len, pos) == -1) return -1;
+        crc = crc32(crc, buf, len);
+        pos += len;
+        left -= len;
+    }
+    return crc == hdr->crc ? 0 : -1;
+}
+
+// replays records written after the last index checkpoint
+// starts at the saved head and follows the log into the next segments as long as sequence numbers keep growing,
+// every body is checked against its checksum first, large records are later served from the segment unchecked
+static size_t roll_forward(disk_tier_t *tier, uint32_t segment, uint64_t offset, uint64_t last_seq) {
+    size_t replayed = 0;
+    for (uint32_t visited = 0; visited < tier->num_segments; visited++) {
+        disk_record_hdr_t hdr;
+        if (offset == 0) {
+            // only continue into a segment the writer actually wrapped into
+            if (read_record_header(tier, segment, 0, &hdr) == -1 || hdr.seq < last_seq) break;
+            index_drop_segment(tier, segment);
+        }
+
+        while (read_record_header(tier, segment, offset, &hdr) == 0 && hdr.seq >= last_seq) {
+            char url[MAX_URL_LENGTH];
+            if (pread_all(tier->segment_fds[segment], url, hdr.url_len, offset + sizeof(hdr)) == -1) break;
+            url[hdr.url_len] = '\0';
+
+            // a header that reached the disk before its body is left out, the records after it are still fine
+            if (record_intact(tier, segment, offset, &hdr) == 0) {
+                disk_loc_t loc = {.segment = segment, .offset = offset, .size = hdr.body_len};
+                pthread_rwlock_wrlock(&tier->index_lock);
+                index_put(tier, hash_key(url), &loc);
+                pthread_rwlock_unlock(&tier->index_lock);
+                replayed++;
+            } else {
+                log_warn("disk tier record for %s was torn by a crash, dropping it", url);
+            }
+
+            offset += sizeof(hdr) + hdr.url_len + hdr.body_len;
+            last_seq = hdr.seq + 1;
+        }
+
+        tier->head_segment = segment;
+        tier->head_offset = offset;
+        tier->next_seq = last_seq;
+
+        segment = (segment + 1) % tier->num_segments;
+        offset = 0;
+    }
+    return replayed;
+}
+
+// maps index.dat and fills the in-memory index from it
+// returns 0 on success, -1 if there is no usable index
+static int load_index(disk_tier_t *tier) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", tier->dir, DISK_INDEX_FILE);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        log_info("no disk index in %s, scanning segments", tier->dir);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(disk_index_hdr_t)) {
+        close(fd);
+        log_warn("disk index %s is truncated", path);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_error("could not map disk index %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    const disk_index_hdr_t *hdr = map;
+    const disk_index_rec_t *recs = (const disk_index_rec_t *)(hdr + 1);
+    int ret = -1;
+    if (hdr->magic != DISK_INDEX_MAGIC || hdr->num_segments != tier->num_segments ||
+        hdr->segment_size != tier->segment_size || hdr->head_segment >= tier->num_segments) {
+        log_warn("disk index %s does not match the configured segments", path);
+    } else if (sizeof(*hdr) + hdr->count * sizeof(disk_index_rec_t) != (size_t)st.st_size ||
+               crc32(0, (const Bytef *)recs, hdr->count * sizeof(disk_index_rec_t)) != hdr->crc) {
+        log_warn("disk index %s is corrupted", path);
+    } else {
+        pthread_rwlock_wrlock(&tier->index_lock);
+        for (uint64_t i = 0; i < hdr->count; i++) {
+            if (recs[i].loc.segment < tier->num_segments) {
+                index_put(tier, recs[i].key, &recs[i].loc);
+            }
+        }
+        pthread_rwlock_unlock(&tier->index_lock);
+
+        tier->head_segment = hdr->head_segment;
+        tier->head_offset = hdr->head_offset;
+        tier->next_seq = hdr->next_seq;
+        ret = 0;
+    }
+
+    munmap(map, st.st_size);
+    return ret;
+}
+
+// restores the index from the last checkpoint plus whatever was appended after it,
+// or from the segments alone if there is no checkpoint
+static void recover(disk_tier_t *tier) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t replayed;
+    if (load_index(tier) == 0) {
+        replayed = roll_forward(tier, tier->head_segment, tier->head_offset, tier->next_seq);
+    } else {
+        // the log starts at the segment holding the oldest first record
+        uint32_t oldest = 0;
+        uint64_t oldest_seq = UINT64_MAX;
+        for (uint32_t i = 0; i < tier->num_segments; i++) {
+            disk_record_hdr_t hdr;
+            if (read_record_header(tier, i, 0, &hdr) == 0 && hdr.seq < oldest_seq) {
+                oldest_seq = hdr.seq;
+                oldest = i;
+            }
+        }
+        replayed = oldest_seq == UINT64_MAX ? 0 : roll_forward(tier, oldest, 0, oldest_seq);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    log_info("disk tier recovered %zu objects (%zu replayed from the log) in %ld ms",
+             tier->index_count, replayed, ms);
+}
+
+disk_tier_t* disk_tier_init(const char *dir, size_t capacity) {
+    disk_tier_t *tier = calloc(1, sizeof(disk_tier_t));
+    if (!tier) {
+        log_fatal("could not allocate disk tier");
+        return NULL;
+    }
+
+    tier->segment_size = DISK_SEGMENT_SIZE;
+    if (capacity < DISK_MIN_SEGMENTS * DISK_SEGMENT_SIZE)
+        tier->segment_size = capacity / DISK_MIN_SEGMENTS;
+    if (tier->segment_size == 0) {
+        log_fatal("disk tier capacity %zu is too small", capacity);
+        free(tier);
+        return NULL;
+    }
+    tier->num_segments = capacity / tier->segment_size;
+
+    tier->dir = strdup(dir);
+    tier->segment_fds = malloc(tier->num_segments * sizeof(int));
+    tier->segment_pins = calloc(tier->num_segments, sizeof(uint32_t));
+    tier->segment_gens = calloc(tier->num_segments, sizeof(uint64_t));
+    tier->index = calloc(DISK_INDEX_BUCKETS, sizeof(disk_index_entry_t *));
+    if (!tier->dir || !tier->segment_fds || !tier->segment_pins || !tier->segment_gens || !tier->index) {
+        log_fatal("could not allocate disk tier tables");
+        free(tier->dir);
+        free(tier->segment_fds);
+        free(tier->segment_pins);
+        free(tier->segment_gens);
+        free(tier->index);
+        free(tier);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < tier->num_segments; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/segment-%04u.dat", dir, i);
+
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        int err = fd == -1 ? errno : posix_fallocate(fd, 0, tier->segment_size);
+        if (err != 0) {
+            log_fatal("could not prepare disk segment %s: %s", path, strerror(err));
+            if (fd != -1) close(fd);
+            for (uint32_t j = 0; j < i; j++) close(tier->segment_fds[j]);
+            free(tier->dir);
+            free(tier->segment_fds);
+            free(tier->segment_pins);
+            free(tier->segment_gens);
+            free(tier->index);
+            free(tier);
+            return NULL;
+        }
+        tier->segment_fds[i] = fd;
+    }
+
+    pthread_rwlock_init(&tier->index_lock, NULL);
+    pthread_mutex_init(&tier->jobs_lock, NULL);
+    pthread_cond_init(&tier->jobs_cond, NULL);
+    pthread_mutex_init(&tier->pin_lock, NULL);
+    pthread_cond_init(&tier->pin_cond, NULL);
+
+    recover(tier);
+
+    tier->writer_running = 1;
+
+    if (pthread_create(&tier->writer_thread, NULL, writer_thread_func, tier) != 0) {
+        log_fatal("failed to create disk tier writer thread");
+        tier->writer_running = 0;
+        disk_tier_shutdown(&tier);
+        return NULL;
+    }
+
+    log_info("disk tier ready in %s: %u segments of %lu bytes", dir, tier->num_segments, tier->segment_size);
+    return tier;
+}
+
+// flushes queued entries, stops the writer, persists the index and frees it
+// must be called before the cache entries themselves are destroyed
+void disk_tier_shutdown(disk_tier_t **tier_ptr) {
+    if (!tier_ptr || !*tier_ptr) {
+        return;
+    }
+    disk_tier_t *tier = *tier_ptr;
+
+    if (tier->writer_running) {
+        pthread_mutex_lock(&tier->jobs_lock);
+        tier->writer_running = 0;
+        pthread_cond_signal(&tier->jobs_cond);
+        pthread_mutex_unlock(&tier->jobs_lock);
+        pthread_join(tier->writer_thread, NULL);
+        save_index(tier);
+    }
+
+    for (size_t i = 0; i < DISK_INDEX_BUCKETS; i++) {
+        disk_index_entry_t *node = tier->index[i];
+        while (node) {
+            disk_index_entry_t *next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+    for (uint32_t i = 0; i < tier->num_segments; i++) {
+        close(tier->segment_fds[i]);
+    }
+
+    pthread_rwlock_destroy(&tier->index_lock);
+    pthread_mutex_destroy(&tier->jobs_lock);
+    pthread_cond_destroy(&tier->jobs_cond);
+    pthread_mutex_destroy(&tier->pin_lock);
+    pthread_cond_destroy(&tier->pin_cond);
+    free(tier->index);
+    free(tier->segment_fds);
+    free(tier->segment_pins);
+    free(tier->segment_gens);
+    free(tier->dir);
+    free(tier);
+    *tier_ptr = NULL;
+
+    log_info("disk tier shutdown successfully");
+}
@@ -0,0 +1,126 @@
+#ifndef DISK_TIER_H
+#define DISK_TIER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "httpcache.h"
+
+#define DISK_SEGMENT_SIZE (256UL * 1024 * 1024) // 256MB per segment file
+#define DISK_MIN_SEGMENTS 2
+#define DISK_INDEX_BUCKETS 65536
+#define DISK_RECORD_MAGIC 0x48434432u // "HCD2"
+#define DISK_INDEX_MAGIC 0x48434958u  // "HCIX"
+#define DISK_INDEX_FILE "index.dat"
+#define DISK_VERIFY_CHUNK (64 * 1024) // bytes of a replayed record checksummed at a time
+#define DISK_PIN_WAIT_MS 50 // the writer waits this long for readers of the segment it wraps into, then skips the object
+
+// on-disk record layout: header, url bytes, body bytes
+typedef struct _disk_record_hdr_t {
+    uint32_t magic;
+    uint32_t url_len;
+    uint64_t body_len;
+    uint64_t seq;      // write sequence number, strictly increasing across the log
+    uint32_t crc;      // crc32 of url and body
+    uint32_t hdr_crc;  // crc32 of the fields above
+} disk_record_hdr_t;
+
+// where an object lives in the segment files
+typedef struct _disk_loc_t {
+    uint32_t segment;
+    uint64_t offset;   // offset of the record header inside the segment
+    uint64_t size;     // body size
+} disk_loc_t;
+
+// persisted index file layout: header followed by count records
+typedef struct _disk_index_hdr_t {
+    uint32_t magic;
+    uint32_t num_segments;
+    uint64_t segment_size;
+    uint64_t head_offset;
+    uint64_t next_seq;
+    uint64_t count;
+    uint32_t head_segment;
+    uint32_t crc;      // crc32 of the records
+} disk_index_hdr_t;
+
+typedef struct _disk_index_rec_t {
+    uint64_t key;
+    disk_loc_t loc;
+} disk_index_rec_t;
+
+// compact index node, the url itself is only stored on disk
+typedef struct _disk_index_entry_t {
+    uint64_t key;
+    disk_loc_t loc;
+    struct _disk_index_entry_t *next;
+} disk_index_entry_t;
+
+// an open record, its segment is pinned until disk_tier_close
+typedef struct _disk_handle_t {
+    int fd;
+    uint32_t segment;
+    off_t body_offset;
+    uint64_t size;
+    uint32_t crc;
+} disk_handle_t;
+
+// a purge the writer has not finished yet, matching records are refused by disk_tier_open until it has
+typedef struct _disk_purge_t {
+    char *key;
+    size_t len;
+    int prefix;        // every url starting with key, otherwise exactly key
+    struct _disk_purge_t *next;
+} disk_purge_t;
+
+// entries waiting to be written out by the writer thread, or a purge to carry out in order with them
+// like a compaction job it holds no reference, the entry is claimed from its bucket when the job runs
+typedef struct _disk_job_t {
+    cache_entry_t *entry;
+    http_cache_t *cache;
+    uint32_t hash;
+    disk_purge_t *purge;
+    struct _disk_job_t *next;
+} disk_job_t;
+
+typedef struct disk_tier {
+    char *dir;
+    int *segment_fds;
+    uint32_t num_segments;
+    uint64_t segment_size;
+
+    // write head, only touched by the writer thread once it is running
+    uint32_t head_segment;
+    uint64_t head_offset;
+    uint64_t next_seq;
+
+    disk_index_entry_t **index;
+    size_t index_count;
+    pthread_rwlock_t index_lock;
+    disk_purge_t *purges;         // pending purges, under index_lock
+
+    // readers pin segments, the writer waits for a segment to be unpinned before recycling it
+    uint32_t *segment_pins;
+    uint64_t *segment_gens;       // bumped on every recycle, under index_lock
+    pthread_mutex_t pin_lock;
+    pthread_cond_t pin_cond;
+
+    disk_job_t *jobs_head;
+    disk_job_t *jobs_tail;
+    pthread_mutex_t jobs_lock;
+    pthread_cond_t jobs_cond;
+    pthread_t writer_thread;
+    volatile int writer_running;
+} disk_tier_t;
+
+disk_tier_t* disk_tier_init(const char *dir, size_t capacity);
+void disk_tier_shutdown(disk_tier_t **tier);
+int disk_tier_store(disk_tier_t *tier, cache_entry_t *entry);
+int disk_tier_open(disk_tier_t *tier, const char *url, disk_handle_t *handle);
+ssize_t disk_tier_read(disk_tier_t *tier, const disk_handle_t *handle, const char *url, void *buf);
+void disk_tier_close(disk_tier_t *tier, disk_handle_t *handle);
+void disk_tier_forget(disk_tier_t *tier, const char *url);
+int disk_tier_purge(disk_tier_t *tier, const char *key, int prefix);
+
+#endif // DISK_TIER_H
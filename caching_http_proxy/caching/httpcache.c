@@ -1,20 +1,54 @@
+#define _GNU_SOURCE
 #include "httpcache.h"
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <unistd.h>
 #include <asm-generic/errno.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "arena.h"
+#include "compress.h"
+#include "disktier.h"
+#include "memwatch.h"
+#include "numa.h"
+#include "shmtier.h"
+
+// only whole extents go to the arena, a short tail would waste most of its slot
+static uint8_t *alloc_body(http_cache_t *cache, size_t size) {
+    uint8_t *data = cache->arena && size == COMPACT_EXTENT_SIZE ? arena_alloc(cache->arena) : NULL;
+    return data ? data : malloc(size ? size : 1);
+}
 
-// it is the caller's responsibility to avoid race conditions while using this function
-static void free_entry_data(cache_entry_t *entry) {
-    data_chunk_t *chunk = entry->data_head;
+static void free_body(http_cache_t *cache, uint8_t *data) {
+    if (data && cache->arena && arena_owns(cache->arena, data))
+        arena_free(cache->arena, data);
+    else
+        free(data);
+}
+
+static void free_chunks(http_cache_t *cache, data_chunk_t *chunk) {
     while (chunk) {
         data_chunk_t *next = chunk->next;
-        free(chunk->data);
+        free_body(cache, chunk->data);
         free(chunk);
         chunk = next;
     }
 }
 
-static uint32_t hash_url(const char *url) {
+// it is the caller's responsibility to avoid race conditions while using this function
+static void free_entry_data(cache_entry_t *entry) {
+    free_chunks(entry->cache, entry->data_head);
+}
+
+uint32_t cache_hash_url(const char *url) {
     uint32_t hash = 2166136261u;
     while (*url) {
         hash ^= (uint8_t)*url++;
@@ -50,138 +84,662 @@ static void lru_add_head(http_cache_t *cache, cache_entry_t *entry) {
         cache->lru_tail = entry;
 }
 
-static void remove_entry(http_cache_t* cache, cache_entry_t *entry) {
-    pthread_mutex_lock(&entry->lock);
-    cache_entry_t *to_evict = entry;
-    if (to_evict->refcount > 0) {
-        pthread_mutex_unlock(&entry->lock);
-        return;;
+// GDSF priority queue, caller holds lru_lock ======================================================================
+
+// H = L + frequency * cost / size, L is the priority of the last evicted entry so old favourites age out
+static double gdsf_priority(http_cache_t *cache, cache_entry_t *entry) {
+    size_t size = entry->total_size ? entry->total_size : 1;
+    return cache->gdsf_clock + entry->hits * entry->fetch_cost / (double)size;
+}
+
+static void gdsf_swap(http_cache_t *cache, size_t i, size_t j) {
+    cache_entry_t *tmp = cache->gdsf_heap[i];
+    cache->gdsf_heap[i] = cache->gdsf_heap[j];
+    cache->gdsf_heap[j] = tmp;
+    cache->gdsf_heap[i]->policy_idx = i;
+    cache->gdsf_heap[j]->policy_idx = j;
+}
+
+static void gdsf_sift_up(http_cache_t *cache, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (cache->gdsf_heap[parent]->priority <= cache->gdsf_heap[i]->priority) break;
+        gdsf_swap(cache, i, parent);
+        i = parent;
     }
+}
 
-    pthread_mutex_lock(&cache->lru_lock);
-    // Remove from LRU list
-    lru_remove(cache, to_evict);
-    pthread_mutex_unlock(&cache->lru_lock);
+static void gdsf_sift_down(http_cache_t *cache, size_t i) {
+    while (1) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1, right = 2 * i + 2;
+        if (left < cache->gdsf_len && cache->gdsf_heap[left]->priority < cache->gdsf_heap[smallest]->priority)
+            smallest = left;
+        if (right < cache->gdsf_len && cache->gdsf_heap[right]->priority < cache->gdsf_heap[smallest]->priority)
+            smallest = right;
+        if (smallest == i) break;
+        gdsf_swap(cache, i, smallest);
+        i = smallest;
+    }
+}
 
-    uint32_t bucket_idx = hash_url(to_evict->url) % cache->num_buckets;
-    pthread_mutex_lock(&cache->buckets[bucket_idx].lock);
+// entries still referenced or being filled cannot be evicted
+// references are taken under the bucket lock, so the evictor checks again once it holds that
+static int is_idle(cache_entry_t *entry) {
+    return atomic_load(&entry->refcount) == 0 && atomic_load(&entry->state) != ENTRY_INCOMPLETE;
+}
+
+// returns the idle entry with the lowest priority without disturbing the heap, NULL if every entry is busy
+// walks the heap best first, past GDSF_SCAN_DEPTH busy nodes the rest of the heap is scanned in one pass instead
+static cache_entry_t *gdsf_victim(http_cache_t *cache) {
+    size_t frontier[GDSF_SCAN_DEPTH + 1];
+    size_t len = cache->gdsf_len ? 1 : 0;
+    frontier[0] = 0;
+    for (size_t steps = 0; len > 0 && steps < GDSF_SCAN_DEPTH; steps++) {
+        size_t best = 0;
+        for (size_t i = 1; i < len; i++) {
+            if (cache->gdsf_heap[frontier[i]]->priority < cache->gdsf_heap[frontier[best]]->priority)
+                best = i;
+        }
+        size_t idx = frontier[best];
+        if (is_idle(cache->gdsf_heap[idx])) return cache->gdsf_heap[idx];
+        frontier[best] = frontier[--len];
+        if (2 * idx + 1 < cache->gdsf_len) frontier[len++] = 2 * idx + 1;
+        if (2 * idx + 2 < cache->gdsf_len) frontier[len++] = 2 * idx + 2;
+    }
+    if (len == 0) return NULL;
+
+    cache_entry_t *victim = NULL;
+    for (size_t i = 0; i < cache->gdsf_len; i++) {
+        cache_entry_t *entry = cache->gdsf_heap[i];
+        if (is_idle(entry) && (!victim || entry->priority < victim->priority))
+            victim = entry;
+    }
+    return victim;
+}
+
+// replacement policy, caller holds lru_lock =========================================================================
+
+static void policy_add(http_cache_t *cache, cache_entry_t *entry) {
+    if (cache->policy == CACHE_POLICY_LRU) {
+        lru_add_head(cache, entry);
+        return;
+    }
+    if (cache->gdsf_len == cache->gdsf_cap) {
+        size_t new_cap = cache->gdsf_cap ? cache->gdsf_cap * 2 : 256;
+        cache_entry_t **heap = realloc(cache->gdsf_heap, new_cap * sizeof(cache_entry_t *));
+        if (!heap) {
+            log_error("could not grow the GDSF heap, %s will never be evicted", entry->url);
+            return;
+        }
+        cache->gdsf_heap = heap;
+        cache->gdsf_cap = new_cap;
+    }
+    entry->priority = gdsf_priority(cache, entry);
+    entry->policy_idx = cache->gdsf_len;
+    cache->gdsf_heap[cache->gdsf_len++] = entry;
+    gdsf_sift_up(cache, entry->policy_idx);
+}
+
+static void policy_remove(http_cache_t *cache, cache_entry_t *entry) {
+    if (cache->policy == CACHE_POLICY_LRU) {
+        lru_remove(cache, entry);
+        return;
+    }
+    if (entry->policy_idx < 0) return;
+    size_t i = entry->policy_idx;
+    cache->gdsf_len--;
+    if (i != cache->gdsf_len) {
+        gdsf_swap(cache, i, cache->gdsf_len);
+        gdsf_sift_up(cache, i);
+        gdsf_sift_down(cache, i);
+    }
+    entry->policy_idx = -1;
+}
 
-    // Remove from hash bucket
-    cache_entry_t **pp = &cache->buckets[bucket_idx].entries;
-    while (*pp && *pp != to_evict)
+// re-keys the entry after a hit (hit = 1) or after its size or cost changed (hit = 0)
+static void policy_update(http_cache_t *cache, cache_entry_t *entry, int hit) {
+    if (cache->policy == CACHE_POLICY_LRU) {
+        if (!hit) return;
+        lru_remove(cache, entry);
+        lru_add_head(cache, entry);
+        return;
+    }
+    if (entry->policy_idx < 0) return;
+    entry->hits += hit;
+    entry->priority = gdsf_priority(cache, entry);
+    gdsf_sift_up(cache, entry->policy_idx);
+    gdsf_sift_down(cache, entry->policy_idx);
+}
+
+// the next eviction candidate, busy entries are passed over in the same walk
+static cache_entry_t *policy_victim(http_cache_t *cache) {
+    if (cache->policy == CACHE_POLICY_LRU) {
+        cache_entry_t *victim = cache->lru_tail;
+        while (victim && !is_idle(victim))
+            victim = victim->lru_prev;
+        return victim;
+    }
+    return gdsf_victim(cache);
+}
+
+// sweep heap management, caller holds collector_lock =============================================================
+
+static void sweep_swap(http_cache_t *cache, size_t i, size_t j) {
+    cache_entry_t *tmp = cache->sweep_heap[i];
+    cache->sweep_heap[i] = cache->sweep_heap[j];
+    cache->sweep_heap[j] = tmp;
+    cache->sweep_heap[i]->sweep_idx = i;
+    cache->sweep_heap[j]->sweep_idx = j;
+}
+
+static void sweep_sift_up(http_cache_t *cache, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (cache->sweep_heap[parent]->sweep_at <= cache->sweep_heap[i]->sweep_at) break;
+        sweep_swap(cache, i, parent);
+        i = parent;
+    }
+}
+
+static void sweep_sift_down(http_cache_t *cache, size_t i) {
+    while (1) {
+        size_t smallest = i;
+        size_t left = 2 * i + 1, right = 2 * i + 2;
+        if (left < cache->sweep_len && cache->sweep_heap[left]->sweep_at < cache->sweep_heap[smallest]->sweep_at)
+            smallest = left;
+        if (right < cache->sweep_len && cache->sweep_heap[right]->sweep_at < cache->sweep_heap[smallest]->sweep_at)
+            smallest = right;
+        if (smallest == i) break;
+        sweep_swap(cache, i, smallest);
+        i = smallest;
+    }
+}
+
+static void sweep_remove_locked(http_cache_t *cache, cache_entry_t *entry) {
+    if (entry->sweep_idx < 0) return;
+    size_t i = entry->sweep_idx;
+    cache->sweep_len--;
+    if (i != cache->sweep_len) {
+        sweep_swap(cache, i, cache->sweep_len);
+        sweep_sift_up(cache, i);
+        sweep_sift_down(cache, i);
+    }
+    entry->sweep_idx = -1;
+}
+
+static void sweep_schedule_locked(http_cache_t *cache, cache_entry_t *entry, time_t when) {
+    if (entry->sweep_idx < 0) {
+        if (cache->sweep_len == cache->sweep_cap) {
+            size_t new_cap = cache->sweep_cap ? cache->sweep_cap * 2 : 256;
+            cache_entry_t **heap = realloc(cache->sweep_heap, new_cap * sizeof(cache_entry_t *));
+            if (!heap) {
+                log_error("could not grow the sweep heap, %s is left to LRU eviction", entry->url);
+                return;
+            }
+            cache->sweep_heap = heap;
+            cache->sweep_cap = new_cap;
+        }
+        entry->sweep_idx = cache->sweep_len;
+        cache->sweep_heap[cache->sweep_len++] = entry;
+    }
+    entry->sweep_at = when;
+    sweep_sift_up(cache, entry->sweep_idx);
+    sweep_sift_down(cache, entry->sweep_idx);
+}
+
+// asks the collector to look at the entry at the given time, wakes it up if that is earlier than anything else
+static void sweep_schedule(http_cache_t *cache, cache_entry_t *entry, time_t when) {
+    pthread_mutex_lock(&cache->collector_lock);
+    sweep_schedule_locked(cache, entry, when);
+    if (entry->sweep_idx == 0)
+        pthread_cond_signal(&cache->collector_cond);
+    pthread_mutex_unlock(&cache->collector_lock);
+}
+
+static void sweep_unschedule(http_cache_t *cache, cache_entry_t *entry) {
+    pthread_mutex_lock(&cache->collector_lock);
+    sweep_remove_locked(cache, entry);
+    pthread_mutex_unlock(&cache->collector_lock);
+}
+
+// =================================================================================================================
+
+static void destroy_entry(cache_entry_t *entry) {
+    pthread_mutex_destroy(&entry->lock);
+    free_entry_data(entry);
+    free(entry);
+}
+
+// invalidates every per-worker copy of urls hashing to the same generation slot
+// caller must hold the bucket lock
+static void bump_generation(http_cache_t *cache, uint32_t hash) {
+    atomic_fetch_add_explicit(&cache->generations[hash % CACHE_GENERATION_SLOTS], 1, memory_order_release);
+}
+
+// returns the generation of url, copies of it taken while this stays unchanged are still current
+uint64_t cache_generation(http_cache_t *cache, uint32_t hash) {
+    return atomic_load_explicit(&cache->generations[hash % CACHE_GENERATION_SLOTS], memory_order_acquire);
+}
+
+// unlinks an unused entry from its bucket and the LRU list
+// caller must hold the bucket lock, the entry is freed afterwards by the caller
+static void detach_entry(http_cache_t *cache, cache_bucket_t *bucket, cache_entry_t *entry) {
+    cache_entry_t **pp = &bucket->entries;
+    while (*pp && *pp != entry)
         pp = &(*pp)->next;
     if (*pp)
-        *pp = to_evict->next;
+        *pp = entry->next;
+
+    if (entry->indexed) {
+        pthread_mutex_lock(&cache->keys_lock);
+        radix_remove(&cache->keys, entry->url);
+        pthread_mutex_unlock(&cache->keys_lock);
+        entry->indexed = 0;
+    }
+
+    pthread_mutex_lock(&cache->lru_lock);
+    policy_remove(cache, entry);
+    pthread_mutex_unlock(&cache->lru_lock);
 
-    // Update size atomically
     pthread_mutex_lock(&cache->size_lock);
-    cache->current_size -= to_evict->total_size;
+    cache->current_size -= entry->total_size;
     pthread_mutex_unlock(&cache->size_lock);
 
-    pthread_mutex_unlock(&cache->buckets[bucket_idx].lock);
-
-    // Free the entry
-    pthread_mutex_destroy(&to_evict->lock);
-    pthread_cond_destroy(&to_evict->data_ready);
-    free_entry_data(to_evict);
-    free(to_evict);
+    sweep_unschedule(cache, entry);
+    bump_generation(cache, entry->hash);
 }
 
-// dont use this without rewriting it
+// evicts least recently used entries until required_size more bytes fit into max_size
+// entries that are still referenced or being filled are skipped
 static void evict_lru_entries(http_cache_t *cache, size_t required_size) {
     while (1) {
-        size_t current_size;
+        size_t current_size, max_size;
         pthread_mutex_lock(&cache->size_lock);
         current_size = cache->current_size;
+        max_size = cache->max_size;
         pthread_mutex_unlock(&cache->size_lock);
 
-        if (current_size + required_size <= cache->max_size) {
+        if (current_size + required_size <= max_size) {
             return;
         }
 
+        // the victim stays alive while it is on the LRU list, so only its hash is taken out of the lock
         pthread_mutex_lock(&cache->lru_lock);
-        if (!cache->lru_tail) {
+        cache_entry_t *victim = policy_victim(cache);
+        if (!victim) {
             pthread_mutex_unlock(&cache->lru_lock);
+            log_warn("cache is over its size limit but every entry is in use");
             return;
         }
+        uint32_t bucket_idx = victim->hash % cache->num_buckets;
+        pthread_mutex_unlock(&cache->lru_lock);
 
-        cache_entry_t *to_evict = cache->lru_tail;
-        if (to_evict->refcount > 0) {
-            if (to_evict->lru_prev == NULL) {
-                pthread_mutex_unlock(&cache->lru_lock);
-                return;
-            }
-            cache->lru_tail = to_evict->lru_prev;
-            cache->lru_tail->lru_next = NULL;
-            pthread_mutex_unlock(&cache->lru_lock);
+        cache_bucket_t *bucket = &cache->buckets[bucket_idx];
+        pthread_mutex_lock(&bucket->lock);
+
+        // make sure nobody freed it in between
+        cache_entry_t *entry = bucket->entries;
+        while (entry && entry != victim)
+            entry = entry->next;
+        if (!entry) {
+            pthread_mutex_unlock(&bucket->lock);
+            continue;
+        }
+
+        // new references are only taken under the bucket lock, so a zero refcount stays zero here
+        // one taken since the victim was picked sends the walk around again, which now passes it over
+        if (!is_idle(entry)) {
+            pthread_mutex_unlock(&bucket->lock);
             continue;
         }
 
-        // Remove from LRU list
-        lru_remove(cache, to_evict);
+        detach_entry(cache, bucket, entry);
+        pthread_mutex_unlock(&bucket->lock);
+
+        // inflate the GDSF clock, whatever stays has to earn its place against the newcomers
+        pthread_mutex_lock(&cache->lru_lock);
+        if (entry->priority > cache->gdsf_clock)
+            cache->gdsf_clock = entry->priority;
         pthread_mutex_unlock(&cache->lru_lock);
 
-        uint32_t bucket_idx = hash_url(to_evict->url) % cache->num_buckets;
-        pthread_mutex_lock(&cache->buckets[bucket_idx].lock);
+        log_debug("evicted %s (%zu bytes)", entry->url, entry->total_size);
+        destroy_entry(entry);
+    }
+}
 
-        // Remove from hash bucket
-        cache_entry_t **pp = &cache->buckets[bucket_idx].entries;
-        while (*pp && *pp != to_evict)
-            pp = &(*pp)->next;
-        if (*pp)
-            *pp = to_evict->next;
+// wakes up readers sleeping in cache_entry_read and fires the watchers of parked readers
+// both are skipped when nobody waits
+static void publish(cache_entry_t *entry) {
+    atomic_fetch_add(&entry->publish_seq, 1);
+    if (atomic_load(&entry->waiters) > 0) {
+        syscall(SYS_futex, &entry->publish_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+    if (atomic_load(&entry->watchers)) {
+        // watchers are one-shot, the lock keeps their owners from freeing them under us
+        pthread_mutex_lock(&entry->lock);
+        cache_watcher_t *watcher = atomic_exchange(&entry->watchers, NULL);
+        for (; watcher; watcher = watcher->next) {
+            watcher->ready = 1;
+            eventfd_write(watcher->wake_fd, 1);
+        }
+        pthread_mutex_unlock(&entry->lock);
+    }
+}
 
-        // Update size atomically
-        pthread_mutex_lock(&cache->size_lock);
-        cache->current_size -= to_evict->total_size;
-        pthread_mutex_unlock(&cache->size_lock);
+// appends an already filled chunk to the entry and accounts for it in the cache size
+// only the writer may call this, readers see the chunk once total_size covers it
+static void attach_chunk(cache_entry_t *entry, data_chunk_t *chunk) {
+    chunk->next = NULL;
+    if (!entry->data_head) {
+        entry->data_head = chunk;
+    } else {
+        entry->data_tail->next = chunk;
+    }
+    entry->data_tail = chunk;
+    atomic_fetch_add(&entry->total_size, chunk->size);
 
-        pthread_mutex_unlock(&cache->buckets[bucket_idx].lock);
+    pthread_mutex_lock(&entry->cache->size_lock);
+    entry->cache->current_size += chunk->size;
+    pthread_mutex_unlock(&entry->cache->size_lock);
+}
 
-        // Free the entry
-        pthread_mutex_destroy(&to_evict->lock);
-        pthread_cond_destroy(&to_evict->data_ready);
-        free_entry_data(to_evict);
-        free(to_evict);
+static cache_entry_t *alloc_entry(http_cache_t *cache, const char *url) {
+    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    if (!entry) {
+        log_error("could not allocate memory for cache entry");
+        return NULL;
     }
+
+    strncpy(entry->url, url, MAX_URL_LENGTH - 1);
+    entry->hash = cache_hash_url(entry->url);
+    entry->cache = cache;
+    entry->disk_fd = -1;
+    entry->sweep_idx = -1;
+    entry->policy_idx = -1;
+    entry->hits = 1;
+    entry->fetch_cost = 1.0;
+    entry->encoding = CACHE_ENCODING_UNKNOWN;
+
+    entry->data_head = NULL;
+    entry->data_tail = NULL;
+    entry->total_size = 0;  // Will grow as data is appended
+    entry->state = ENTRY_INCOMPLETE;
+    entry->refcount = 1;
+    entry->last_access = time(NULL);
+
+    pthread_mutex_init(&entry->lock, NULL);
+    return entry;
 }
 
-cache_entry_t* cache_lookup(http_cache_t *cache, const char *url) {
+static cache_entry_t *insert_entry(http_cache_t *cache, const char *url, int unique, int *found);
+
+// hashes a body filled from elsewhere in as a complete entry, returned with a reference held
+// promotions race each other and new fills, if the url got cached meanwhile the body is dropped
+// and that entry is returned instead with *found set, it is not the caller's to set up
+static cache_entry_t *insert_complete(http_cache_t *cache, const char *url, data_chunk_t *head, int *found) {
+    *found = 0;
+    cache_entry_t *entry = insert_entry(cache, url, 1, found);
+    if (!entry || *found) {
+        free_chunks(cache, head);
+        return entry;
+    }
+    for (data_chunk_t *chunk = head, *next; chunk; chunk = next) {
+        next = chunk->next;
+        attach_chunk(entry, chunk);
+    }
+    entry->state = ENTRY_COMPLETE;
+    publish(entry);
 
-    cache_entry_t *entry = NULL;
-    uint32_t bucket_idx = hash_url(url) % cache->num_buckets;
+    pthread_mutex_lock(&cache->lru_lock);
+    policy_update(cache, entry, 0);
+    pthread_mutex_unlock(&cache->lru_lock);
+    return entry;
+}
 
-    pthread_mutex_lock(&cache->buckets[bucket_idx].lock);
+// loads an object from the disk tier into a new complete memory entry
+// objects above DISK_PROMOTE_MAX_SIZE get a private entry that reads from the segment file instead
+// returns the entry with a reference held, or NULL if it is not on disk
+static cache_entry_t *promote_from_disk(http_cache_t *cache, const char *url) {
+    disk_handle_t handle;
+    if (disk_tier_open(cache->disk, url, &handle) == -1) {
+        return NULL;
+    }
 
-    for (entry = cache->buckets[bucket_idx].entries; entry != NULL; entry = entry->next) {
-        if (strcmp(entry->url, url) == 0) {
-            pthread_mutex_lock(&entry->lock);
+    if (handle.size > DISK_PROMOTE_MAX_SIZE) {
+        cache_entry_t *entry = alloc_entry(cache, url);
+        if (!entry) {
+            disk_tier_close(cache->disk, &handle);
+            return NULL;
+        }
+        // the segment stays pinned until the last reference is released
+        entry->disk_fd = handle.fd;
+        entry->disk_segment = handle.segment;
+        entry->disk_offset = handle.body_offset;
+        entry->total_size = handle.size;
+        entry->on_disk = 1;
+        entry->state = ENTRY_COMPLETE;
+        log_debug("serving %s from disk tier segment %u", url, handle.segment);
+        return entry;
+    }
 
-            // Skip cancelled entries
-            if (entry->state == ENTRY_CANCELLED) {
-                pthread_mutex_unlock(&entry->lock);
+    data_chunk_t *chunk = malloc(sizeof(data_chunk_t));
+    uint8_t *data = malloc(handle.size ? handle.size : 1);
+    if (!chunk || !data) {
+        free(chunk);
+        free(data);
+        disk_tier_close(cache->disk, &handle);
+        log_error("could not allocate memory for disk tier object");
+        return NULL;
+    }
+    ssize_t ret = disk_tier_read(cache->disk, &handle, url, data);
+    disk_tier_close(cache->disk, &handle);
+    if (ret != (ssize_t)handle.size) {
+        free(chunk);
+        free(data);
+        return NULL;
+    }
+    chunk->data = data;
+    chunk->size = handle.size;
+    chunk->next = NULL;
+
+    int found;
+    cache_entry_t *entry = insert_complete(cache, url, chunk, &found);
+    if (!entry || found) return entry;
+    entry->on_disk = 1;
+
+    log_debug("promoted %s from disk tier (%lu bytes)", url, handle.size);
+    evict_lru_entries(cache, 0);
+    return entry;
+}
+
+// empty chunks covering size bytes, cut into the extents compaction would produce
+static data_chunk_t *alloc_extents(http_cache_t *cache, size_t size) {
+    size_t extent = size <= SMALL_OBJECT_SIZE ? size : COMPACT_EXTENT_SIZE;
+    data_chunk_t *head = NULL, *tail = NULL;
+    for (size_t offset = 0; offset < size || !head; ) {
+        size_t len = size - offset < extent ? size - offset : extent;
+        data_chunk_t *chunk = malloc(sizeof(data_chunk_t));
+        uint8_t *data = alloc_body(cache, len);
+        if (!chunk || !data) {
+            free(chunk);
+            free_body(cache, data);
+            free_chunks(cache, head);
+            return NULL;
+        }
+        chunk->data = data;
+        chunk->size = len;
+        chunk->next = NULL;
+        if (tail) tail->next = chunk;
+        else head = chunk;
+        tail = chunk;
+        offset += len;
+    }
+    return head;
+}
+
+// copies an object another process stored in the shared tier into a fresh memory entry
+// returns the entry with a reference held, or NULL if it is not there or changed while being copied
+static cache_entry_t *promote_from_shared(http_cache_t *cache, const char *url) {
+    shm_handle_t handle;
+    if (shm_tier_find(cache->shared, url, &handle) == -1) {
+        return NULL;
+    }
+
+    data_chunk_t *head = alloc_extents(cache, handle.size);
+    if (!head) return NULL;
+    size_t offset = 0;
+    for (data_chunk_t *chunk = head; chunk; chunk = chunk->next) {
+        if (shm_tier_read(cache->shared, &handle, chunk->data, offset, chunk->size) == -1) {
+            free_chunks(cache, head);
+            return NULL;
+        }
+        offset += chunk->size;
+    }
+
+    int found;
+    cache_entry_t *entry = insert_complete(cache, url, head, &found);
+    if (!entry || found) return entry;
+    entry->shared = 1;
+    if (handle.expires)
+        cache_entry_set_ttl(entry, handle.expires - time(NULL));
+
+    log_debug("promoted %s from shared tier (%lu bytes)", url, handle.size);
+    evict_lru_entries(cache, 0);
+    return entry;
+}
+
+// takes a reference on the live entry for url and counts the hit, NULL if there is none
+// caller must hold the bucket lock
+static cache_entry_t *hit_locked(http_cache_t *cache, cache_bucket_t *bucket, const char *url) {
+    cache_entry_t *entry = NULL;
+    time_t now = time(NULL);
+
+    for (entry = bucket->entries; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->url, url) == 0) {
+            // Skip cancelled and expired entries, the collector reclaims them
+            if (entry->state == ENTRY_CANCELLED || (entry->expires && entry->expires <= now)) {
                 continue;
             }
 
-            entry->refcount++;
-            entry->last_access = time(NULL);
+            atomic_fetch_add(&entry->refcount, 1);
 
             pthread_mutex_lock(&cache->lru_lock);
-            lru_remove(cache, entry);
-            lru_add_head(cache, entry);
+            entry->last_access = now;
+            policy_update(cache, entry, 1);
             pthread_mutex_unlock(&cache->lru_lock);
-
-            pthread_mutex_unlock(&entry->lock);
             break;
         }
     }
+    return entry;
+}
 
+static cache_entry_t *lookup_memory(http_cache_t *cache, const char *url) {
+    uint32_t bucket_idx = cache_hash_url(url) % cache->num_buckets;
+
+    pthread_mutex_lock(&cache->buckets[bucket_idx].lock);
+    cache_entry_t *entry = hit_locked(cache, &cache->buckets[bucket_idx], url);
     pthread_mutex_unlock(&cache->buckets[bucket_idx].lock);
+    return entry;
+}
+
+// copies a complete in-memory entry of another node's shard into this one, NULL if that fails
+static cache_entry_t *replicate(http_cache_t *cache, cache_entry_t *remote) {
+    data_chunk_t *head = alloc_extents(cache, remote->total_size);
+    if (!head) return NULL;
+    size_t offset = 0;
+    for (data_chunk_t *chunk = head; chunk; chunk = chunk->next) {
+        for (size_t copied = 0; copied < chunk->size; ) {
+            ssize_t ret = cache_entry_read_nowait(remote, chunk->data + copied, offset + copied, chunk->size - copied);
+            if (ret <= 0) {
+                free_chunks(cache, head);
+                return NULL;
+            }
+            copied += ret;
+        }
+        offset += chunk->size;
+    }
 
+    int found;
+    cache_entry_t *entry = insert_complete(cache, remote->url, head, &found);
+    if (!entry || found) return entry;
+    entry->on_disk = remote->on_disk;
+    entry->shared = remote->shared;
+    atomic_store(&entry->encoding, atomic_load(&remote->encoding));
+    cache_entry_set_fetch_cost(entry, remote->fetch_cost);
+
+    pthread_mutex_lock(&remote->lock);
+    time_t expires = remote->expires;
+    pthread_mutex_unlock(&remote->lock);
+    if (expires)
+        cache_entry_set_ttl(entry, expires - time(NULL));
+
+    evict_lru_entries(cache, 0);
     return entry;
 }
 
+// a miss in the local shard looks at the shards of the other nodes before the lower tiers
+// small complete objects are copied over so their next hits stay on this node, the rest is read remotely
+static cache_entry_t *lookup_peers(http_cache_t *cache, const char *url) {
+    for (size_t i = 0; i < cache->num_shards; i++) {
+        http_cache_t *peer = cache->shards[i];
+        if (peer == cache) continue;
+        cache_entry_t *remote = lookup_memory(peer, url);
+        if (!remote) continue;
+
+        atomic_fetch_add_explicit(&cache->remote_hits, 1, memory_order_relaxed);
+        if (remote->state != ENTRY_COMPLETE || remote->disk_fd >= 0 || remote->total_size > NUMA_REPLICATE_MAX_SIZE)
+            return remote;
+        cache_entry_t *local = replicate(cache, remote);
+        if (!local) return remote;
+        cache_entry_release(remote);
+        return local;
+    }
+    return NULL;
+}
+
+// only the entries of this shard, cheap enough to run under the proxy's lookup-or-insert lock
+cache_entry_t *cache_lookup_local(http_cache_t *cache, const char *url) {
+    return lookup_memory(cache, url);
+}
+
+// the other nodes' shards, the shared tier and the disk tier in that order
+// copies and disk reads happen here, so callers should not hold locks other lookups wait on
+cache_entry_t *cache_lookup_tiers(http_cache_t *cache, const char *url) {
+    cache_entry_t *entry = NULL;
+
+    if (cache->shards) {
+        entry = lookup_peers(cache, url);
+    }
+    if (!entry && cache->shared) {
+        entry = promote_from_shared(cache, url);
+    }
+    if (!entry && cache->disk) {
+        entry = promote_from_disk(cache, url);
+    }
+
+    return entry;
+}
+
+cache_entry_t* cache_lookup(http_cache_t *cache, const char *url) {
+    cache_entry_t *entry = cache_lookup_local(cache, url);
+    if (!entry) entry = cache_lookup_tiers(cache, url);
+    return entry;
+}
+
+// returns 1 if an object of the given size may be cached, 0 otherwise
+// size is the whole stored response with its headers, the same bytes cache_entry_append_chunk counts
+int cache_admits_size(http_cache_t *cache, size_t size) {
+    return size >= cache->min_object_size && size <= atomic_load(&cache->max_object_size);
+}
+
 cache_entry_t* cache_insert(http_cache_t *cache, const char *url) {
+    return insert_entry(cache, url, 0, NULL);
+}
+
+// links a new entry for url into its bucket and the replacement policy, returned with a reference held
+// with unique set an entry already cached for url is returned instead and *found is set
+static cache_entry_t *insert_entry(http_cache_t *cache, const char *url, int unique, int *found) {
     // First ensure we have space
     // evict_lru_entries(cache, expected_size);
     //
@@ -194,12 +752,11 @@ cache_entry_t* cache_insert(http_cache_t *cache, const char *url) {
     // cache->current_size += expected_size;  // Update size immediately if we have space
     // pthread_mutex_unlock(&cache->size_lock);
 
-    cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+    cache_entry_t *entry = alloc_entry(cache, url);
     if (!entry) {
         // pthread_mutex_lock(&cache->size_lock);
         // cache->current_size -= expected_size;  // Rollback on failure as this is less likely
         // pthread_mutex_unlock(&cache->size_lock);
-        log_error("could not allocate memory for cache entry");
         return NULL;
     }
 
@@ -207,7 +764,6 @@ cache_entry_t* cache_insert(http_cache_t *cache, const char *url) {
     // cache->current_size += expected_size;
     // pthread_mutex_unlock(&cache->size_lock);
 
-    strncpy(entry->url, url, MAX_URL_LENGTH - 1);
     // entry->data = malloc(expected_size);
     // if (!entry->data) {
     //     free(entry);
@@ -215,42 +771,51 @@ cache_entry_t* cache_insert(http_cache_t *cache, const char *url) {
     //     return NULL;
     // }
 
-    entry->data_head = NULL;
-    entry->data_tail = NULL;
-    entry->total_size = 0;  // Will grow as data is appended
-    entry->state = ENTRY_INCOMPLETE;
-    entry->refcount = 1;
-    entry->last_access = time(NULL);
+    // make room for the new entry before it starts growing
+    evict_lru_entries(cache, 0);
 
-    pthread_mutex_init(&entry->lock, NULL);
-    pthread_cond_init(&entry->data_ready, NULL);
-
-    uint32_t bucket_idx = hash_url(url) % cache->num_buckets;
+    uint32_t bucket_idx = entry->hash % cache->num_buckets;
     pthread_mutex_lock(&cache->buckets[bucket_idx].lock);
+    cache_entry_t *existing = unique ? hit_locked(cache, &cache->buckets[bucket_idx], url) : NULL;
+    if (existing) {
+        pthread_mutex_unlock(&cache->buckets[bucket_idx].lock);
+        destroy_entry(entry);
+        *found = 1;
+        return existing;
+    }
     entry->next = cache->buckets[bucket_idx].entries;
     cache->buckets[bucket_idx].entries = entry;
+    // the new entry shadows any older one for the same url
+    bump_generation(cache, entry->hash);
+    pthread_mutex_lock(&cache->keys_lock);
+    entry->indexed = radix_insert(&cache->keys, entry->url) == 0;
+    pthread_mutex_unlock(&cache->keys_lock);
     pthread_mutex_unlock(&cache->buckets[bucket_idx].lock);
 
     // Add to LRU list
     pthread_mutex_lock(&cache->lru_lock);
-        lru_add_head(cache, entry);
+        policy_add(cache, entry);
     pthread_mutex_unlock(&cache->lru_lock);
 
     return entry;
 }
 
 // returns 0 on success, -1 on failure
+// there is exactly one writer per entry, so appending needs no lock
 int cache_entry_append_chunk(cache_entry_t *entry, const void *data, size_t size) {
-    pthread_mutex_lock(&entry->lock);
     if (entry->state == ENTRY_CANCELLED) {
-        pthread_mutex_unlock(&entry->lock);
         log_fatal("cache entry should never be used after cancellation, how did this happen????");
         return -1;
     }
 
+    size_t max_object_size = atomic_load(&entry->cache->max_object_size);
+    if (entry->total_size + size > max_object_size) {
+        log_info("%s grew past the max object size of %zu bytes", entry->url, max_object_size);
+        return -1;
+    }
+
     data_chunk_t *new_chunk = malloc(sizeof(data_chunk_t));
     if (!new_chunk) {
-        pthread_mutex_unlock(&entry->lock);
         log_error("could not allocate memory for new data chunk");
         return -1;
     }
@@ -258,64 +823,52 @@ int cache_entry_append_chunk(cache_entry_t *entry, const void *data, size_t size
     new_chunk->data = malloc(size);
     if (!new_chunk->data) {
         free(new_chunk);
-        pthread_mutex_unlock(&entry->lock);
         log_error("could not allocate memory for chunk data");
         return -1;
     }
 
     memcpy(new_chunk->data, data, size);
     new_chunk->size = size;
-    new_chunk->next = NULL;
+    attach_chunk(entry, new_chunk);
+    publish(entry);
 
-    if (!entry->data_head) {
-        entry->data_head = new_chunk;
-        entry->data_tail = new_chunk;
-    } else {
-        entry->data_tail->next = new_chunk;
-        entry->data_tail = new_chunk;
-    }
-
-    entry->total_size += size;
-    pthread_cond_broadcast(&entry->data_ready);
-    pthread_mutex_unlock(&entry->lock);
+    evict_lru_entries(entry->cache, 0);
     return 0;
 }
 
-// Function to read from cache entry with waiting
-// returns number of bytes read or -1 on cache failure
-ssize_t cache_entry_read(cache_entry_t *entry, void *buf, ssize_t offset, ssize_t size) {
-    pthread_mutex_lock(&entry->lock);
-
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout); // it is REALTIME because that's what timed wait requires (epoch time)
-    timeout.tv_sec += 5; // 5-second timeout
+// sleeps until publish_seq moves away from seen or the timeout runs out
+static void wait_for_publish(cache_entry_t *entry, uint32_t seen, const struct timespec *timeout) {
+    atomic_fetch_add(&entry->waiters, 1);
+    syscall(SYS_futex, &entry->publish_seq, FUTEX_WAIT_PRIVATE, seen, timeout, NULL, 0);
+    atomic_fetch_sub(&entry->waiters, 1);
+}
 
-    // todo: this can maybe be an exit point to support multiplexing, though it maybe needs to be in proxy.c and not here
-    while (offset >= entry->total_size && entry->state == ENTRY_INCOMPLETE) {
-        int rc = pthread_cond_timedwait(&entry->data_ready, &entry->lock, &timeout);
-        // Check if entry was cancelled
-        if (entry->state == ENTRY_CANCELLED) { // todo maybe shift this after ETIMEDOUT
-            pthread_mutex_unlock(&entry->lock);
-            log_warn("cache entry was cancelled");
-            return -1;
-        }
-        if (rc == ETIMEDOUT) {
-            pthread_mutex_unlock(&entry->lock);
-            log_error("cache read timed out");
-            return -1;  // Timeout error
-        }
+// reads from a cache entry without waiting for the writer
+// returns number of bytes read, 0 at the end of a complete entry, CACHE_READ_WOULD_BLOCK when the reader
+// caught up with the writer or -1 on cache failure
+ssize_t cache_entry_read_nowait(cache_entry_t *entry, void *buf, ssize_t offset, ssize_t size) {
+    // the state is loaded first, a complete entry never grows afterwards
+    entry_state_t state = entry->state;
+    if (state == ENTRY_CANCELLED) {
+        log_warn("cache entry was cancelled");
+        return -1;
     }
+    ssize_t available = entry->total_size;
+    if (offset >= available) return state == ENTRY_COMPLETE ? 0 : CACHE_READ_WOULD_BLOCK;
+    if (size > available - offset) size = available - offset;
 
-    // Don't read from cancelled entries
-    if (entry->state == ENTRY_CANCELLED) {
-        pthread_mutex_unlock(&entry->lock);
-        return -1;
+    if (entry->disk_fd >= 0) {
+        ssize_t ret;
+        while ((ret = pread(entry->disk_fd, buf, size, entry->disk_offset + offset)) == -1 && errno == EINTR) {
+        }
+        if (ret == -1) log_error("disk tier read failed: %s", strerror(errno));
+        return ret;
     }
 
-    // Find the starting chunk and offset within it
+    // Find the starting chunk and offset within it, everything below available is published
     data_chunk_t *chunk = entry->data_head;
     ssize_t chunk_offset = offset;
-    while (chunk && chunk_offset >= chunk->size) {
+    while (chunk_offset >= chunk->size) {
         chunk_offset -= chunk->size;
         chunk = chunk->next;
     }
@@ -324,106 +877,622 @@ ssize_t cache_entry_read(cache_entry_t *entry, void *buf, ssize_t offset, ssize_
     ssize_t bytes_read = 0;
     uint8_t *dest = buf;
 
-    while (chunk && bytes_read < size) {
+    for (;;) {
         ssize_t available_in_chunk = chunk->size - chunk_offset;
         ssize_t to_read = (size - bytes_read < available_in_chunk) ? size - bytes_read : available_in_chunk;
 
         memcpy(dest + bytes_read, chunk->data + chunk_offset, to_read);
         bytes_read += to_read;
+        // never follow next past the published length, the writer may be linking it right now
+        if (bytes_read >= size) break;
         chunk = chunk->next;
         chunk_offset = 0;  // Reset offset for subsequent chunks
     }
 
-    pthread_mutex_unlock(&entry->lock);
     return bytes_read;
 }
 
+// Function to read from cache entry with waiting
+// only blocks when the reader has caught up with the writer
+// returns number of bytes read or -1 on cache failure
+ssize_t cache_entry_read(cache_entry_t *entry, void *buf, ssize_t offset, ssize_t size) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += READ_WAIT_TIMEOUT;
+
+    for (;;) {
+        // sample the sequence first so a publish after the read below still wakes us
+        uint32_t seen = atomic_load(&entry->publish_seq);
+        ssize_t ret = cache_entry_read_nowait(entry, buf, offset, size);
+        if (ret != CACHE_READ_WOULD_BLOCK) return ret;
+
+        struct timespec now, remaining;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+        remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+        if (remaining.tv_nsec < 0) {
+            remaining.tv_sec--;
+            remaining.tv_nsec += 1000000000L;
+        }
+        if (remaining.tv_sec < 0) {
+            log_error("cache read timed out");
+            return -1;
+        }
+        wait_for_publish(entry, seen, &remaining);
+    }
+}
+
+// arms a one-shot watcher that fires once data past offset is published or the entry completes or is cancelled
+// returns 0 if the watcher is armed, 1 if there is already something to read and it was not armed
+int cache_entry_watch(cache_entry_t *entry, cache_watcher_t *watcher, ssize_t offset) {
+    pthread_mutex_lock(&entry->lock);
+    watcher->ready = 0;
+    watcher->next = entry->watchers;
+    entry->watchers = watcher;
+
+    // a publish that raced with arming did not see the watcher, so look again
+    if (offset < entry->total_size || entry->state != ENTRY_INCOMPLETE) {
+        entry->watchers = watcher->next;
+        pthread_mutex_unlock(&entry->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&entry->lock);
+    return 0;
+}
+
+// disarms a watcher, it is fine if it already fired
+void cache_entry_unwatch(cache_entry_t *entry, cache_watcher_t *watcher) {
+    pthread_mutex_lock(&entry->lock);
+    cache_watcher_t *prev = NULL;
+    for (cache_watcher_t *cur = entry->watchers; cur; prev = cur, cur = cur->next) {
+        if (cur != watcher) continue;
+        if (prev) prev->next = cur->next;
+        else entry->watchers = cur->next;
+        break;
+    }
+    pthread_mutex_unlock(&entry->lock);
+}
+
+// sends up to size bytes of a disk backed entry starting at offset straight from the page cache
+// returns number of bytes sent or -1 on failure
+ssize_t cache_entry_sendfile(cache_entry_t *entry, int out_fd, ssize_t offset, ssize_t size) {
+    if (entry->disk_fd < 0) {
+        log_fatal("sendfile on an entry that is not backed by the disk tier");
+        return -1;
+    }
+    if (offset >= entry->total_size) return 0;
+    if (size > entry->total_size - offset) size = entry->total_size - offset;
+
+    off_t file_offset = entry->disk_offset + offset;
+    ssize_t sent = 0;
+    while (sent < size) {
+        ssize_t ret = sendfile(out_fd, entry->disk_fd, &file_offset, size - sent);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            log_error("sendfile failed: %s", strerror(errno));
+            return -1;
+        }
+        if (ret == 0) break;
+        sent += ret;
+    }
+    return sent;
+}
+
+// returns the body of a complete in-memory entry held in a single chunk, NULL otherwise
+// the pointer stays valid for as long as the caller holds its reference
+const void *cache_entry_contiguous(cache_entry_t *entry, size_t *size) {
+    if (entry->state != ENTRY_COMPLETE || entry->disk_fd >= 0 || !entry->data_head || entry->data_head->next) {
+        return NULL;
+    }
+    *size = entry->data_head->size;
+    return entry->data_head->data;
+}
+
+// rebuilds the chunk list of a complete entry, small objects become one allocation and large ones extents
+// the copy is made without any lock and only swapped in under the bucket lock if the caller holds the only
+// reference, new references are never handed out while that lock is held
+// returns 0 if the entry is compacted or needs nothing, 1 if readers were in the way, -1 on allocation failure
+static int compact_entry(http_cache_t *cache, cache_entry_t *entry) {
+    // the job's pointer may have been reused for another entry, which is still safe to look at
+    if (entry->state != ENTRY_COMPLETE || entry->disk_fd >= 0) return 0;
+    size_t total = entry->total_size;
+    size_t extent = total <= SMALL_OBJECT_SIZE ? total : COMPACT_EXTENT_SIZE;
+    if (total == 0) return 0;
+
+    size_t chunks = 0;
+    for (data_chunk_t *chunk = entry->data_head; chunk; chunk = chunk->next)
+        chunks++;
+    if (chunks <= (total + extent - 1) / extent) return 0;
+
+    data_chunk_t *head = NULL, *tail = NULL;
+    for (size_t offset = 0; offset < total; ) {
+        size_t size = total - offset < extent ? total - offset : extent;
+        data_chunk_t *chunk = malloc(sizeof(data_chunk_t));
+        uint8_t *data = alloc_body(cache, size);
+        if (!chunk || !data) {
+            free(chunk);
+            free_body(cache, data);
+            free_chunks(cache, head);
+            log_error("could not allocate memory to compact %s", entry->url);
+            return -1;
+        }
+        ssize_t ret = cache_entry_read_nowait(entry, data, offset, size);
+        chunk->data = data;
+        chunk->size = ret;
+        chunk->next = NULL;
+        if (tail) tail->next = chunk;
+        else head = chunk;
+        tail = chunk;
+        if (ret != (ssize_t)size) {
+            free_chunks(cache, head);
+            return -1;
+        }
+        offset += size;
+    }
+
+    cache_bucket_t *bucket = &cache->buckets[entry->hash % cache->num_buckets];
+    pthread_mutex_lock(&bucket->lock);
+    if (entry->refcount != 1) {
+        pthread_mutex_unlock(&bucket->lock);
+        free_chunks(cache, head);
+        return 1;
+    }
+    data_chunk_t *old = entry->data_head;
+    entry->data_head = head;
+    entry->data_tail = tail;
+    pthread_mutex_unlock(&bucket->lock);
+
+    log_debug("compacted %s from %zu chunks into %zu", entry->url, chunks, (total + extent - 1) / extent);
+    free_chunks(cache, old);
+    return 0;
+}
+
+// takes a reference on an entry queued without one, NULL if it has left its bucket since, evicted or purged
+// the pointer may be stale, it is only compared against the entries of the bucket
+cache_entry_t *cache_entry_claim(http_cache_t *cache, cache_entry_t *entry, uint32_t hash) {
+    cache_bucket_t *bucket = &cache->buckets[hash % cache->num_buckets];
+    pthread_mutex_lock(&bucket->lock);
+    cache_entry_t *found = bucket->entries;
+    while (found && found != entry)
+        found = found->next;
+    if (found)
+        atomic_fetch_add(&found->refcount, 1);
+    pthread_mutex_unlock(&bucket->lock);
+    return found;
+}
+
+// hands a complete entry to the collector for compaction
+static void compact_schedule(http_cache_t *cache, cache_entry_t *entry) {
+    compact_job_t *job = malloc(sizeof(compact_job_t));
+    if (!job) return;
+    job->entry = entry;
+    job->hash = entry->hash;
+    job->not_before = 0;
+    job->tries = 0;
+    job->next = NULL;
+
+    pthread_mutex_lock(&cache->collector_lock);
+    if (cache->compact_tail) cache->compact_tail->next = job;
+    else cache->compact_head = job;
+    cache->compact_tail = job;
+    pthread_cond_signal(&cache->collector_cond);
+    pthread_mutex_unlock(&cache->collector_lock);
+}
+
+// compacts at most SWEEP_BATCH queued entries that are due, busy ones are retried a few times later on
+// returns the number of jobs looked at
+static size_t compact_due_entries(http_cache_t *cache, time_t now) {
+    size_t done = 0;
+    while (done < SWEEP_BATCH) {
+        pthread_mutex_lock(&cache->collector_lock);
+        compact_job_t *job = cache->compact_head;
+        if (!job || job->not_before > now) {
+            pthread_mutex_unlock(&cache->collector_lock);
+            break;
+        }
+        cache->compact_head = job->next;
+        if (!cache->compact_head) cache->compact_tail = NULL;
+        pthread_mutex_unlock(&cache->collector_lock);
+        done++;
+
+        cache_entry_t *entry = cache_entry_claim(cache, job->entry, job->hash);
+        int ret = entry ? compact_entry(cache, entry) : 0;
+        if (entry)
+            cache_entry_release(entry);
+        if (ret == 1 && ++job->tries < COMPACT_MAX_TRIES) {
+            job->not_before = now + SWEEP_RETRY;
+            job->next = NULL;
+            pthread_mutex_lock(&cache->collector_lock);
+            if (cache->compact_tail) cache->compact_tail->next = job;
+            else cache->compact_head = job;
+            cache->compact_tail = job;
+            pthread_mutex_unlock(&cache->collector_lock);
+            continue;
+        }
+        free(job);
+    }
+    return done;
+}
+
 void cache_entry_complete(cache_entry_t *entry) {
     if (entry == NULL) {
         log_fatal("cache entry should not be NULL");
         return;
     }
-    pthread_mutex_lock(&entry->lock);
     entry->state = ENTRY_COMPLETE;
-    pthread_cond_broadcast(&entry->data_ready);
+    publish(entry);
+
+    // the final size is known only now
+    pthread_mutex_lock(&entry->cache->lru_lock);
+    policy_update(entry->cache, entry, 0);
+    pthread_mutex_unlock(&entry->cache->lru_lock);
+
+    // text goes through the compression pool first, which settles the entry once it is done with it
+    if (entry->compress_header_len && entry->cache->compress &&
+        compress_pool_submit(entry->cache->compress, entry) == 0) {
+        return;
+    }
+    cache_entry_settle(entry);
+}
+
+// hands a complete entry to compaction and the disk tier
+void cache_entry_settle(cache_entry_t *entry) {
+    // before compaction is scheduled, nothing swaps the chunk list while it is copied
+    if (entry->cache->shared && !entry->shared && entry->disk_fd < 0) {
+        shm_tier_store(entry->cache->shared, entry);
+        entry->shared = 1;
+    }
+
+    // small objects are cheap to copy, do it right away unless coalesced readers are still attached
+    if (entry->disk_fd < 0) {
+        if (entry->total_size > SMALL_OBJECT_SIZE || compact_entry(entry->cache, entry) == 1)
+            compact_schedule(entry->cache, entry);
+    }
+
+    // short lived entries are not worth a trip to disk
+    if (entry->cache->disk && !entry->expires) {
+        disk_tier_store(entry->cache->disk, entry);
+    }
+}
+
+// marks the response as worth compressing at rest, header_len is the length of its header block
+// only the writer may call this, before the entry is completed
+void cache_entry_set_compressible(cache_entry_t *entry, size_t header_len) {
+    entry->compress_header_len = header_len;
+}
+
+// swaps the stored response of a complete entry for another representation of it
+// new references are only taken under the bucket lock, so holding the only one there means nobody is reading
+// returns 0 if the data was replaced and the entry owns the new chunks, 1 if someone else holds a reference
+int cache_entry_replace_data(cache_entry_t *entry, data_chunk_t *head, data_chunk_t *tail, size_t size,
+                             cache_encoding_t encoding) {
+    http_cache_t *cache = entry->cache;
+    cache_bucket_t *bucket = &cache->buckets[entry->hash % cache->num_buckets];
+    pthread_mutex_lock(&bucket->lock);
+    if (entry->refcount != 1) {
+        pthread_mutex_unlock(&bucket->lock);
+        return 1;
+    }
+    data_chunk_t *old = entry->data_head;
+    size_t old_size = entry->total_size;
+    entry->data_head = head;
+    entry->data_tail = tail;
+    entry->total_size = size;
+    entry->encoding = encoding;
+    pthread_mutex_unlock(&bucket->lock);
+
+    pthread_mutex_lock(&cache->size_lock);
+    cache->current_size = cache->current_size - old_size + size;
+    pthread_mutex_unlock(&cache->size_lock);
+
+    pthread_mutex_lock(&cache->lru_lock);
+    policy_update(cache, entry, 0);
+    pthread_mutex_unlock(&cache->lru_lock);
+
+    free_chunks(cache, old);
+    return 0;
+}
+
+// makes the entry invisible to lookups ttl seconds from now, an entry purged while filling stays purged
+void cache_entry_set_ttl(cache_entry_t *entry, time_t ttl) {
+    pthread_mutex_lock(&entry->lock);
+    time_t expires = time(NULL) + ttl;
+    if (!entry->expires || expires < entry->expires)
+        entry->expires = expires;
+    sweep_schedule(entry->cache, entry, entry->expires);
     pthread_mutex_unlock(&entry->lock);
 }
 
+// records how long the origin took, GDSF keeps expensive objects around longer
+void cache_entry_set_fetch_cost(cache_entry_t *entry, double cost_ms) {
+    pthread_mutex_lock(&entry->cache->lru_lock);
+    entry->fetch_cost = cost_ms > 1.0 ? cost_ms : 1.0;
+    policy_update(entry->cache, entry, 0);
+    pthread_mutex_unlock(&entry->cache->lru_lock);
+}
+
 void cache_entry_release(cache_entry_t *entry) {
     if (entry == NULL) {
         log_fatal("cache entry should not be NULL");
         return;
     }
-    pthread_mutex_lock(&entry->lock);
-    entry->refcount--;
-    pthread_mutex_unlock(&entry->lock);
+    uint32_t refs = atomic_fetch_sub(&entry->refcount, 1) - 1;
+
+    // disk backed entries are private to their readers, the last one unpins the segment
+    if (entry->disk_fd >= 0 && refs == 0) {
+        disk_handle_t handle = {.fd = entry->disk_fd, .segment = entry->disk_segment};
+        disk_tier_close(entry->cache->disk, &handle);
+        destroy_entry(entry);
+    }
 }
 
+// the caller must still hold its reference, eviction frees a cancelled entry as soon as nobody does
+// so cancel first and release afterwards
 void cache_entry_cancel(cache_entry_t *entry) {
     if (entry == NULL) {
         log_fatal("cache entry should not be NULL");
         return;
     }
-    pthread_mutex_lock(&entry->lock);
+    assert(atomic_load(&entry->refcount) > 0);
     entry->state = ENTRY_CANCELLED;
-    pthread_cond_broadcast(&entry->data_ready);  // Wake up any waiting readers
+    publish(entry);  // Wake up any waiting readers
+    pthread_mutex_lock(&entry->lock);
+    sweep_schedule(entry->cache, entry, time(NULL));
     pthread_mutex_unlock(&entry->lock);
 }
 
-// Cleanup function that removes cancelled entries
-static void cleanup_cancelled_entries(http_cache_t *cache) {
-    log_info("starting cleanup of cancelled entries");
-    for (size_t i = 0; i < cache->num_buckets; i++) {
-            pthread_mutex_lock(&cache->buckets[i].lock);
-
-        cache_entry_t *entry = cache->buckets[i].entries;
-        cache_entry_t *prev = NULL;
-
-        while (entry != NULL) {
-            pthread_mutex_lock(&entry->lock);
-
-            if (entry->state == ENTRY_CANCELLED && entry->refcount == 0) {
-                cache_entry_t *to_remove = entry;
-                entry = entry->next;
-
-                // Update the linked list
-                if (prev == NULL) {
-                    cache->buckets[i].entries = entry;
-                } else {
-                    prev->next = entry;
-                }
-
-                // Remove from LRU list
-                pthread_mutex_lock(&cache->lru_lock);
-                lru_remove(cache, to_remove);
-                pthread_mutex_unlock(&cache->lru_lock);
-
-                // Update cache size
-                pthread_mutex_lock(&cache->size_lock);
-                cache->current_size -= to_remove->total_size;
-                pthread_mutex_unlock(&cache->size_lock);
-
-                pthread_mutex_unlock(&to_remove->lock);
-
-                // Clean up the entry
-                pthread_mutex_destroy(&to_remove->lock);
-                pthread_cond_destroy(&to_remove->data_ready);
-                free_entry_data(to_remove);
-                free(to_remove);
-                to_remove = NULL;
+// reclaims at most SWEEP_BATCH due entries from the top of the sweep heap
+// only the bucket of the entry at hand is locked, so lookups elsewhere never wait on the collector
+// returns the number of entries looked at
+static size_t sweep_due_entries(http_cache_t *cache, time_t now) {
+    size_t handled = 0, reclaimed = 0;
+    while (handled < SWEEP_BATCH) {
+        pthread_mutex_lock(&cache->collector_lock);
+        if (cache->sweep_len == 0 || cache->sweep_heap[0]->sweep_at > now) {
+            pthread_mutex_unlock(&cache->collector_lock);
+            break;
+        }
+        // push it back first so an entry that is still in use does not hold up the ones behind it,
+        // detach_entry takes it out for good
+        cache_entry_t *victim = cache->sweep_heap[0];
+        uint32_t bucket_idx = victim->hash % cache->num_buckets;
+        sweep_schedule_locked(cache, victim, now + SWEEP_RETRY);
+        pthread_mutex_unlock(&cache->collector_lock);
+        handled++;
+
+        cache_bucket_t *bucket = &cache->buckets[bucket_idx];
+        pthread_mutex_lock(&bucket->lock);
+
+        // it may have been evicted and freed in between
+        cache_entry_t *entry = bucket->entries;
+        while (entry && entry != victim)
+            entry = entry->next;
+        if (!entry) {
+            pthread_mutex_unlock(&bucket->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&entry->lock);
+        int expired = entry->expires && entry->expires <= now && entry->state != ENTRY_INCOMPLETE;
+        if ((entry->state == ENTRY_CANCELLED || expired) && entry->refcount == 0) {
+            detach_entry(cache, bucket, entry);
+            pthread_mutex_unlock(&entry->lock);
+            pthread_mutex_unlock(&bucket->lock);
+            destroy_entry(entry);
+            reclaimed++;
+            continue;
+        }
+        pthread_mutex_unlock(&entry->lock);
+        pthread_mutex_unlock(&bucket->lock);
+    }
+
+    if (reclaimed)
+        log_debug("collector reclaimed %zu expired or cancelled entries", reclaimed);
+    return handled;
+}
+
+// purges every live entry for url, returns how many there were
+// a soft purge only marks them stale, lookups miss from now on and the collector frees them later
+// a hard purge frees unused entries right away, the ones still being read or filled are marked stale
+static size_t purge_url(http_cache_t *cache, const char *url, time_t now, int soft) {
+    uint32_t hash = cache_hash_url(url);
+    cache_bucket_t *bucket = &cache->buckets[hash % cache->num_buckets];
+    cache_entry_t *dead = NULL;
+    size_t purged = 0;
+
+    pthread_mutex_lock(&bucket->lock);
+    cache_entry_t *entry = bucket->entries;
+    while (entry) {
+        cache_entry_t *next = entry->next;
+        if (strcmp(entry->url, url) == 0 && entry->state != ENTRY_CANCELLED &&
+            !(entry->expires && entry->expires <= now)) {
+            purged++;
+            if (!soft && entry->refcount == 0 && entry->state == ENTRY_COMPLETE) {
+                detach_entry(cache, bucket, entry);
+                entry->next = dead;
+                dead = entry;
             } else {
+                pthread_mutex_lock(&entry->lock);
+                entry->expires = now;
+                sweep_schedule(cache, entry, now);
                 pthread_mutex_unlock(&entry->lock);
-                prev = entry;
-                entry = entry->next;
             }
         }
+        entry = next;
+    }
+    // per-worker copies check the generation, a soft purge has to reach them as well
+    bump_generation(cache, hash);
+    pthread_mutex_unlock(&bucket->lock);
+
+    while (dead) {
+        cache_entry_t *next = dead->next;
+        destroy_entry(dead);
+        dead = next;
+    }
+    return purged;
+}
 
-        pthread_mutex_unlock(&cache->buckets[i].lock);
+// removes a url, or every url under a prefix, from the memory tier only
+static size_t purge_memory(http_cache_t *cache, const char *key, cache_purge_scope_t scope, int soft) {
+    time_t now = time(NULL);
+    size_t purged = 0;
+
+    if (scope == CACHE_PURGE_URL) {
+        purged = purge_url(cache, key, now, soft);
+    } else {
+        // the keys are copied out first, purge_url takes bucket locks which rank above keys_lock
+        char **keys;
+        pthread_mutex_lock(&cache->keys_lock);
+        size_t count = radix_collect(&cache->keys, key, &keys);
+        pthread_mutex_unlock(&cache->keys_lock);
+        for (size_t i = 0; i < count; i++) {
+            purged += purge_url(cache, keys[i], now, soft);
+            free(keys[i]);
+        }
+        free(keys);
     }
-    log_info("cancelled entries cleaned up");
+    return purged;
+}
+
+// applies a purge to every node's shard
+static size_t purge_shards(http_cache_t *cache, const char *key, cache_purge_scope_t scope, int soft) {
+    if (!cache->shards)
+        return purge_memory(cache, key, scope, soft);
+    size_t purged = 0;
+    for (size_t i = 0; i < cache->num_shards; i++)
+        purged += purge_memory(cache->shards[i], key, scope, soft);
+    return purged;
+}
+
+// removes a url, or every url under a prefix, from all tiers
+// returns the number of memory entries purged, disk and shared copies are dropped without being counted
+size_t cache_purge(http_cache_t *cache, const char *key, cache_purge_scope_t scope, int soft) {
+    size_t purged = purge_shards(cache, key, scope, soft);
+
+    // the other processes replay it against their own memory from the shared tier
+    if (cache->shared)
+        shm_tier_purge(cache->shared, key, scope == CACHE_PURGE_PREFIX);
+    if (cache->disk)
+        disk_tier_purge(cache->disk, key, scope == CACHE_PURGE_PREFIX);
+
+    pthread_mutex_lock(&cache->collector_lock);
+    pthread_cond_signal(&cache->collector_cond);
+    pthread_mutex_unlock(&cache->collector_lock);
+
+    log_info("%s purge of %s%s: %zu objects", soft ? "soft" : "hard", key,
+             scope == CACHE_PURGE_PREFIX ? "*" : "", purged);
+    return purged;
+}
+
+void cache_stats_request(http_cache_t *cache, int hit) {
+    atomic_fetch_add_explicit(hit ? &cache->hit_objects : &cache->miss_objects, 1, memory_order_relaxed);
+}
+
+void cache_stats_bytes(http_cache_t *cache, int hit, size_t bytes) {
+    atomic_fetch_add_explicit(hit ? &cache->hit_bytes : &cache->miss_bytes, bytes, memory_order_relaxed);
+}
+
+void cache_log_stats(http_cache_t *cache) {
+    uint64_t hits = cache->hit_objects, misses = cache->miss_objects;
+    uint64_t hit_bytes = cache->hit_bytes, miss_bytes = cache->miss_bytes;
+    if (hits + misses == 0) return;
+    log_info("%s hit ratio: %.1f%% of %lu requests, %.1f%% of %lu bytes",
+             cache->policy == CACHE_POLICY_GDSF ? "GDSF" : "LRU",
+             100.0 * hits / (hits + misses), hits + misses,
+             hit_bytes + miss_bytes ? 100.0 * hit_bytes / (hit_bytes + miss_bytes) : 0.0, hit_bytes + miss_bytes);
+    if (cache->shards)
+        log_info("node %d: %lu lookups answered by the shards of other nodes", numa_topology()->ids[cache->node],
+                 (uint64_t)cache->remote_hits);
+}
+
+// sets the memory budget and the largest object admitted under it, caller holds size_lock once the cache runs
+// a single object must never be able to push everything else out, whatever the budget shrinks to
+static void set_budget_locked(http_cache_t *cache, size_t max_size) {
+    cache->max_size = max_size;
+    size_t max_object_size = cache->configured_object_size;
+    if (max_object_size > max_size / 2)
+        max_object_size = max_size / 2;
+    atomic_store(&cache->max_object_size, max_object_size);
+}
+
+// moves the budget between MEMWATCH_MIN_BUDGET and the configured size
+// running into the limit shrinks it at once, memory pressure in steps, and calm lets it grow back slowly
+static void adjust_budget(http_cache_t *cache) {
+    memwatch_sample_t sample;
+    if (memwatch_sample(cache->memwatch, &sample) == -1) return;
+
+    // with per node shards the budget covers all of them, split in proportion to their configured sizes
+    http_cache_t **shards = cache->shards ? cache->shards : &cache;
+    size_t num_shards = cache->shards ? cache->num_shards : 1;
+    size_t current = 0, budget = 0, configured = 0;
+    for (size_t i = 0; i < num_shards; i++) {
+        pthread_mutex_lock(&shards[i]->size_lock);
+        current += shards[i]->current_size;
+        budget += shards[i]->max_size;
+        pthread_mutex_unlock(&shards[i]->size_lock);
+        configured += shards[i]->configured_size;
+    }
+
+    // whatever the cache holds could be handed back, so it counts as available too
+    size_t headroom = sample.limit / 100 * MEMWATCH_HEADROOM;
+    size_t fits = current + sample.available > headroom ? current + sample.available - headroom : 0;
+    size_t target = budget;
+    if (fits < budget) {
+        target = fits;
+    } else if (sample.pressure >= MEMWATCH_PSI_HIGH) {
+        target = budget - budget / 100 * MEMWATCH_SHRINK_STEP;
+    } else if (sample.pressure < MEMWATCH_PSI_LOW) {
+        target = budget + configured / 100 * MEMWATCH_GROW_STEP;
+        if (target > fits) target = fits;
+    }
+
+    size_t floor = configured < MEMWATCH_MIN_BUDGET ? configured : MEMWATCH_MIN_BUDGET;
+    if (target < floor) target = floor;
+    if (target > configured) target = configured;
+    if (target == budget) return;
+
+    for (size_t i = 0; i < num_shards; i++) {
+        pthread_mutex_lock(&shards[i]->size_lock);
+        set_budget_locked(shards[i], (size_t)((double)target * shards[i]->configured_size / configured));
+        pthread_mutex_unlock(&shards[i]->size_lock);
+    }
+
+    if (target > budget) {
+        log_debug("memory budget raised to %zu MB", target / (1024 * 1024));
+        return;
+    }
+    log_info("memory budget lowered to %zu MB (limit %zu MB, %zu MB available, pressure %.1f%%)",
+             target / (1024 * 1024), sample.limit / (1024 * 1024), sample.available / (1024 * 1024),
+             sample.pressure);
+    for (size_t i = 0; i < num_shards; i++)
+        evict_lru_entries(shards[i], 0);
+    // freed chunks mostly sit in the malloc arenas, trimming hands their pages back with MADV_DONTNEED
+    malloc_trim(0);
+    for (size_t i = 0; i < num_shards; i++) {
+        if (shards[i]->arena)
+            arena_trim(shards[i]->arena);
+    }
+}
+
+// applies the purges other processes made to the memory tier of this one
+static void replay_shared_purges(http_cache_t *cache) {
+    shm_purge_t *purges;
+    size_t count = shm_tier_replay(cache->shared, &purges);
+    for (size_t i = 0; i < count; i++) {
+        size_t purged = purge_shards(cache, purges[i].key, purges[i].prefix ? CACHE_PURGE_PREFIX : CACHE_PURGE_URL, 0);
+        log_debug("replayed purge of %s%s from another process: %zu objects", purges[i].key,
+                  purges[i].prefix ? "*" : "", purged);
+    }
+    free(purges);
+}
+
+// shards other than the first borrow the lower tiers, the compression pool and the memory watch
+static int owns_tiers(http_cache_t *cache) {
+    return !cache->shards || cache->shards[0] == cache;
 }
 
 // Collector thread function
+// sleeps until the earliest scheduled entry is due and then works through the due ones in small batches
 static void *collector_thread_func(void *arg) {
     http_cache_t *cache = (http_cache_t *)arg;
     struct timespec wait_time;
@@ -431,20 +1500,46 @@ static void *collector_thread_func(void *arg) {
     while (1) {
         pthread_mutex_lock(&cache->collector_lock);
 
-        // Wait for X minutes or until signaled
-        clock_gettime(CLOCK_REALTIME, &wait_time);
-        // wait_time.tv_sec += 300; // 5 minutes
-        wait_time.tv_sec += 60; // 1 minute
-
-        pthread_cond_timedwait(&cache->collector_cond, &cache->collector_lock, &wait_time);
+        time_t now = time(NULL);
+        time_t next = now + SWEEP_IDLE_WAIT;
+        if (cache->sweep_len > 0 && cache->sweep_heap[0]->sweep_at < next)
+            next = cache->sweep_heap[0]->sweep_at;
+        if (cache->compact_head && cache->compact_head->not_before < next)
+            next = cache->compact_head->not_before;
+        if (cache->memwatch && cache->memwatch_at + MEMWATCH_INTERVAL < next)
+            next = cache->memwatch_at + MEMWATCH_INTERVAL;
+        if (cache->shared && owns_tiers(cache) && cache->shared_replayed_at + SHM_REPLAY_INTERVAL < next)
+            next = cache->shared_replayed_at + SHM_REPLAY_INTERVAL;
+
+        if (next > now && cache->collector_running) {
+            wait_time.tv_sec = next;
+            wait_time.tv_nsec = 0;
+            pthread_cond_timedwait(&cache->collector_cond, &cache->collector_lock, &wait_time);
+        }
         if (!cache->collector_running) {
             pthread_mutex_unlock(&cache->collector_lock);
             break;
         }
         pthread_mutex_unlock(&cache->collector_lock);
 
-        // Run cleanup
-        cleanup_cancelled_entries(cache);
+        if (time(NULL) - cache->stats_logged >= STATS_INTERVAL) {
+            cache_log_stats(cache);
+            cache->stats_logged = time(NULL);
+        }
+        if (cache->memwatch && time(NULL) - cache->memwatch_at >= MEMWATCH_INTERVAL) {
+            adjust_budget(cache);
+            cache->memwatch_at = time(NULL);
+        }
+        if (cache->shared && owns_tiers(cache) && time(NULL) - cache->shared_replayed_at >= SHM_REPLAY_INTERVAL) {
+            replay_shared_purges(cache);
+            cache->shared_replayed_at = time(NULL);
+        }
+
+        // a full batch means there may be more due, give other threads a go before the next one
+        size_t swept = sweep_due_entries(cache, time(NULL));
+        size_t compacted = compact_due_entries(cache, time(NULL));
+        if (swept == SWEEP_BATCH || compacted == SWEEP_BATCH)
+            sched_yield();
     }
 
     return NULL;
@@ -457,6 +1552,11 @@ static void http_cache_shutdown_no_collector(http_cache_t **cache_ptr) {
 
     http_cache_t *cache = *cache_ptr;
 
+    compress_pool_shutdown(&cache->compress);
+    disk_tier_shutdown(&cache->disk);
+    memwatch_close(&cache->memwatch);
+    shm_tier_close(&cache->shared);
+
     // Free all entries in each bucket
     for (size_t i = 0; i < cache->num_buckets; i++) {
         cache_bucket_t *bucket = &cache->buckets[i];
@@ -470,7 +1570,6 @@ static void http_cache_shutdown_no_collector(http_cache_t **cache_ptr) {
 
             // Destroy synchronization primitives
             pthread_mutex_destroy(&entry->lock);
-            pthread_cond_destroy(&entry->data_ready);
 
             // Free entry data
             free_entry_data(entry);
@@ -486,8 +1585,14 @@ static void http_cache_shutdown_no_collector(http_cache_t **cache_ptr) {
     // Destroy remaining synchronization primitives
     pthread_mutex_destroy(&cache->lru_lock);
     pthread_mutex_destroy(&cache->size_lock);
+    pthread_mutex_destroy(&cache->keys_lock);
+    radix_destroy(&cache->keys);
+    arena_destroy(&cache->arena);
 
     // Free buckets array and cache structure
+    free(cache->sweep_heap);
+    free(cache->generations);
+    free(cache->gdsf_heap);
     free(cache->buckets);
     free(cache);
     *cache_ptr = NULL;
@@ -495,15 +1600,27 @@ static void http_cache_shutdown_no_collector(http_cache_t **cache_ptr) {
     log_info("Cache shutdown_no_collector completed successfully");
 }
 
-http_cache_t* http_cache_init(size_t max_size) {
+// sets up one shard, node is the index of the node to place it on or -1 to leave placement to the kernel
+// its collector is started separately, once every shard that collector may look at exists
+static http_cache_t *init_shard(const cache_config_t *config, int node) {
     http_cache_t *cache = calloc(1, sizeof(http_cache_t));
     if (!cache) return NULL;
 
     cache->num_buckets = MAX_BUCKETS;
-    cache->max_size = max_size ? max_size : DEFAULT_CACHE_SIZE;
+    cache->configured_size = config->max_size ? config->max_size : DEFAULT_CACHE_SIZE;
+    cache->min_object_size = config->min_object_size;
+    cache->configured_object_size = config->max_object_size ? config->max_object_size : DEFAULT_MAX_OBJECT_SIZE;
+    set_budget_locked(cache, cache->configured_size);
+    cache->negative_ttl = config->negative_ttl;
+    cache->policy = config->policy;
+    cache->node = node < 0 ? 0 : node;
+    cache->stats_logged = time(NULL);
     cache->buckets = calloc(cache->num_buckets, sizeof(cache_bucket_t));
+    cache->generations = calloc(CACHE_GENERATION_SLOTS, sizeof(*cache->generations));
 
-    if (!cache->buckets) {
+    if (!cache->buckets || !cache->generations) {
+        free(cache->buckets);
+        free(cache->generations);
         free(cache);
         return NULL;
     }
@@ -514,46 +1631,160 @@ http_cache_t* http_cache_init(size_t max_size) {
 
     pthread_mutex_init(&cache->size_lock, NULL);
     pthread_mutex_init(&cache->lru_lock, NULL);
+    pthread_mutex_init(&cache->keys_lock, NULL);
+
+    if (config->shared_name) {
+        cache->shared = shm_tier_open(config->shared_name, config->shared_size);
+        if (!cache->shared) {
+            http_cache_shutdown_no_collector(&cache);
+            return NULL;
+        }
+    }
+
+    if (config->disk_dir) {
+        cache->disk = disk_tier_init(config->disk_dir, config->disk_size);
+        if (!cache->disk) {
+            http_cache_shutdown_no_collector(&cache);
+            return NULL;
+        }
+    }
 
-    cache->collector_running = 1;
     pthread_mutex_init(&cache->collector_lock, NULL);
     pthread_cond_init(&cache->collector_cond, NULL);
 
-    // Start collector thread
-    if (pthread_create(&cache->collector_thread, NULL, collector_thread_func, cache) != 0) {
-        http_cache_shutdown_no_collector(&cache);
-        pthread_mutex_destroy(&cache->collector_lock);
-        pthread_cond_destroy(&cache->collector_cond);
-        // Handle error
-        log_fatal("Failed to create collector thread");
-        // Clean up and return error
-
-        return NULL;
+    // without the arena every extent comes from the heap
+    if (config->huge_pages) {
+        cache->arena = arena_init(cache->max_size, COMPACT_EXTENT_SIZE);
+        // nothing has touched the mapping yet, so its pages fault in on the shard's node
+        if (cache->arena && node >= 0)
+            numa_bind(cache->arena->base, cache->arena->size, node);
     }
 
+    // the first sample is taken as soon as the collector runs
+    if (config->adaptive_size)
+        cache->memwatch = memwatch_open();
+
+    // a cache without the pool simply keeps responses as received
+    if (config->compress_workers)
+        cache->compress = compress_pool_init(config->compress_workers);
+
     return cache;
 }
 
-void http_cache_shutdown(http_cache_t **cache_ptr) {
-    if (!cache_ptr || !*cache_ptr) {
-        return;
-    }
+// the collector of a shard runs on the cpus of its node, next to the memory of the entries it walks
+static int start_collector(http_cache_t *cache) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cache->shards)
+        numa_thread_attr(&attr, cache->node);
 
-    http_cache_t *cache = *cache_ptr;
+    cache->collector_running = 1;
+    int ret = pthread_create(&cache->collector_thread, &attr, collector_thread_func, cache);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        cache->collector_running = 0;
+        log_fatal("Failed to create collector thread");
+        return -1;
+    }
+    return 0;
+}
 
-    // Stop collector thread
+static void stop_collector(http_cache_t *cache) {
     pthread_mutex_lock(&cache->collector_lock);
+    int running = cache->collector_running;
     cache->collector_running = 0;
     pthread_cond_signal(&cache->collector_cond);
     pthread_mutex_unlock(&cache->collector_lock);
 
     // Wait for collector thread to finish
-    pthread_join(cache->collector_thread, NULL);
+    if (running)
+        pthread_join(cache->collector_thread, NULL);
+}
+
+// with config->numa on a machine with several nodes there is one shard per node and the first is returned
+// the others reach the tiers below memory, the compression pool and the memory watch through it
+http_cache_t* http_cache_init(const cache_config_t *config) {
+    const numa_topology_t *topo = numa_topology();
+    if (!config->numa || topo->num_nodes < 2) {
+        http_cache_t *cache = init_shard(config, -1);
+        if (cache && start_collector(cache) == -1)
+            http_cache_shutdown(&cache);
+        return cache;
+    }
+
+    size_t num_shards = topo->num_nodes;
+    http_cache_t **shards = calloc(num_shards, sizeof(http_cache_t *));
+    if (!shards) return NULL;
+
+    cache_config_t shard_config = *config;
+    shard_config.max_size = (config->max_size ? config->max_size : DEFAULT_CACHE_SIZE) / num_shards;
+    for (size_t i = 0; i < num_shards; i++) {
+        shards[i] = init_shard(&shard_config, i);
+        if (!shards[i]) {
+            while (i-- > 0)
+                http_cache_shutdown(&shards[i]);
+            free(shards);
+            return NULL;
+        }
+        shard_config.disk_dir = NULL;
+        shard_config.shared_name = NULL;
+        shard_config.compress_workers = 0;
+        shard_config.adaptive_size = 0;
+    }
+
+    for (size_t i = 0; i < num_shards; i++) {
+        shards[i]->shards = shards;
+        shards[i]->num_shards = num_shards;
+        if (i > 0) {
+            shards[i]->disk = shards[0]->disk;
+            shards[i]->shared = shards[0]->shared;
+            shards[i]->compress = shards[0]->compress;
+        }
+    }
+
+    http_cache_t *cache = shards[0];
+    for (size_t i = 0; i < num_shards; i++) {
+        if (start_collector(shards[i]) == -1) {
+            http_cache_shutdown(&cache);
+            return NULL;
+        }
+    }
+
+    log_info("memory cache split into %zu shards of %zu MB, one per NUMA node", num_shards,
+             shard_config.max_size / (1024 * 1024));
+    return cache;
+}
+
+http_cache_t *cache_node_shard(http_cache_t *cache, int node) {
+    return cache->shards ? cache->shards[node % cache->num_shards] : cache;
+}
+
+// shards borrowing tiers have dropped their pointers to them by now
+static void shutdown_shard(http_cache_t **cache_ptr) {
+    http_cache_t *cache = *cache_ptr;
+
+    // queued entries are settled on the way out, which needs the collector and the disk tier
+    compress_pool_shutdown(&cache->compress);
+    stop_collector(cache);
+
+    cache_log_stats(cache);
+
+    // pending compactions hold no references, the entries themselves are freed below
+    while (cache->compact_head) {
+        compact_job_t *job = cache->compact_head;
+        cache->compact_head = job->next;
+        free(job);
+    }
 
     // Clean up collector thread resources
     pthread_mutex_destroy(&cache->collector_lock);
     pthread_cond_destroy(&cache->collector_cond);
 
+    // the writer still holds references to queued entries, let it drain first
+    disk_tier_shutdown(&cache->disk);
+    memwatch_close(&cache->memwatch);
+    shm_tier_close(&cache->shared);
+
     // Free all entries in each bucket
     for (size_t i = 0; i < cache->num_buckets; i++) {
         cache_bucket_t *bucket = &cache->buckets[i];
@@ -567,7 +1798,6 @@ void http_cache_shutdown(http_cache_t **cache_ptr) {
 
             // Destroy synchronization primitives
             pthread_mutex_destroy(&entry->lock);
-            pthread_cond_destroy(&entry->data_ready);
 
             // Free entry data
             free_entry_data(entry);
@@ -583,11 +1813,42 @@ void http_cache_shutdown(http_cache_t **cache_ptr) {
     // Destroy remaining synchronization primitives
     pthread_mutex_destroy(&cache->lru_lock);
     pthread_mutex_destroy(&cache->size_lock);
+    pthread_mutex_destroy(&cache->keys_lock);
+    radix_destroy(&cache->keys);
+    arena_destroy(&cache->arena);
 
     // Free buckets array and cache structure
+    free(cache->sweep_heap);
+    free(cache->generations);
+    free(cache->gdsf_heap);
     free(cache->buckets);
     free(cache);
     *cache_ptr = NULL;
+}
+
+void http_cache_shutdown(http_cache_t **cache_ptr) {
+    if (!cache_ptr || !*cache_ptr) {
+        return;
+    }
+
+    http_cache_t *cache = *cache_ptr;
+    http_cache_t **shards = cache->shards;
+    if (shards) {
+        // settling, the disk writer and the first shard's collector reach into every shard,
+        // so all of them stop before any shard goes away
+        compress_pool_shutdown(&cache->compress);
+        for (size_t i = 0; i < cache->num_shards; i++)
+            stop_collector(shards[i]);
+        disk_tier_shutdown(&cache->disk);
+        for (size_t i = 1; i < cache->num_shards; i++) {
+            shards[i]->compress = NULL;
+            shards[i]->disk = NULL;
+            shards[i]->shared = NULL;
+            shutdown_shard(&shards[i]);
+        }
+    }
+    shutdown_shard(cache_ptr);
+    free(shards);
 
     log_info("Cache shutdown completed successfully");
 }
\ No newline at end of file
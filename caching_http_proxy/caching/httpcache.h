@@ -2,41 +2,139 @@
 #define HTTP_CACHE_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <time.h>
+#include <sys/types.h>
 #include "../third_party/log.h"
+#include "radix.h"
 
 
 #define MAX_URL_LENGTH 2048
 #define DEFAULT_CACHE_SIZE (100 * 1024 * 1024) // 100MB default cache size
 #define MAX_BUCKETS 1024
+#define CACHE_GENERATION_SLOTS (16 * MAX_BUCKETS) // a multiple of MAX_BUCKETS, so every slot belongs to one bucket
+#define DISK_PROMOTE_MAX_SIZE (1024 * 1024) // larger disk objects are served from their segment file instead
+#define DEFAULT_MAX_OBJECT_SIZE (64 * 1024 * 1024) // 64MB largest single object
+#define NEGATIVE_TTL_MAX 300 // cap in seconds for error responses, even if the origin allows longer
+#define SWEEP_BATCH 64 // entries the collector looks at before letting go of the locks
+#define GDSF_SCAN_DEPTH 32 // heap nodes walked in priority order for an idle victim before scanning the whole heap
+#define SWEEP_RETRY 1  // seconds before a due entry that is still referenced is looked at again
+#define SWEEP_IDLE_WAIT 60 // seconds the collector sleeps when nothing is scheduled
+#define SMALL_OBJECT_SIZE (64 * 1024) // complete objects up to this size are kept in a single allocation
+#define COMPACT_EXTENT_SIZE (1024 * 1024) // larger objects are rebuilt from extents of this size
+#define COMPACT_MAX_TRIES 5 // times the collector retries an entry that still has readers before giving up
+#define STATS_INTERVAL 60 // seconds between hit ratio reports from the collector
+#define READ_WAIT_TIMEOUT 5 // seconds a reader waits for the filling connection before giving up
+#define CACHE_READ_WOULD_BLOCK (-2) // cache_entry_read_nowait caught up with the writer
 
-typedef volatile enum _state_t {
+struct disk_tier;
+struct compress_pool;
+struct memwatch;
+struct body_arena;
+struct shm_tier;
+
+typedef enum _cache_policy_t {
+    CACHE_POLICY_LRU = 0,
+    CACHE_POLICY_GDSF = 1,  // Greedy-Dual-Size-Frequency, weighs hits and fetch cost against size
+} cache_policy_t;
+
+// Content-Encoding of the stored response
+typedef enum _cache_encoding_t {
+    CACHE_ENCODING_UNKNOWN = -1,  // loaded from disk, the proxy looks at the headers on first use
+    CACHE_ENCODING_IDENTITY = 0,
+    CACHE_ENCODING_GZIP = 1,
+    CACHE_ENCODING_OTHER = 2,     // anything the proxy cannot decode, served as stored
+} cache_encoding_t;
+
+typedef enum _cache_purge_scope_t {
+    CACHE_PURGE_URL = 0,     // exactly one url
+    CACHE_PURGE_PREFIX = 1,  // every url starting with the key, a whole host is the prefix "scheme://host/"
+} cache_purge_scope_t;
+
+typedef struct _cache_config_t {
+    size_t max_size;          // memory tier budget in bytes
+    const char *disk_dir;     // directory for the disk tier segment files, NULL disables the tier
+    size_t disk_size;         // total size of all disk tier segments in bytes
+    size_t min_object_size;   // smaller responses, headers included, are not cached
+    size_t max_object_size;   // larger responses are passed through, 0 means DEFAULT_MAX_OBJECT_SIZE
+    time_t negative_ttl;      // seconds to keep 404/410/5xx responses, 0 disables negative caching
+    cache_policy_t policy;    // which entries eviction picks first
+    size_t compress_workers;  // threads gzipping text responses at rest, 0 keeps them as received
+    int adaptive_size;        // shrink below max_size when memory limits or pressure call for it
+    int huge_pages;           // keep the extents of compacted bodies in a huge page backed arena
+    const char *shared_name;  // shm_open name of a memory tier shared with other processes, NULL for none
+    size_t shared_size;       // size of that tier in bytes, if this process creates it
+    int numa;                 // one memory shard per NUMA node, workers use the shard of their node
+} cache_config_t;
+
+typedef enum _state_t {
     ENTRY_INCOMPLETE = 0,
     ENTRY_COMPLETE = 1,
     ENTRY_CANCELLED = 2
 } entry_state_t;
 
+// chunks are immutable once published, readers walk them without any lock
 typedef struct data_chunk {
     uint8_t *data;
     ssize_t size;
     struct data_chunk *next;
 } data_chunk_t;
 
+// complete entry waiting for the collector to rebuild its chunk list
+// it holds no reference so eviction is not held up, the entry is looked up in its bucket again before compacting
+typedef struct compact_job {
+    struct cache_entry *entry;
+    uint32_t hash;
+    time_t not_before;
+    int tries;
+    struct compact_job *next;
+} compact_job_t;
+
+// lets an event loop wait for an in-progress entry instead of blocking a thread on it
+typedef struct cache_watcher {
+    int wake_fd;                   // eventfd written when the entry publishes data or changes state
+    _Atomic int ready;             // set by the writer together with the wake up, cleared when armed
+    struct cache_watcher *next;
+} cache_watcher_t;
+
 // LRU list node
 typedef struct cache_entry {
     char url[MAX_URL_LENGTH];
     data_chunk_t *data_head;    // Head of data chunks list
-    data_chunk_t *data_tail;    // Tail for fast appending
-    size_t total_size;
+    data_chunk_t *data_tail;    // Tail for fast appending, only touched by the writer
+    _Atomic size_t total_size;  // published length, chunks up to here are safe to read
     // size_t current_size;
     time_t last_access;
-    entry_state_t state;
-    uint32_t refcount;
+    time_t expires;                // 0 for entries that never expire
+    time_t sweep_at;               // when the collector should look at this entry, key of the sweep heap
+    ssize_t sweep_idx;             // position in the sweep heap, -1 if not scheduled
+    _Atomic entry_state_t state;
+    _Atomic uint32_t refcount;     // first references are taken under the bucket lock, dropped anywhere
+    uint32_t hash;                 // hash_url(url), cached for bucket lookups
+    int on_disk;                   // a copy of this entry already lives in the disk tier
+    int shared;                    // a copy of this entry already lives in the shared memory tier
+    int indexed;                   // the url was added to the cache's key index
+    _Atomic int encoding;          // cache_encoding_t of the stored response
+    size_t compress_header_len;    // set by the writer if the response is worth compressing at rest, 0 otherwise
+    struct http_cache *cache;      // owning cache, for size accounting
+
+    // replacement policy state, under the cache's lru_lock
+    uint32_t hits;                 // lookups that found this entry, plus one for the fill
+    double fetch_cost;             // milliseconds the origin took to answer
+    double priority;               // GDSF key
+    ssize_t policy_idx;            // position in the GDSF heap, -1 if not in it
+
+    // body served straight from a disk tier segment, the entry is not in the hash table and dies on last release
+    int disk_fd;                   // -1 for entries held in memory
+    uint32_t disk_segment;
+    off_t disk_offset;
 
     // Synchronization
-    pthread_mutex_t lock;          // Protects entry data and condition
-    pthread_cond_t data_ready;     // Signals when new data is available
+    pthread_mutex_t lock;          // Protects expiry, the watcher list and the disk tier hand-off
+    _Atomic uint32_t publish_seq;  // futex word, bumped whenever data is published or the state changes
+    _Atomic uint32_t waiters;      // readers sleeping on publish_seq
+    cache_watcher_t *_Atomic watchers; // parked readers, fired and cleared on the next publish
 
     // Hash table links
     struct cache_entry *next;      // Next in hash bucket
@@ -55,29 +153,103 @@ typedef struct http_cache {
     cache_bucket_t *buckets;
     size_t num_buckets;
     size_t current_size;
-    size_t max_size;
+    size_t max_size;              // current budget under size_lock, moved by the memory watch
+    size_t configured_size;       // upper bound of the budget
+    size_t min_object_size;
+    _Atomic size_t max_object_size; // configured_object_size, held to half the current budget
+    size_t configured_object_size;
+    time_t negative_ttl;
+
+    cache_policy_t policy;
 
     // LRU list management
     cache_entry_t *lru_head;      // Most recently used
     cache_entry_t *lru_tail;      // Least recently used
-    pthread_mutex_t lru_lock;     // Protects LRU list modifications
+    pthread_mutex_t lru_lock;     // Protects LRU list modifications, and the GDSF heap when that policy is used
+
+    // min-heap of entries ordered by GDSF priority, unused with the LRU policy
+    cache_entry_t **gdsf_heap;
+    size_t gdsf_len;
+    size_t gdsf_cap;
+    double gdsf_clock;            // priority of the last evicted entry
 
     pthread_mutex_t size_lock; // Protects current_size
 
+    // bumped whenever an entry is inserted or detached, lets per-worker copies check they are current
+    // kept apart from the buckets so hits on the bucket locks never dirty these lines
+    _Atomic uint64_t *generations;
+
+    // every url in the buckets, lets prefix purges find their victims without walking the table
+    radix_tree_t keys;
+    pthread_mutex_t keys_lock;    // taken inside bucket locks
+
+    struct disk_tier *disk;       // second tier below the memory cache, may be NULL
+    struct compress_pool *compress; // compresses complete text responses, may be NULL
+    struct memwatch *memwatch;    // follows the memory limits of the process, NULL keeps max_size fixed
+    struct body_arena *arena;     // huge page backed extents, NULL keeps all bodies on the heap
+    struct shm_tier *shared;      // objects shared with other processes, between memory and disk, may be NULL
+    time_t shared_replayed_at;    // collector only, when purges from other processes were last applied
+    time_t memwatch_at;           // collector only, when the last sample was taken
+
+    // per NUMA node shards, every shard points at the same array, NULL on a single node
+    // the tiers below memory, the compression pool and the memory watch belong to shards[0]
+    struct http_cache **shards;
+    size_t num_shards;
+    int node;                     // index of the node the shard's memory and collector are placed on
+
     // Collector thread and collector managment management
     pthread_t collector_thread;
     volatile int collector_running;
-    pthread_mutex_t collector_lock;
+    pthread_mutex_t collector_lock;  // also protects the sweep heap
     pthread_cond_t collector_cond;
+
+    // min-heap of expiring and cancelled entries ordered by sweep_at
+    cache_entry_t **sweep_heap;
+    size_t sweep_len;
+    size_t sweep_cap;
+
+    // completed entries whose chunk lists the collector should compact, also under collector_lock
+    compact_job_t *compact_head;
+    compact_job_t *compact_tail;
+
+    // requests and bytes served from the cache versus fetched from origins
+    _Atomic uint64_t hit_objects;
+    _Atomic uint64_t miss_objects;
+    _Atomic uint64_t hit_bytes;
+    _Atomic uint64_t miss_bytes;
+    _Atomic uint64_t remote_hits; // lookups answered by the shard of another node
+    time_t stats_logged;          // collector only
 } http_cache_t;
 
-http_cache_t* http_cache_init(size_t max_size);
+http_cache_t* http_cache_init(const cache_config_t *config);
+http_cache_t *cache_node_shard(http_cache_t *cache, int node);
+uint32_t cache_hash_url(const char *url);
+uint64_t cache_generation(http_cache_t *cache, uint32_t hash);
 void http_cache_shutdown(http_cache_t **cache);
 cache_entry_t* cache_lookup(http_cache_t *cache, const char *url);
+cache_entry_t *cache_lookup_local(http_cache_t *cache, const char *url);
+cache_entry_t *cache_lookup_tiers(http_cache_t *cache, const char *url);
+int cache_admits_size(http_cache_t *cache, size_t size);
 cache_entry_t* cache_insert(http_cache_t *cache, const char *url);
 ssize_t cache_entry_read(cache_entry_t *entry, void *buf, ssize_t offset, ssize_t size);
+ssize_t cache_entry_read_nowait(cache_entry_t *entry, void *buf, ssize_t offset, ssize_t size);
+int cache_entry_watch(cache_entry_t *entry, cache_watcher_t *watcher, ssize_t offset);
+void cache_entry_unwatch(cache_entry_t *entry, cache_watcher_t *watcher);
+const void *cache_entry_contiguous(cache_entry_t *entry, size_t *size);
+ssize_t cache_entry_sendfile(cache_entry_t *entry, int out_fd, ssize_t offset, ssize_t size);
 int cache_entry_append_chunk(cache_entry_t *entry, const void *data, size_t size);
 void cache_entry_complete(cache_entry_t *entry);
+cache_entry_t *cache_entry_claim(http_cache_t *cache, cache_entry_t *entry, uint32_t hash);
+void cache_entry_set_compressible(cache_entry_t *entry, size_t header_len);
+int cache_entry_replace_data(cache_entry_t *entry, data_chunk_t *head, data_chunk_t *tail, size_t size,
+                             cache_encoding_t encoding);
+void cache_entry_settle(cache_entry_t *entry);
+void cache_entry_set_ttl(cache_entry_t *entry, time_t ttl);
+void cache_entry_set_fetch_cost(cache_entry_t *entry, double cost_ms);
+void cache_stats_request(http_cache_t *cache, int hit);
+void cache_stats_bytes(http_cache_t *cache, int hit, size_t bytes);
+void cache_log_stats(http_cache_t *cache);
+size_t cache_purge(http_cache_t *cache, const char *key, cache_purge_scope_t scope, int soft);
 void cache_entry_release(cache_entry_t *entry);
 void cache_entry_cancel(cache_entry_t *entry);
 
@@ -0,0 +1,91 @@
+#include "l1cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void clear_slot(l1_object_t *obj) {
+    free(obj->url);
+    free(obj->data);
+    memset(obj, 0, sizeof(*obj));
+}
+
+l1_cache_t *l1_cache_init(void) {
+    l1_cache_t *l1 = calloc(1, sizeof(l1_cache_t));
+    if (!l1) log_error("could not allocate per-worker cache");
+    return l1;
+}
+
+void l1_cache_destroy(l1_cache_t **l1) {
+    if (!l1 || !*l1) return;
+    for (size_t i = 0; i < L1_SLOTS; i++) {
+        clear_slot(&(*l1)->slots[i]);
+    }
+    log_debug("per-worker cache: %zu hits, %zu misses", (*l1)->hits, (*l1)->misses);
+    free(*l1);
+    *l1 = NULL;
+}
+
+// returns the worker's copy of url if it is still current, NULL otherwise
+// only the generation slot of url is read from the shared cache, and that line is written on insert and evict only
+const l1_object_t *l1_lookup(l1_cache_t *l1, http_cache_t *cache, const char *url, uint32_t hash) {
+    l1_object_t *obj = &l1->slots[hash % L1_SLOTS];
+    if (!obj->url || obj->hash != hash || strcmp(obj->url, url) != 0) {
+        l1->misses++;
+        return NULL;
+    }
+    if ((obj->expires && obj->expires <= time(NULL)) || cache_generation(cache, hash) != obj->generation) {
+        clear_slot(obj);
+        l1->misses++;
+        return NULL;
+    }
+    l1->hits++;
+    return obj;
+}
+
+// copies a small complete in-memory entry into the worker
+// generation must have been read before the entry was looked up, so a copy that raced with a replacement is dropped
+// entries of another node's shard are left out, generation does not cover them
+// returns the new copy or NULL if the entry does not qualify
+const l1_object_t *l1_admit(l1_cache_t *l1, http_cache_t *cache, cache_entry_t *entry, uint64_t generation) {
+    if (entry->cache != cache || entry->state != ENTRY_COMPLETE || entry->disk_fd >= 0 ||
+        entry->total_size > L1_MAX_OBJECT_SIZE) {
+        return NULL;
+    }
+
+    size_t size = entry->total_size;
+    uint8_t *data = malloc(size ? size : 1);
+    char *url = strdup(entry->url);
+    if (!data || !url) {
+        free(data);
+        free(url);
+        return NULL;
+    }
+
+    size_t copied = 0;
+    while (copied < size) {
+        ssize_t ret = cache_entry_read_nowait(entry, data + copied, copied, size - copied);
+        if (ret <= 0) {
+            free(data);
+            free(url);
+            return NULL;
+        }
+        copied += ret;
+    }
+
+    if (cache_generation(cache, entry->hash) != generation) {
+        free(data);
+        free(url);
+        return NULL;
+    }
+
+    l1_object_t *obj = &l1->slots[entry->hash % L1_SLOTS];
+    clear_slot(obj);
+    obj->url = url;
+    obj->hash = entry->hash;
+    obj->generation = generation;
+    obj->expires = entry->expires;
+    obj->gzip = entry->encoding == CACHE_ENCODING_GZIP;
+    obj->size = size;
+    obj->data = data;
+    return obj;
+}
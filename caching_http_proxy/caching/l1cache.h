@@ -0,0 +1,35 @@
+#ifndef L1_CACHE_H
+#define L1_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "httpcache.h"
+
+#define L1_SLOTS 256                   // direct mapped, per worker thread
+#define L1_MAX_OBJECT_SIZE (16 * 1024) // whole responses up to this size are copied into the worker
+
+// private copy of a complete shared entry, only ever touched by the owning worker
+typedef struct l1_object {
+    char *url;                 // NULL for an empty slot
+    uint32_t hash;
+    uint64_t generation;       // shared cache generation the copy was taken at
+    time_t expires;            // 0 for objects that never expire
+    size_t size;
+    int gzip;                  // the response is stored gzip encoded, clients that do not accept it skip the copy
+    uint8_t *data;             // the full response, headers included
+} l1_object_t;
+
+typedef struct l1_cache {
+    l1_object_t slots[L1_SLOTS];
+    size_t hits;
+    size_t misses;
+} l1_cache_t;
+
+l1_cache_t *l1_cache_init(void);
+void l1_cache_destroy(l1_cache_t **l1);
+const l1_object_t *l1_lookup(l1_cache_t *l1, http_cache_t *cache, const char *url, uint32_t hash);
+const l1_object_t *l1_admit(l1_cache_t *l1, http_cache_t *cache, cache_entry_t *entry, uint64_t generation);
+
+#endif // L1_CACHE_H
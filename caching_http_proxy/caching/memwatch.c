@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include "memwatch.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../third_party/log.h"
+
+// finds the cgroup of the process in /proc/self/cgroup
+// controller NULL looks for the v2 hierarchy, otherwise for the v1 hierarchy with that controller
+int cgroup_path(const char *controller, char *out, size_t len) {
+    FILE *file = fopen("/proc/self/cgroup", "re");
+    if (!file) return -1;
+
+    char line[PATH_MAX + 64];
+    int ret = -1;
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        // id:controllers:path
+        char *controllers = strchr(line, ':');
+        char *path = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!path) continue;
+        *controllers++ = '\0';
+        *path++ = '\0';
+
+        int match = 0;
+        if (!controller) {
+            match = strcmp(line, "0") == 0 && *controllers == '\0';
+        } else {
+            for (char *save, *name = strtok_r(controllers, ",", &save); name; name = strtok_r(NULL, ",", &save))
+                if (strcmp(name, controller) == 0) match = 1;
+        }
+        if (match) {
+            snprintf(out, len, "%s", strcmp(path, "/") == 0 ? "" : path);
+            ret = 0;
+            break;
+        }
+    }
+    fclose(file);
+    return ret;
+}
+
+// picks the directory of the own cgroup below root, if it holds the given file
+// inside a cgroup namespace the own group is the root of the mount, so that is tried next
+int cgroup_dir(const char *root, const char *rel, const char *probe, char *out, size_t len) {
+    char path[PATH_MAX];
+    snprintf(out, len, "%s%s", root, rel);
+    snprintf(path, sizeof(path), "%s/%s", out, probe);
+    if (access(path, R_OK) == 0) return 0;
+
+    snprintf(out, len, "%s", root);
+    snprintf(path, sizeof(path), "%s/%s", out, probe);
+    return access(path, R_OK) == 0 ? 0 : -1;
+}
+
+// the path of name inside a cgroup directory, -1 if it does not fit into out
+int cgroup_file(const char *dir, const char *name, char *out, size_t len) {
+    int ret = snprintf(out, len, "%s/%s", dir, name);
+    return ret < 0 || (size_t)ret >= len ? -1 : 0;
+}
+
+// reads a single number, "max" means no limit
+static int read_size(const char *path, size_t *value) {
+    FILE *file = fopen(path, "re");
+    if (!file) return -1;
+
+    char buf[64];
+    int ret = -1;
+    if (fgets(buf, sizeof(buf), file)) {
+        if (strncmp(buf, "max", 3) == 0) {
+            *value = SIZE_MAX;
+            ret = 0;
+        } else {
+            char *end;
+            unsigned long long parsed = strtoull(buf, &end, 10);
+            if (end != buf) {
+                *value = parsed;
+                ret = 0;
+            }
+        }
+    }
+    fclose(file);
+    return ret;
+}
+
+// reads the number following key in a "key value" file like memory.stat or /proc/meminfo
+static int read_key(const char *path, const char *key, size_t *value) {
+    FILE *file = fopen(path, "re");
+    if (!file) return -1;
+
+    char line[256];
+    size_t key_len = strlen(key);
+    int ret = -1;
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, key, key_len) == 0 && (line[key_len] == ' ' || line[key_len] == '\t')) {
+            *value = strtoull(line + key_len, NULL, 10);
+            ret = 0;
+            break;
+        }
+    }
+    fclose(file);
+    return ret;
+}
+
+// points the watch at the limit, usage and stat files of the cgroup in dir
+// a directory too long for any of them is skipped, the paths are left empty
+static int watch_cgroup(memwatch_t *watch, const char *dir, const char *limit, const char *usage) {
+    if (cgroup_file(dir, limit, watch->limit_path, sizeof(watch->limit_path)) == 0 &&
+        cgroup_file(dir, usage, watch->usage_path, sizeof(watch->usage_path)) == 0 &&
+        cgroup_file(dir, "memory.stat", watch->stat_path, sizeof(watch->stat_path)) == 0)
+        return 0;
+    log_warn("cgroup path %s is too long, its memory limit is not watched", dir);
+    watch->limit_path[0] = watch->usage_path[0] = watch->stat_path[0] = '\0';
+    return -1;
+}
+
+memwatch_t *memwatch_open(void) {
+    memwatch_t *watch = calloc(1, sizeof(memwatch_t));
+    if (!watch) {
+        log_error("could not allocate memory watch");
+        return NULL;
+    }
+
+    char rel[PATH_MAX], dir[PATH_MAX];
+    if (cgroup_path(NULL, rel, sizeof(rel)) == 0 &&
+        cgroup_dir(CGROUP_ROOT, rel, "memory.max", dir, sizeof(dir)) == 0 &&
+        watch_cgroup(watch, dir, "memory.max", "memory.current") == 0) {
+        if (cgroup_file(dir, "memory.pressure", watch->pressure_path, sizeof(watch->pressure_path)) != 0 ||
+            access(watch->pressure_path, R_OK) != 0)
+            watch->pressure_path[0] = '\0';
+        watch->inactive_key = "inactive_file";
+    } else if (cgroup_path("memory", rel, sizeof(rel)) == 0 &&
+               cgroup_dir(CGROUP_ROOT "/memory", rel, "memory.limit_in_bytes", dir, sizeof(dir)) == 0 &&
+               watch_cgroup(watch, dir, "memory.limit_in_bytes", "memory.usage_in_bytes") == 0) {
+        watch->inactive_key = "total_inactive_file";
+    }
+    if (!watch->pressure_path[0] && access("/proc/pressure/memory", R_OK) == 0)
+        snprintf(watch->pressure_path, sizeof(watch->pressure_path), "/proc/pressure/memory");
+
+    log_info("memory watch: limit from %s, pressure from %s",
+             watch->limit_path[0] ? watch->limit_path : "/proc/meminfo",
+             watch->pressure_path[0] ? watch->pressure_path : "nowhere");
+    return watch;
+}
+
+void memwatch_close(memwatch_t **watch) {
+    if (!watch || !*watch) return;
+    free(*watch);
+    *watch = NULL;
+}
+
+// returns 0 on success, -1 if not even /proc/meminfo could be read
+int memwatch_sample(memwatch_t *watch, memwatch_sample_t *sample) {
+    size_t total, available;
+    if (read_key("/proc/meminfo", "MemTotal:", &total) == -1 ||
+        read_key("/proc/meminfo", "MemAvailable:", &available) == -1) {
+        return -1;
+    }
+    sample->limit = total * 1024;
+    sample->available = available * 1024;
+
+    // v1 reports an unlimited group as a huge number, anything above physical memory is no limit
+    size_t limit, usage, inactive = 0;
+    if (watch->limit_path[0] && read_size(watch->limit_path, &limit) == 0 && limit < sample->limit &&
+        read_size(watch->usage_path, &usage) == 0) {
+        // the kernel drops clean inactive page cache before it goes for the cache's own pages
+        read_key(watch->stat_path, watch->inactive_key, &inactive);
+        usage = usage > inactive ? usage - inactive : 0;
+        size_t left = usage < limit ? limit - usage : 0;
+        sample->limit = limit;
+        if (left < sample->available)
+            sample->available = left;
+    }
+
+    sample->pressure = -1;
+    if (watch->pressure_path[0]) {
+        FILE *file = fopen(watch->pressure_path, "re");
+        if (file) {
+            if (fscanf(file, "some avg10=%lf", &sample->pressure) != 1)
+                sample->pressure = -1;
+            fclose(file);
+        }
+    }
+    return 0;
+}
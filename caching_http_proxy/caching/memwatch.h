@@ -0,0 +1,44 @@
+#ifndef MEMWATCH_H
+#define MEMWATCH_H
+
+#include <limits.h>
+#include <stddef.h>
+
+#ifndef CGROUP_ROOT
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#endif
+
+#define MEMWATCH_INTERVAL 2            // seconds between samples taken by the collector
+#define MEMWATCH_HEADROOM 10           // percent of the memory limit left to everything besides the cache
+#define MEMWATCH_MIN_BUDGET (16 * 1024 * 1024) // the cache never shrinks below this, unless configured smaller
+#define MEMWATCH_PSI_HIGH 10.0         // "some avg10" percent above which the cache gives memory back
+#define MEMWATCH_PSI_LOW 1.0           // below this the budget grows back towards the configured size
+#define MEMWATCH_SHRINK_STEP 20        // percent of the budget given up per sample under pressure
+#define MEMWATCH_GROW_STEP 5           // percent of the configured size regained per calm sample
+
+// files describing the memory limit the process runs under, empty paths are not available
+// cgroup v2 is preferred, the v1 memory controller is used on hosts that still mount it
+typedef struct memwatch {
+    char limit_path[PATH_MAX];     // memory.max or memory.limit_in_bytes
+    char usage_path[PATH_MAX];     // memory.current or memory.usage_in_bytes
+    char stat_path[PATH_MAX];      // memory.stat, inactive file pages are reclaimable and not counted as used
+    char pressure_path[PATH_MAX];  // memory.pressure of the cgroup, or the system wide /proc/pressure/memory
+    const char *inactive_key;      // name of the inactive file pages counter in memory.stat
+} memwatch_t;
+
+typedef struct memwatch_sample {
+    size_t limit;      // smaller of the cgroup limit and physical memory
+    size_t available;  // bytes that can still be allocated before running into it
+    double pressure;   // percent of the last 10 seconds some task stalled on memory, -1 if unknown
+} memwatch_sample_t;
+
+// also used to find the cpu controller
+int cgroup_path(const char *controller, char *out, size_t len);
+int cgroup_dir(const char *root, const char *rel, const char *probe, char *out, size_t len);
+int cgroup_file(const char *dir, const char *name, char *out, size_t len);
+
+memwatch_t *memwatch_open(void);
+void memwatch_close(memwatch_t **watch);
+int memwatch_sample(memwatch_t *watch, memwatch_sample_t *sample);
+
+#endif // MEMWATCH_H
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "numa.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+#include "memwatch.h"
+#include "../third_party/log.h"
+
+static numa_topology_t topology;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+// parses a sysfs list like "0-3,8-11" into set, returns the number of entries or -1
+static int read_list(const char *path, cpu_set_t *set) {
+    FILE *file = fopen(path, "re");
+    if (!file) return -1;
+
+    char buf[4096];
+    int count = 0;
+    CPU_ZERO(set);
+    if (fgets(buf, sizeof(buf), file)) {
+        for (char *save, *range = strtok_r(buf, ",\n", &save); range; range = strtok_r(NULL, ",\n", &save)) {
+            int first, last;
+            int n = sscanf(range, "%d-%d", &first, &last);
+            if (n < 1) continue;
+            if (n == 1) last = first;
+            for (int i = first; i <= last && i < CPU_SETSIZE; i++) {
+                CPU_SET(i, set);
+                count++;
+            }
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+static long long read_number(const char *dir, const char *name) {
+    char path[PATH_MAX];
+    if (cgroup_file(dir, name, path, sizeof(path)) == -1) return -1;
+    FILE *file = fopen(path, "re");
+    if (!file) return -1;
+    long long value = -1;
+    if (fscanf(file, "%lld", &value) != 1) value = -1;
+    fclose(file);
+    return value;
+}
+
+// whole cpus worth of run time the cgroup grants, 0 without a quota
+static int cpu_quota(void) {
+    char rel[PATH_MAX], dir[PATH_MAX];
+    long long quota = -1, period = -1;
+    if (cgroup_path(NULL, rel, sizeof(rel)) == 0 && cgroup_dir(CGROUP_ROOT, rel, "cpu.max", dir, sizeof(dir)) == 0) {
+        // "max 100000" without a limit, "quota period" otherwise
+        // a directory too long for the path is treated like one without a quota
+        char path[PATH_MAX];
+        FILE *file = cgroup_file(dir, "cpu.max", path, sizeof(path)) == 0 ? fopen(path, "re") : NULL;
+        if (file) {
+            if (fscanf(file, "%lld %lld", &quota, &period) != 2) quota = -1;
+            fclose(file);
+        }
+    } else if (cgroup_path("cpu", rel, sizeof(rel)) == 0 &&
+               cgroup_dir(CGROUP_ROOT "/cpu", rel, "cpu.cfs_quota_us", dir, sizeof(dir)) == 0) {
+        quota = read_number(dir, "cpu.cfs_quota_us");
+        period = read_number(dir, "cpu.cfs_period_us");
+    }
+    if (quota <= 0 || period <= 0) return 0;
+    return (int)((quota + period - 1) / period);
+}
+
+static void discover(void) {
+    cpu_set_t allowed, online;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        CPU_ZERO(&allowed);
+        for (long i = 0; i < sysconf(_SC_NPROCESSORS_ONLN) && i < CPU_SETSIZE; i++)
+            CPU_SET(i, &allowed);
+    }
+    topology.allowed = allowed;
+    topology.num_cpus = CPU_COUNT(&allowed);
+    int quota = cpu_quota();
+    if (quota > 0 && quota < topology.num_cpus)
+        topology.num_cpus = quota;
+
+    // nodes without an allowed cpu, memory only ones or ones outside the cpuset, get no workers
+    if (read_list("/sys/devices/system/node/online", &online) > 0) {
+        for (int id = 0; id < NUMA_MAX_NODES; id++) {
+            if (!CPU_ISSET(id, &online)) continue;
+            char path[64];
+            cpu_set_t cpus;
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+            if (read_list(path, &cpus) <= 0) continue;
+            CPU_AND(&cpus, &cpus, &allowed);
+            if (CPU_COUNT(&cpus) == 0) continue;
+            topology.ids[topology.num_nodes] = id;
+            topology.cpus[topology.num_nodes] = cpus;
+            topology.num_nodes++;
+        }
+    }
+
+    if (topology.num_nodes < 2) {
+        topology.num_nodes = 1;
+        topology.ids[0] = 0;
+        topology.cpus[0] = allowed;
+    }
+    log_info("numa: %d node%s, %d usable cpu%s", topology.num_nodes, topology.num_nodes == 1 ? "" : "s",
+             topology.num_cpus, topology.num_cpus == 1 ? "" : "s");
+}
+
+const numa_topology_t *numa_topology(void) {
+    pthread_once(&topology_once, discover);
+    return &topology;
+}
+
+// restricts threads created with attr to the cpus of the node with the given index
+// by default the scheduler still moves them between those cpus, --pin-workers narrows workers to one cpu each
+int numa_thread_attr(pthread_attr_t *attr, int node) {
+    const numa_topology_t *topo = numa_topology();
+    if (topo->num_nodes < 2) return 0;
+    return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &topo->cpus[node % topo->num_nodes]);
+}
+
+// id of the cpu at position n of set, counting round when n is past the end, -1 for an empty set
+int numa_nth_cpu(const cpu_set_t *set, int n) {
+    int count = CPU_COUNT(set);
+    if (count == 0) return -1;
+    n %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && n-- == 0) return cpu;
+    }
+    return -1;
+}
+
+// asks the kernel to place the pages of a mapping on the node with the given index
+// preferred rather than bound, a full node falls back to the others instead of failing the fault
+int numa_bind(void *addr, size_t len, int node) {
+    const numa_topology_t *topo = numa_topology();
+    if (topo->num_nodes < 2) return 0;
+
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+    int id = topo->ids[node % topo->num_nodes];
+    mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0) == -1) {
+        log_warn("could not bind memory to node %d: %s", id, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+
+#define NUMA_MAX_NODES 64
+#define NUMA_REPLICATE_MAX_SIZE (4 * 1024 * 1024) // larger objects found on another node are read from there
+
+// nodes the process may run on, read once from sysfs
+// a machine without NUMA, or with only one usable node, is a single node holding every allowed cpu
+typedef struct numa_topology {
+    int num_cpus;                      // allowed cpus, capped by the cgroup cpu quota
+    cpu_set_t allowed;                 // affinity mask the process started with
+    int num_nodes;
+    int ids[NUMA_MAX_NODES];           // kernel node id of each node index
+    cpu_set_t cpus[NUMA_MAX_NODES];    // allowed cpus of each node index
+} numa_topology_t;
+
+const numa_topology_t *numa_topology(void);
+int numa_thread_attr(pthread_attr_t *attr, int node);
+int numa_nth_cpu(const cpu_set_t *set, int n);
+int numa_bind(void *addr, size_t len, int node);
+
+#endif // NUMA_H
@@ -0,0 +1,228 @@
+#include "radix.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../third_party/log.h"
+
+static radix_node_t *new_node(const char *label, size_t label_len) {
+    radix_node_t *node = calloc(1, sizeof(radix_node_t));
+    if (!node) return NULL;
+    node->label = malloc(label_len);
+    if (!node->label) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, label_len);
+    node->label_len = label_len;
+    return node;
+}
+
+static void free_subtree(radix_node_t *node) {
+    radix_node_t *child = node->child;
+    while (child) {
+        radix_node_t *next = child->sibling;
+        free_subtree(child);
+        free(child);
+        child = next;
+    }
+    free(node->label);
+}
+
+// returns the link pointing at the child whose label starts with c, or at the end of the child list
+static radix_node_t **find_child(radix_node_t *node, char c) {
+    radix_node_t **link = &node->child;
+    while (*link && (*link)->label[0] != c)
+        link = &(*link)->sibling;
+    return link;
+}
+
+// adds one occurrence of key, returns 0 on success, -1 if out of memory
+int radix_insert(radix_tree_t *tree, const char *key) {
+    radix_node_t *node = &tree->root;
+    size_t rest = strlen(key);
+
+    while (rest > 0) {
+        radix_node_t **link = find_child(node, *key);
+        radix_node_t *child = *link;
+        if (!child) {
+            child = new_node(key, rest);
+            if (!child) goto oom;
+            *link = child;
+            node = child;
+            break;
+        }
+
+        size_t common = 0;
+        while (common < child->label_len && common < rest && child->label[common] == key[common])
+            common++;
+
+        if (common < child->label_len) {
+            // split the edge, the new node takes the shared part and adopts the old child
+            radix_node_t *mid = new_node(child->label, common);
+            char *tail = malloc(child->label_len - common);
+            if (!mid || !tail) {
+                if (mid) free(mid->label);
+                free(mid);
+                free(tail);
+                goto oom;
+            }
+            memcpy(tail, child->label + common, child->label_len - common);
+            free(child->label);
+            child->label = tail;
+            child->label_len -= common;
+
+            mid->sibling = child->sibling;
+            child->sibling = NULL;
+            mid->child = child;
+            *link = mid;
+            child = mid;
+        }
+        node = child;
+        key += common;
+        rest -= common;
+    }
+
+    if (node->count++ == 0) tree->keys++;
+    return 0;
+
+oom:
+    log_error("could not allocate memory for the cache key index");
+    return -1;
+}
+
+// removes one occurrence of key below node and tidies up empty nodes on the way back
+// returns 1 if the key was found
+static int remove_below(radix_tree_t *tree, radix_node_t *node, const char *key) {
+    if (!*key) {
+        if (node->count == 0) return 0;
+        if (--node->count == 0) tree->keys--;
+        return 1;
+    }
+
+    radix_node_t **link = find_child(node, *key);
+    radix_node_t *child = *link;
+    if (!child || strncmp(child->label, key, child->label_len) != 0) return 0;
+    if (!remove_below(tree, child, key + child->label_len)) return 0;
+
+    if (child->count == 0 && !child->child) {
+        *link = child->sibling;
+        free(child->label);
+        free(child);
+    } else if (child->count == 0 && !child->child->sibling) {
+        // a node with a single child and no key of its own is folded into that child
+        radix_node_t *only = child->child;
+        char *label = malloc(child->label_len + only->label_len);
+        if (label) {
+            memcpy(label, child->label, child->label_len);
+            memcpy(label + child->label_len, only->label, only->label_len);
+            free(only->label);
+            only->label = label;
+            only->label_len += child->label_len;
+            only->sibling = child->sibling;
+            *link = only;
+            free(child->label);
+            free(child);
+        }
+    }
+    return 1;
+}
+
+void radix_remove(radix_tree_t *tree, const char *key) {
+    remove_below(tree, &tree->root, key);
+}
+
+typedef struct {
+    char *path;
+    size_t path_cap;
+    char **keys;
+    size_t count;
+    size_t cap;
+    int failed;
+} collector_t;
+
+static void collect_subtree(collector_t *c, radix_node_t *node, size_t depth) {
+    if (c->failed) return;
+    if (depth + node->label_len + 1 > c->path_cap) {
+        size_t cap = (depth + node->label_len + 1) * 2;
+        char *path = realloc(c->path, cap);
+        if (!path) {
+            c->failed = 1;
+            return;
+        }
+        c->path = path;
+        c->path_cap = cap;
+    }
+    memcpy(c->path + depth, node->label, node->label_len);
+    depth += node->label_len;
+
+    if (node->count > 0) {
+        if (c->count == c->cap) {
+            size_t cap = c->cap ? c->cap * 2 : 64;
+            char **keys = realloc(c->keys, cap * sizeof(char *));
+            if (!keys) {
+                c->failed = 1;
+                return;
+            }
+            c->keys = keys;
+            c->cap = cap;
+        }
+        c->path[depth] = '\0';
+        c->keys[c->count] = strdup(c->path);
+        if (!c->keys[c->count]) {
+            c->failed = 1;
+            return;
+        }
+        c->count++;
+    }
+
+    for (radix_node_t *child = node->child; child; child = child->sibling)
+        collect_subtree(c, child, depth);
+}
+
+// copies every key starting with prefix into a newly allocated array, the caller frees the keys and the array
+// returns the number of keys, 0 with *keys set to NULL if there are none or memory ran out
+size_t radix_collect(radix_tree_t *tree, const char *prefix, char ***keys) {
+    collector_t c = {0};
+    *keys = NULL;
+
+    // walk down to the first node whose path covers the whole prefix, base is the path length above it
+    radix_node_t *node = &tree->root;
+    size_t len = strlen(prefix), base = 0;
+    while (base < len) {
+        radix_node_t *child = *find_child(node, prefix[base]);
+        if (!child) return 0;
+        size_t n = child->label_len < len - base ? child->label_len : len - base;
+        if (strncmp(child->label, prefix + base, n) != 0) return 0;
+        node = child;
+        if (n < child->label_len || base + n == len) break;
+        base += n;
+    }
+
+    c.path_cap = base + 1;
+    c.path = malloc(c.path_cap);
+    if (!c.path) return 0;
+    memcpy(c.path, prefix, base);
+
+    if (node == &tree->root) {
+        for (radix_node_t *child = node->child; child; child = child->sibling)
+            collect_subtree(&c, child, 0);
+    } else {
+        collect_subtree(&c, node, base);
+    }
+    free(c.path);
+
+    if (c.failed) {
+        log_error("could not allocate memory to collect cache keys");
+        for (size_t i = 0; i < c.count; i++) free(c.keys[i]);
+        free(c.keys);
+        return 0;
+    }
+    *keys = c.keys;
+    return c.count;
+}
+
+void radix_destroy(radix_tree_t *tree) {
+    free_subtree(&tree->root);
+    memset(tree, 0, sizeof(*tree));
+}
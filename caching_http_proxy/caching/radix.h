@@ -0,0 +1,27 @@
+#ifndef RADIX_H
+#define RADIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// compressed prefix tree over cache keys, lets a prefix purge visit only the keys below the prefix
+// not thread safe, the cache guards it with its own lock
+typedef struct radix_node {
+    char *label;                 // edge label leading to this node, NULL for the root
+    size_t label_len;
+    uint32_t count;              // keys ending at this node, one key can be inserted several times
+    struct radix_node *child;    // first child, children never share the first label byte
+    struct radix_node *sibling;
+} radix_node_t;
+
+typedef struct radix_tree {
+    radix_node_t root;
+    size_t keys;                 // distinct keys
+} radix_tree_t;
+
+int radix_insert(radix_tree_t *tree, const char *key);
+void radix_remove(radix_tree_t *tree, const char *key);
+size_t radix_collect(radix_tree_t *tree, const char *prefix, char ***keys);
+void radix_destroy(radix_tree_t *tree);
+
+#endif // RADIX_H
@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+#include "shmtier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ROUND_UP(x, to) (((x) + (to) - 1) / (to) * (to))
+
+// region layout, everything is derived from the mapped size so every process computes the same offsets
+static void layout(shm_tier_t *tier) {
+    size_t header_size = ROUND_UP(sizeof(shm_header_t), 4096);
+    size_t per_slot = sizeof(shm_object_t) + sizeof(uint32_t) + SHM_BLOCK_SIZE;
+    size_t slots = (tier->size - header_size - 4096) / per_slot;
+    if (slots >= SHM_NONE) slots = SHM_NONE - 1;
+
+    tier->header = (shm_header_t *)tier->base;
+    tier->objects = (shm_object_t *)(tier->base + header_size);
+    tier->block_next = (_Atomic uint32_t *)(tier->objects + slots);
+    tier->blocks = tier->base + ROUND_UP((size_t)((uint8_t *)(tier->block_next + slots) - tier->base), 4096);
+    tier->header->num_slots = slots;
+    // larger objects would push out too much of what the other processes use
+    tier->max_object_size = slots * SHM_BLOCK_SIZE / 8;
+}
+
+static uint32_t chain_length(const shm_object_t *object);
+
+// marks the blocks of an object some live process is still filling, returns -1 if its chain is not intact
+// that process copies into them without the lock, so they must not be handed to anybody else
+static int keep_writing(shm_tier_t *tier, const shm_object_t *object, uint8_t *kept) {
+    uint32_t slots = tier->header->num_slots;
+    if (object->state != SHM_OBJECT_WRITING || object->writer <= 0) return -1;
+    if (object->writer != getpid() && kill(object->writer, 0) == -1 && errno == ESRCH) return -1;
+
+    uint32_t count = chain_length(object);
+    uint32_t block = object->first_block;
+    uint32_t marked = 0;
+    while (marked < count && block < slots && !kept[block]) {
+        kept[block] = 1;
+        marked++;
+        block = atomic_load_explicit(&tier->block_next[block], memory_order_relaxed);
+    }
+    if (marked == count && block == SHM_NONE) return 0;
+
+    // the blocks marked so far go back on the free list with the rest
+    block = object->first_block;
+    for (; marked > 0; marked--) {
+        kept[block] = 0;
+        block = atomic_load_explicit(&tier->block_next[block], memory_order_relaxed);
+    }
+    return -1;
+}
+
+// empties the index, every slot and block goes back on the free lists
+// also how the region is recovered after a process died in the middle of changing it,
+// objects live writers are still filling keep their slot and blocks and are published as usual once done
+static void reset_index(shm_tier_t *tier) {
+    shm_header_t *header = tier->header;
+    uint32_t slots = header->num_slots;
+
+    // with no memory for the marks every writer is dropped, they notice by the generation before each block
+    uint8_t *kept = calloc(slots ? slots : 1, 1);
+    uint8_t *keep_object = calloc(slots ? slots : 1, 1);
+    if (!kept || !keep_object) {
+        free(kept);
+        free(keep_object);
+        kept = keep_object = NULL;
+        log_error("could not allocate memory to keep the shared cache writers, dropping them too");
+    }
+    for (uint32_t i = 0; kept && i < slots; i++) {
+        if (tier->objects[i].state != SHM_OBJECT_WRITING) continue;
+        keep_object[i] = keep_writing(tier, &tier->objects[i], kept) == 0;
+    }
+
+    for (size_t i = 0; i < SHM_BUCKETS; i++)
+        header->buckets[i] = SHM_NONE;
+    header->free_objects = SHM_NONE;
+    header->free_blocks = SHM_NONE;
+    header->num_free_blocks = 0;
+    // built back to front so both free lists come out in slot order
+    for (uint32_t i = slots; i-- > 0; ) {
+        shm_object_t *object = &tier->objects[i];
+        if (!keep_object || !keep_object[i]) {
+            atomic_fetch_add_explicit(&object->generation, 1, memory_order_release);
+            object->state = SHM_OBJECT_FREE;
+            object->next = header->free_objects;
+            header->free_objects = i;
+        }
+        if (!kept || !kept[i]) {
+            atomic_store_explicit(&tier->block_next[i], header->free_blocks, memory_order_relaxed);
+            header->free_blocks = i;
+            header->num_free_blocks++;
+        }
+    }
+    header->clock_hand = 0;
+    free(kept);
+    free(keep_object);
+}
+
+// returns 0 with the region locked, -1 if the lock is beyond repair
+static int lock_region(shm_tier_t *tier) {
+    int ret = pthread_mutex_lock(&tier->header->lock);
+    if (ret == EOWNERDEAD) {
+        // the dead process may have left a list half linked, starting over empty is always consistent
+        log_warn("a process died holding the shared cache lock, dropping the shared index");
+        reset_index(tier);
+        pthread_mutex_consistent(&tier->header->lock);
+        return 0;
+    }
+    if (ret != 0) {
+        log_error("could not lock the shared cache: %s", strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+static void unlock_region(shm_tier_t *tier) {
+    pthread_mutex_unlock(&tier->header->lock);
+}
+
+static uint32_t chain_length(const shm_object_t *object) {
+    uint64_t bytes = object->url_len + object->size;
+    return bytes ? (bytes + SHM_BLOCK_SIZE - 1) / SHM_BLOCK_SIZE : 1;
+}
+
+// the url always fits into the first block, MAX_URL_LENGTH is smaller than a block
+static const char *object_url(shm_tier_t *tier, const shm_object_t *object) {
+    return (const char *)tier->blocks + (size_t)object->first_block * SHM_BLOCK_SIZE;
+}
+
+static int url_matches(shm_tier_t *tier, const shm_object_t *object, const char *key, size_t len, int prefix) {
+    if (prefix ? object->url_len < len : object->url_len != len) return 0;
+    return memcmp(object_url(tier, object), key, len) == 0;
+}
+
+// caller holds the lock
+static void free_object(shm_tier_t *tier, uint32_t idx) {
+    shm_header_t *header = tier->header;
+    shm_object_t *object = &tier->objects[idx];
+
+    if (object->state == SHM_OBJECT_READY) {
+        uint32_t *pp = &header->buckets[object->hash % SHM_BUCKETS];
+        while (*pp != SHM_NONE && *pp != idx)
+            pp = &tier->objects[*pp].next;
+        if (*pp == idx)
+            *pp = object->next;
+    }
+
+    uint32_t count = chain_length(object);
+    uint32_t last = object->first_block;
+    for (uint32_t i = 1; i < count; i++)
+        last = atomic_load_explicit(&tier->block_next[last], memory_order_relaxed);
+    atomic_store_explicit(&tier->block_next[last], header->free_blocks, memory_order_relaxed);
+    header->free_blocks = object->first_block;
+    header->num_free_blocks += count;
+
+    // readers copying the blocks right now see the new generation and drop what they copied
+    atomic_fetch_add_explicit(&object->generation, 1, memory_order_release);
+    object->state = SHM_OBJECT_FREE;
+    object->next = header->free_objects;
+    header->free_objects = idx;
+}
+
+// second chance clock over the object slots, expired objects and ones left behind by dead writers go first
+// caller holds the lock, returns 0 if an object was freed
+static int evict_one(shm_tier_t *tier) {
+    shm_header_t *header = tier->header;
+    time_t now = time(NULL);
+
+    for (uint64_t step = 0; step < 2 * (uint64_t)header->num_slots; step++) {
+        uint32_t idx = header->clock_hand;
+        header->clock_hand = idx + 1 < header->num_slots ? idx + 1 : 0;
+        shm_object_t *object = &tier->objects[idx];
+
+        if (object->state == SHM_OBJECT_WRITING) {
+            if (object->writer != getpid() && kill(object->writer, 0) == -1 && errno == ESRCH) {
+                free_object(tier, idx);
+                return 0;
+            }
+            continue;
+        }
+        if (object->state != SHM_OBJECT_READY) continue;
+        if (object->referenced && !(object->expires && object->expires <= now)) {
+            object->referenced = 0;
+            continue;
+        }
+        free_object(tier, idx);
+        return 0;
+    }
+    return -1;
+}
+
+// takes count blocks off the free list, evicting as needed
+// caller holds the lock, returns the first block of the chain or SHM_NONE
+static uint32_t alloc_chain(shm_tier_t *tier, uint32_t count) {
+    shm_header_t *header = tier->header;
+    while (header->num_free_blocks < count) {
+        if (evict_one(tier) == -1) return SHM_NONE;
+    }
+
+    uint32_t first = header->free_blocks;
+    uint32_t last = first;
+    for (uint32_t i = 1; i < count; i++)
+        last = atomic_load_explicit(&tier->block_next[last], memory_order_relaxed);
+    header->free_blocks = atomic_load_explicit(&tier->block_next[last], memory_order_relaxed);
+    atomic_store_explicit(&tier->block_next[last], SHM_NONE, memory_order_relaxed);
+    header->num_free_blocks -= count;
+    return first;
+}
+
+// caller holds the lock, returns the ready object for url or SHM_NONE
+static uint32_t find_locked(shm_tier_t *tier, const char *url, size_t len, uint32_t hash) {
+    uint32_t idx = tier->header->buckets[hash % SHM_BUCKETS];
+    while (idx != SHM_NONE) {
+        shm_object_t *object = &tier->objects[idx];
+        if (object->hash == hash && url_matches(tier, object, url, len, 0)) return idx;
+        idx = object->next;
+    }
+    return SHM_NONE;
+}
+
+static void init_region(shm_tier_t *tier) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&tier->header->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    tier->header->size = tier->size;
+    atomic_store(&tier->header->purge_epoch, 0);
+    reset_index(tier);
+}
+
+// maps the shared region called name, creating it with size bytes if no process has yet
+// a region that already exists keeps its size and contents
+// returns NULL if it can neither be created nor attached to
+shm_tier_t *shm_tier_open(const char *name, size_t size) {
+    int creator = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        creator = 0;
+        fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    }
+    if (fd == -1) {
+        log_error("could not open shared cache %s: %s", name, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (creator) {
+        size = ROUND_UP(size, 4096);
+        if (size < 2 * ROUND_UP(sizeof(shm_header_t), 4096) + SHM_BLOCK_SIZE || ftruncate(fd, size) == -1) {
+            log_error("could not size shared cache %s to %zu bytes: %s", name, size, strerror(errno));
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+    } else {
+        // the creator may not have sized it yet
+        for (int i = 0; i < SHM_ATTACH_WAIT * 100 && fstat(fd, &st) == 0 && st.st_size == 0; i++)
+            usleep(10000);
+        if (fstat(fd, &st) == -1 || st.st_size == 0) {
+            log_error("shared cache %s was never set up, remove /dev/shm/%s to start over", name, name + (name[0] == '/'));
+            close(fd);
+            return NULL;
+        }
+        size = st.st_size;
+    }
+
+    uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        log_error("could not map shared cache %s: %s", name, strerror(errno));
+        if (creator) shm_unlink(name);
+        return NULL;
+    }
+
+    shm_tier_t *tier = calloc(1, sizeof(shm_tier_t));
+    char *name_copy = strdup(name);
+    if (!tier || !name_copy) {
+        log_error("could not allocate shared cache tier");
+        free(tier);
+        free(name_copy);
+        munmap(base, size);
+        return NULL;
+    }
+    tier->name = name_copy;
+    tier->base = base;
+    tier->size = size;
+
+    if (creator) {
+        layout(tier);
+        init_region(tier);
+        atomic_store_explicit(&tier->header->magic, SHM_MAGIC, memory_order_release);
+    } else {
+        shm_header_t *header = (shm_header_t *)base;
+        for (int i = 0; i < SHM_ATTACH_WAIT * 100 &&
+                        atomic_load_explicit(&header->magic, memory_order_acquire) != SHM_MAGIC; i++)
+            usleep(10000);
+        if (atomic_load_explicit(&header->magic, memory_order_acquire) != SHM_MAGIC || header->size != size) {
+            log_error("shared cache %s was never set up, remove /dev/shm/%s to start over", name, name + (name[0] == '/'));
+            shm_tier_close(&tier);
+            return NULL;
+        }
+        layout(tier);
+    }
+    tier->purges_seen = atomic_load(&tier->header->purge_epoch);
+
+    log_info("%s shared cache %s: %zu MB, %u blocks", creator ? "created" : "attached to", name,
+             size / (1024 * 1024), tier->header->num_slots);
+    return tier;
+}
+
+// unmaps the region, it stays around for the other processes and later runs
+void shm_tier_close(shm_tier_t **tier_ptr) {
+    if (!tier_ptr || !*tier_ptr) return;
+    shm_tier_t *tier = *tier_ptr;
+    munmap(tier->base, tier->size);
+    free(tier->name);
+    free(tier);
+    *tier_ptr = NULL;
+}
+
+void shm_tier_unlink(const char *name) {
+    if (shm_unlink(name) == -1 && errno != ENOENT)
+        log_warn("could not remove shared cache %s: %s", name, strerror(errno));
+}
+
+// copies a complete memory entry into the region, replacing an older copy of the url
+// the blocks are filled without the lock, the object only becomes visible once they are
+// the chunk list is walked directly, the caller must make sure it is not swapped meanwhile
+// returns 0 on success, -1 if the entry is not eligible or does not fit
+int shm_tier_store(shm_tier_t *tier, cache_entry_t *entry) {
+    size_t size = entry->total_size;
+    size_t url_len = strlen(entry->url);
+    if (entry->state != ENTRY_COMPLETE || entry->disk_fd >= 0 || size > tier->max_object_size) return -1;
+
+    if (lock_region(tier) == -1) return -1;
+    uint32_t idx = find_locked(tier, entry->url, url_len, entry->hash);
+    if (idx != SHM_NONE)
+        free_object(tier, idx);
+
+    shm_object_t probe = {.url_len = url_len, .size = size};
+    uint32_t first = alloc_chain(tier, chain_length(&probe));
+    if (first == SHM_NONE) {
+        unlock_region(tier);
+        log_debug("no room in the shared cache for %s", entry->url);
+        return -1;
+    }
+    idx = tier->header->free_objects;
+    shm_object_t *object = &tier->objects[idx];
+    tier->header->free_objects = object->next;
+    object->hash = entry->hash;
+    object->next = SHM_NONE;
+    object->first_block = first;
+    object->url_len = url_len;
+    object->size = size;
+    object->expires = entry->expires;
+    object->writer = getpid();
+    object->state = SHM_OBJECT_WRITING;
+    uint64_t generation = atomic_load(&object->generation);
+    unlock_region(tier);
+
+    memcpy(tier->blocks + (size_t)first * SHM_BLOCK_SIZE, entry->url, url_len);
+    uint32_t block = first, slots = tier->header->num_slots;
+    size_t pos = url_len;
+    for (data_chunk_t *chunk = entry->data_head; chunk; chunk = chunk->next) {
+        for (size_t done = 0; done < (size_t)chunk->size; ) {
+            if (pos == SHM_BLOCK_SIZE) {
+                // a recovery keeps the chain of a live writer, if it did not the blocks belong to others by now
+                block = atomic_load_explicit(&tier->block_next[block], memory_order_relaxed);
+                if (block >= slots || atomic_load(&object->generation) != generation) return -1;
+                pos = 0;
+            }
+            size_t len = chunk->size - done < SHM_BLOCK_SIZE - pos ? chunk->size - done : SHM_BLOCK_SIZE - pos;
+            memcpy(tier->blocks + (size_t)block * SHM_BLOCK_SIZE + pos, chunk->data + done, len);
+            done += len;
+            pos += len;
+        }
+    }
+
+    if (lock_region(tier) == -1) return -1;
+    // a recovery may have wiped the index while the blocks were being filled
+    if (object->state == SHM_OBJECT_WRITING && atomic_load(&object->generation) == generation) {
+        // another process may have stored the same url meanwhile, the newest copy wins
+        uint32_t older = find_locked(tier, entry->url, url_len, entry->hash);
+        if (older != SHM_NONE)
+            free_object(tier, older);
+        uint32_t *bucket = &tier->header->buckets[object->hash % SHM_BUCKETS];
+        object->next = *bucket;
+        *bucket = idx;
+        object->writer = 0;
+        object->referenced = 1;
+        object->state = SHM_OBJECT_READY;
+    }
+    unlock_region(tier);
+    return 0;
+}
+
+// looks url up, expired objects are freed on the way
+// returns 0 and fills handle if it is there, -1 otherwise
+int shm_tier_find(shm_tier_t *tier, const char *url, shm_handle_t *handle) {
+    size_t len = strlen(url);
+    if (lock_region(tier) == -1) return -1;
+    uint32_t idx = find_locked(tier, url, len, cache_hash_url(url));
+    if (idx == SHM_NONE) {
+        unlock_region(tier);
+        return -1;
+    }
+    shm_object_t *object = &tier->objects[idx];
+    if (object->expires && object->expires <= time(NULL)) {
+        free_object(tier, idx);
+        unlock_region(tier);
+        return -1;
+    }
+    object->referenced = 1;
+    handle->object = idx;
+    handle->first_block = object->first_block;
+    handle->url_len = object->url_len;
+    handle->size = object->size;
+    handle->expires = object->expires;
+    handle->generation = atomic_load(&object->generation);
+    unlock_region(tier);
+    return 0;
+}
+
+// copies size bytes of the body from offset without taking the lock
+// returns 0 if the copy is good, -1 if the object was freed or replaced while it was made
+int shm_tier_read(shm_tier_t *tier, const shm_handle_t *handle, void *buf, size_t offset, size_t size) {
+    if (offset + size > handle->size) return -1;
+    uint32_t slots = tier->header->num_slots;
+    uint8_t *out = buf;
+
+    size_t pos = handle->url_len + offset;
+    uint32_t block = handle->first_block;
+    // a recycled chain may point anywhere, every hop is checked before it is followed
+    for (size_t i = 0; i < pos / SHM_BLOCK_SIZE && block < slots; i++)
+        block = atomic_load_explicit(&tier->block_next[block], memory_order_relaxed);
+    pos %= SHM_BLOCK_SIZE;
+
+    while (size > 0 && block < slots) {
+        size_t len = size < SHM_BLOCK_SIZE - pos ? size : SHM_BLOCK_SIZE - pos;
+        memcpy(out, tier->blocks + (size_t)block * SHM_BLOCK_SIZE + pos, len);
+        out += len;
+        size -= len;
+        pos = 0;
+        if (size > 0)
+            block = atomic_load_explicit(&tier->block_next[block], memory_order_relaxed);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (size > 0 || atomic_load_explicit(&tier->objects[handle->object].generation, memory_order_relaxed) !=
+                    handle->generation) {
+        return -1;
+    }
+    return 0;
+}
+
+// drops key, or every url starting with it, and records the purge for the other processes to replay
+// returns the number of shared objects freed
+size_t shm_tier_purge(shm_tier_t *tier, const char *key, int prefix) {
+    size_t len = strlen(key);
+    size_t purged = 0;
+    if (len >= MAX_URL_LENGTH || lock_region(tier) == -1) return 0;
+
+    if (!prefix) {
+        uint32_t idx = find_locked(tier, key, len, cache_hash_url(key));
+        if (idx != SHM_NONE) {
+            free_object(tier, idx);
+            purged++;
+        }
+    } else {
+        for (uint32_t idx = 0; idx < tier->header->num_slots; idx++) {
+            shm_object_t *object = &tier->objects[idx];
+            if (object->state == SHM_OBJECT_READY && url_matches(tier, object, key, len, 1)) {
+                free_object(tier, idx);
+                purged++;
+            }
+        }
+    }
+
+    uint64_t epoch = atomic_load(&tier->header->purge_epoch) + 1;
+    shm_purge_t *record = &tier->header->purges[epoch % SHM_PURGE_RING];
+    memcpy(record->key, key, len + 1);
+    record->prefix = prefix;
+    record->origin = getpid();
+    record->epoch = epoch;
+    atomic_store(&tier->header->purge_epoch, epoch);
+    unlock_region(tier);
+    return purged;
+}
+
+// collects the purges other processes made since the last call, for the caller to apply to its own memory
+// if more happened than the ring holds, a single prefix purge of "" stands in for everything
+// returns the number of purges in *purges, which the caller frees
+size_t shm_tier_replay(shm_tier_t *tier, shm_purge_t **purges) {
+    *purges = NULL;
+    uint64_t epoch = atomic_load(&tier->header->purge_epoch);
+    if (epoch == tier->purges_seen || lock_region(tier) == -1) return 0;
+
+    epoch = atomic_load(&tier->header->purge_epoch);
+    uint64_t missed = epoch - tier->purges_seen;
+    size_t count = missed > SHM_PURGE_RING ? 1 : missed;
+    shm_purge_t *out = malloc(count * sizeof(shm_purge_t));
+    if (!out) {
+        unlock_region(tier);
+        return 0;
+    }
+
+    size_t n = 0;
+    if (missed > SHM_PURGE_RING) {
+        out[n++] = (shm_purge_t){.epoch = epoch, .prefix = 1, .key = ""};
+    } else {
+        for (uint64_t e = tier->purges_seen + 1; e <= epoch; e++) {
+            shm_purge_t *record = &tier->header->purges[e % SHM_PURGE_RING];
+            if (record->epoch == e && record->origin != getpid())
+                out[n++] = *record;
+        }
+    }
+    tier->purges_seen = epoch;
+    unlock_region(tier);
+
+    if (n == 0) free(out);
+    else *purges = out;
+    return n;
+}
@@ -0,0 +1,94 @@
+#ifndef SHM_TIER_H
+#define SHM_TIER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "httpcache.h"
+
+#define SHM_MAGIC 0x48435348u          // "HCSH"
+#define SHM_BLOCK_SIZE 4096            // body storage unit, an object is a chain of blocks holding its url and body
+#define SHM_BUCKETS 16384
+#define SHM_PURGE_RING 64              // purges kept for the other processes to replay
+#define SHM_ATTACH_WAIT 5              // seconds to wait for the process creating the region to set it up
+#define SHM_REPLAY_INTERVAL 1          // seconds between looks at the purges of the other processes
+#define SHM_NONE UINT32_MAX
+
+typedef enum _shm_state_t {
+    SHM_OBJECT_FREE = 0,
+    SHM_OBJECT_WRITING = 1,  // blocks are being filled by the process in writer, invisible to lookups
+    SHM_OBJECT_READY = 2,
+} shm_state_t;
+
+// object slot, one per block since an object takes at least one
+typedef struct _shm_object_t {
+    uint32_t hash;
+    uint32_t next;                 // next object in the bucket, or in the free list
+    uint32_t first_block;
+    uint32_t url_len;
+    uint64_t size;                 // body bytes, they follow the url in the block chain
+    int64_t expires;               // 0 for objects that never expire
+    _Atomic uint64_t generation;   // bumped whenever the slot is freed, readers compare it after copying
+    pid_t writer;
+    uint8_t state;                 // shm_state_t
+    uint8_t referenced;            // second chance bit for the eviction clock
+} shm_object_t;
+
+typedef struct _shm_purge_t {
+    uint64_t epoch;
+    uint32_t prefix;               // every url starting with key, otherwise exactly key
+    pid_t origin;                  // process that purged, it has applied the purge already
+    char key[MAX_URL_LENGTH];
+} shm_purge_t;
+
+// start of the region, followed by the object slots, the block links and the blocks
+// everything but the block contents is under lock, which is process shared and robust
+typedef struct _shm_header_t {
+    _Atomic uint32_t magic;        // stored last by the creating process
+    uint32_t num_slots;            // objects and blocks
+    uint64_t size;                 // bytes mapped
+    pthread_mutex_t lock;
+    uint32_t buckets[SHM_BUCKETS];
+    uint32_t free_objects;
+    uint32_t free_blocks;
+    uint32_t num_free_blocks;
+    uint32_t clock_hand;
+    _Atomic uint64_t purge_epoch;
+    shm_purge_t purges[SHM_PURGE_RING];
+} shm_header_t;
+
+// a process's view of the region
+typedef struct shm_tier {
+    char *name;                    // shm_open name, the region outlives the processes using it
+    uint8_t *base;
+    size_t size;
+    shm_header_t *header;
+    shm_object_t *objects;
+    _Atomic uint32_t *block_next;  // read without the lock by readers walking a chain
+    uint8_t *blocks;
+    size_t max_object_size;
+    uint64_t purges_seen;          // replayed up to this epoch, collector only
+} shm_tier_t;
+
+// a located object, its contents are only valid if the generation still matches after they were copied
+typedef struct _shm_handle_t {
+    uint32_t object;
+    uint32_t first_block;
+    uint32_t url_len;
+    uint64_t size;
+    uint64_t generation;
+    time_t expires;
+} shm_handle_t;
+
+shm_tier_t *shm_tier_open(const char *name, size_t size);
+void shm_tier_close(shm_tier_t **tier);
+void shm_tier_unlink(const char *name);
+int shm_tier_store(shm_tier_t *tier, cache_entry_t *entry);
+int shm_tier_find(shm_tier_t *tier, const char *url, shm_handle_t *handle);
+int shm_tier_read(shm_tier_t *tier, const shm_handle_t *handle, void *buf, size_t offset, size_t size);
+size_t shm_tier_purge(shm_tier_t *tier, const char *key, int prefix);
+size_t shm_tier_replay(shm_tier_t *tier, shm_purge_t **purges);
+
+#endif // SHM_TIER_H
@@ -1,10 +1,227 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "proxy/proxy.h"
+#include "proxy/warmup.h"
 
 #define SERVER_PORT 8080
+#define CACHE_SIZE_MB 1000
+#define DISK_SIZE_MB 10240
+#define MAX_OBJECT_MB 64
+#define COMPRESS_WORKERS 2
+#define SHARED_CACHE_MB 1024
+
+// long options without a short form
+enum {
+    OPT_MIN_OBJECT_BYTES = 256,
+    OPT_MAX_OBJECT_MB,
+    OPT_NEGATIVE_TTL,
+    OPT_EVICTION,
+    OPT_COMPRESS_WORKERS,
+    OPT_WARMUP,
+    OPT_WARMUP_CONCURRENCY,
+    OPT_WARMUP_RATE,
+    OPT_FIXED_CACHE_SIZE,
+    OPT_HUGE_PAGES,
+    OPT_NO_NUMA,
+    OPT_PROCESSES,
+    OPT_MAX_CONNECTIONS,
+    OPT_WORKERS,
+    OPT_PIN_WORKERS,
+    OPT_ACCEPT_CPU,
+    OPT_ACCEPT_THREAD,
+    OPT_IO_URING,
+    OPT_SHARED_CACHE,
+    OPT_SHARED_CACHE_MB,
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -p, --port PORT         listening port (default %d)\n"
+            "  -m, --cache-mb MB       memory cache size, shrunk while memory is tight (default %d)\n"
+            "  --fixed-cache-size      keep the memory cache size regardless of memory limits and pressure\n"
+            "  --huge-pages            keep large cached bodies on 2MB huge pages (hugetlbfs or transparent)\n"
+            "  --no-numa               one memory cache for all NUMA nodes instead of a shard per node\n"
+            "  --processes N           serve from N forked processes sharing one cache, no disk tier (default 1)\n"
+            "  --max-connections N     open client connections per process at most (default: fit the descriptor limit)\n"
+            "  --workers N             worker threads per process (default: one per cpu the affinity mask and quota allow)\n"
+            "  --pin-workers           pin every worker to a cpu of its own\n"
+            "  --accept-thread         accept on one thread handing clients to the workers, instead of a\n"
+            "                          SO_REUSEPORT listener per worker\n"
+            "  --dedicated-accept-cpu  keep one cpu for the accept thread, the workers use the others (implies --accept-thread)\n"
+            "  --io-uring              workers wait for clients on io_uring instead of poll(), poll() if the kernel has none\n"
+            "  --shared-cache NAME     share cached objects with other processes through /dev/shm/NAME\n"
+            "  --shared-cache-mb MB    size of the shared cache when this process creates it (default %d)\n"
+            "  -d, --disk-dir DIR      enable the disk tier with segment files in DIR\n"
+            "  -D, --disk-mb MB        disk tier size (default %d)\n"
+            "  --min-object-bytes N    do not cache responses smaller than N bytes (default 0)\n"
+            "  --max-object-mb MB      pass through responses larger than this (default %d)\n"
+            "  --negative-ttl SEC      cache 404/410/5xx responses for SEC seconds (default 0, off)\n"
+            "  --eviction POLICY       lru or gdsf (size, frequency and fetch cost aware) (default lru)\n"
+            "  --compress-workers N    threads storing text responses gzip compressed, 0 disables (default %d)\n"
+            "  --warmup FILE           prefetch the urls in FILE at startup, a url list or an access log\n"
+            "  --warmup-concurrency N  warmup fetches in flight, 0 disables warmup and PREFETCH (default %d)\n"
+            "  --warmup-rate N         warmup fetches started per second at most (default %d)\n",
+            prog, SERVER_PORT, CACHE_SIZE_MB, SHARED_CACHE_MB, DISK_SIZE_MB, MAX_OBJECT_MB, COMPRESS_WORKERS,
+            WARMUP_CONCURRENCY, WARMUP_RATE);
+}
+
+int main(int argc, char *argv[]) {
+    proxy_config_t config = {
+        .port = SERVER_PORT,
+        .cache = {
+            .max_size = (size_t)CACHE_SIZE_MB * 1024 * 1024,
+            .disk_dir = NULL,
+            .disk_size = (size_t)DISK_SIZE_MB * 1024 * 1024,
+            .min_object_size = 0,
+            .max_object_size = (size_t)MAX_OBJECT_MB * 1024 * 1024,
+            .negative_ttl = 0,
+            .policy = CACHE_POLICY_LRU,
+            .compress_workers = COMPRESS_WORKERS,
+            .adaptive_size = 1,
+            .huge_pages = 0,
+            .numa = 1,
+            .shared_name = NULL,
+            .shared_size = (size_t)SHARED_CACHE_MB * 1024 * 1024,
+        },
+        .warmup_file = NULL,
+        .warmup_concurrency = WARMUP_CONCURRENCY,
+        .warmup_rate = WARMUP_RATE,
+        .processes = 1,
+        .max_connections = 0,
+        .workers = 0,
+        .pin_workers = 0,
+        .accept_thread = 0,
+        .dedicated_accept = 0,
+        .io_uring = 0,
+    };
+
+    static const struct option long_options[] = {
+        {"port", required_argument, NULL, 'p'},
+        {"cache-mb", required_argument, NULL, 'm'},
+        {"disk-dir", required_argument, NULL, 'd'},
+        {"disk-mb", required_argument, NULL, 'D'},
+        {"min-object-bytes", required_argument, NULL, OPT_MIN_OBJECT_BYTES},
+        {"max-object-mb", required_argument, NULL, OPT_MAX_OBJECT_MB},
+        {"negative-ttl", required_argument, NULL, OPT_NEGATIVE_TTL},
+        {"eviction", required_argument, NULL, OPT_EVICTION},
+        {"compress-workers", required_argument, NULL, OPT_COMPRESS_WORKERS},
+        {"warmup", required_argument, NULL, OPT_WARMUP},
+        {"warmup-concurrency", required_argument, NULL, OPT_WARMUP_CONCURRENCY},
+        {"warmup-rate", required_argument, NULL, OPT_WARMUP_RATE},
+        {"fixed-cache-size", no_argument, NULL, OPT_FIXED_CACHE_SIZE},
+        {"huge-pages", no_argument, NULL, OPT_HUGE_PAGES},
+        {"no-numa", no_argument, NULL, OPT_NO_NUMA},
+        {"processes", required_argument, NULL, OPT_PROCESSES},
+        {"max-connections", required_argument, NULL, OPT_MAX_CONNECTIONS},
+        {"workers", required_argument, NULL, OPT_WORKERS},
+        {"pin-workers", no_argument, NULL, OPT_PIN_WORKERS},
+        {"dedicated-accept-cpu", no_argument, NULL, OPT_ACCEPT_CPU},
+        {"accept-thread", no_argument, NULL, OPT_ACCEPT_THREAD},
+        {"io-uring", no_argument, NULL, OPT_IO_URING},
+        {"shared-cache", required_argument, NULL, OPT_SHARED_CACHE},
+        {"shared-cache-mb", required_argument, NULL, OPT_SHARED_CACHE_MB},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
 
-int main(void) {
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:m:d:D:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'p':
+                config.port = (uint16_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                config.cache.max_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'd':
+                config.cache.disk_dir = optarg;
+                break;
+            case 'D':
+                config.cache.disk_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case OPT_MIN_OBJECT_BYTES:
+                config.cache.min_object_size = strtoull(optarg, NULL, 10);
+                break;
+            case OPT_MAX_OBJECT_MB:
+                config.cache.max_object_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case OPT_NEGATIVE_TTL:
+                config.cache.negative_ttl = strtol(optarg, NULL, 10);
+                break;
+            case OPT_EVICTION:
+                if (strcmp(optarg, "lru") == 0) {
+                    config.cache.policy = CACHE_POLICY_LRU;
+                } else if (strcmp(optarg, "gdsf") == 0) {
+                    config.cache.policy = CACHE_POLICY_GDSF;
+                } else {
+                    fprintf(stderr, "unknown eviction policy: %s\n", optarg);
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case OPT_COMPRESS_WORKERS:
+                config.cache.compress_workers = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_WARMUP:
+                config.warmup_file = optarg;
+                break;
+            case OPT_WARMUP_CONCURRENCY:
+                config.warmup_concurrency = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_WARMUP_RATE:
+                config.warmup_rate = strtod(optarg, NULL);
+                break;
+            case OPT_FIXED_CACHE_SIZE:
+                config.cache.adaptive_size = 0;
+                break;
+            case OPT_HUGE_PAGES:
+                config.cache.huge_pages = 1;
+                break;
+            case OPT_NO_NUMA:
+                config.cache.numa = 0;
+                break;
+            case OPT_PROCESSES:
+                config.processes = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_MAX_CONNECTIONS:
+                config.max_connections = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_WORKERS:
+                config.workers = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_PIN_WORKERS:
+                config.pin_workers = 1;
+                break;
+            case OPT_ACCEPT_CPU:
+                config.dedicated_accept = 1;
+                config.accept_thread = 1;
+                break;
+            case OPT_ACCEPT_THREAD:
+                config.accept_thread = 1;
+                break;
+            case OPT_IO_URING:
+                config.io_uring = 1;
+                break;
+            case OPT_SHARED_CACHE:
+                config.cache.shared_name = optarg;
+                break;
+            case OPT_SHARED_CACHE_MB:
+                config.cache.shared_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
 
-    proxy_start(SERVER_PORT);
+    proxy_start(&config);
 
     return 0;
 }
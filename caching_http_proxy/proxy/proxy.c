@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "proxy.h"
 
 #include <assert.h>
@@ -9,13 +10,21 @@
 #include <string.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <zlib.h>
 
 #include "../third_party/log.h"
 
 #include "../threading/threadpool.h"
 #include "../caching/httpcache.h"
+#include "../caching/numa.h"
+#include "../caching/shmtier.h"
+#include "warmup.h"
 
 static pthread_mutex_t searchCreateMutex;
+static warmup_t *warmup;
 
 static void disconnect(int sock) {
     int error = 0;
@@ -155,8 +164,279 @@ ssize_t send_buffer(int sockfd, const void *buffer, size_t buflen) {
     return total_sent_bytes;
 }
 
+// sends bytes [offset, offset + len) of a complete entry to the client
+// disk backed entries go through sendfile, memory entries are copied chunk by chunk
 // returns 0 on success, -1 on error
-int handle_cached_request(cache_entry_t *entry, int client_fd) {
+static int send_entry_range(cache_entry_t *entry, int client_fd, ssize_t offset, ssize_t len) {
+    if (entry->disk_fd >= 0) {
+        return cache_entry_sendfile(entry, client_fd, offset, len) == len ? 0 : -1;
+    }
+
+    char buffer[8192];
+    while (len > 0) {
+        ssize_t want = len < (ssize_t)sizeof(buffer) ? len : (ssize_t)sizeof(buffer);
+        ssize_t bytes_read = cache_entry_read(entry, buffer, offset, want);
+        if (bytes_read <= 0) {
+            log_error("cache failed");
+            return -1;
+        }
+        if (send_buffer(client_fd, buffer, bytes_read) < 0) {
+            log_error("could not send cached data to client");
+            return -1;
+        }
+        offset += bytes_read;
+        len -= bytes_read;
+    }
+    return 0;
+}
+
+// parses a single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range against a body of body_len bytes
+// returns 0 and fills first/last on success, -1 if the range is malformed, unsatisfiable or has several parts
+static int parse_range(const struct phr_header *range, ssize_t body_len, ssize_t *first, ssize_t *last) {
+    char value[128];
+    if (range->value_len >= sizeof(value) || body_len <= 0) return -1;
+    memcpy(value, range->value, range->value_len);
+    value[range->value_len] = '\0';
+
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',')) return -1;
+    char *spec = value + 6;
+    char *dash = strchr(spec, '-');
+    if (!dash) return -1;
+
+    char *end;
+    if (dash == spec) {
+        long long suffix = strtoll(dash + 1, &end, 10);
+        if (*end != '\0' || suffix <= 0) return -1;
+        *first = suffix >= body_len ? 0 : body_len - suffix;
+        *last = body_len - 1;
+        return 0;
+    }
+
+    long long from = strtoll(spec, &end, 10);
+    if (end != dash || from < 0 || from >= body_len) return -1;
+    long long to = body_len - 1;
+    if (dash[1] != '\0') {
+        to = strtoll(dash + 1, &end, 10);
+        if (*end != '\0' || to < from) return -1;
+        if (to >= body_len) to = body_len - 1;
+    }
+    *first = from;
+    *last = to;
+    return 0;
+}
+
+// reads and parses the header block of a complete cached response into head
+// returns the header length or -1 if it cannot be parsed
+static ssize_t read_cached_headers(cache_entry_t *entry, char *head, size_t head_size, response_t *response) {
+    ssize_t head_read = cache_entry_read(entry, head, 0, head_size - 1);
+    if (head_read <= 0) return -1;
+    head[head_read] = '\0';
+
+    char *headerend_pos = strstr(head, "\r\n\r\n");
+    if (!headerend_pos) return -1;
+    ssize_t header_len = headerend_pos + 4 - head;
+
+    response->numHeaders = sizeof(response->headers) / sizeof(response->headers[0]);
+    if (phr_parse_response(head, header_len, &response->minorVersion, &response->status, &response->msg,
+                           &response->msg_len, response->headers, &response->numHeaders, 0) < 0) {
+        return -1;
+    }
+    return header_len;
+}
+
+// answers a single range request from a complete cached 200 response with a 206
+// returns 0 on success, -1 on send error, 1 if the range could not be applied and the full object should be sent
+static int handle_cached_range(cache_entry_t *entry, int client_fd, const struct phr_header *range_header) {
+    char head[BUFFER_SIZE];
+    response_t response;
+    ssize_t header_len = read_cached_headers(entry, head, sizeof(head), &response);
+    if (header_len < 0 || response.status != 200) return 1;
+    // a chunked body's bytes include the chunk framing, they are no entity range
+    if (findHeader(response.headers, response.numHeaders, "Transfer-Encoding")) return 1;
+
+    ssize_t body_len = entry->total_size - header_len;
+    ssize_t first, last;
+    if (parse_range(range_header, body_len, &first, &last) == -1) return 1;
+
+    char out[BUFFER_SIZE + 256];
+    size_t out_len = snprintf(out, sizeof(out), "HTTP/1.%d 206 Partial Content\r\n", response.minorVersion);
+    for (size_t i = 0; i < response.numHeaders; i++) {
+        const struct phr_header *h = &response.headers[i];
+        if (!h->name || (h->name_len == 14 && strncasecmp(h->name, "Content-Length", 14) == 0) ||
+            (h->name_len == 13 && strncasecmp(h->name, "Content-Range", 13) == 0)) {
+            continue;
+        }
+        out_len += snprintf(out + out_len, sizeof(out) - out_len, "%.*s: %.*s\r\n",
+                            (int)h->name_len, h->name, (int)h->value_len, h->value);
+        if (out_len >= sizeof(out)) return 1;
+    }
+    out_len += snprintf(out + out_len, sizeof(out) - out_len,
+                        "Content-Range: bytes %zd-%zd/%zd\r\nContent-Length: %zd\r\n\r\n",
+                        first, last, body_len, last - first + 1);
+    if (out_len >= sizeof(out)) return 1;
+
+    if (send_buffer(client_fd, out, out_len) < 0) return -1;
+    return send_entry_range(entry, client_fd, header_len + first, last - first + 1);
+}
+
+// returns 1 if the client lists gzip in Accept-Encoding without ruling it out with q=0
+static int accepts_gzip(request_t *request) {
+    struct phr_header *accept = findHeader(request->headers, request->numHeaders, "Accept-Encoding");
+    if (!accept) return 0;
+
+    char value[256];
+    size_t len = accept->value_len < sizeof(value) - 1 ? accept->value_len : sizeof(value) - 1;
+    memcpy(value, accept->value, len);
+    value[len] = '\0';
+
+    // an explicit gzip decides, otherwise a wildcard does, so every coding is looked at first
+    int gzip = -1, wildcard = -1;
+    char *save;
+    for (char *token = strtok_r(value, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        while (*token == ' ' || *token == '\t') token++;
+        size_t name_len = strcspn(token, "; \t");
+        char *params = token + name_len;
+        char *q = strstr(params, "q=");
+        int accepted = !q || strtod(q + 2, NULL) > 0;
+        if (name_len == 4 && strncasecmp(token, "gzip", 4) == 0)
+            gzip = accepted;
+        else if (name_len == 1 && token[0] == '*')
+            wildcard = accepted;
+    }
+    return gzip >= 0 ? gzip : wildcard > 0;
+}
+
+static cache_encoding_t response_encoding(response_t *response) {
+    struct phr_header *ce = findHeader(response->headers, response->numHeaders, "Content-Encoding");
+    if (!ce || (ce->value_len == 8 && strncasecmp(ce->value, "identity", 8) == 0)) return CACHE_ENCODING_IDENTITY;
+    if ((ce->value_len == 4 && strncasecmp(ce->value, "gzip", 4) == 0) ||
+        (ce->value_len == 6 && strncasecmp(ce->value, "x-gzip", 6) == 0)) {
+        return CACHE_ENCODING_GZIP;
+    }
+    return CACHE_ENCODING_OTHER;
+}
+
+// text like responses are worth storing gzip compressed, the pool decides afterwards if it actually pays off
+static int is_compressible(response_t *response) {
+    static const char *const types[] = {
+        "text/", "application/javascript", "application/json", "application/xml", "application/xhtml+xml",
+        "application/rss+xml", "application/atom+xml", "image/svg+xml",
+    };
+    if (response->status != 200 || response_encoding(response) != CACHE_ENCODING_IDENTITY ||
+        findHeader(response->headers, response->numHeaders, "Transfer-Encoding")) {
+        return 0;
+    }
+    struct phr_header *ct = findHeader(response->headers, response->numHeaders, "Content-Type");
+    if (!ct) return 0;
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        size_t len = strlen(types[i]);
+        if (ct->value_len >= len && strncasecmp(ct->value, types[i], len) == 0) return 1;
+    }
+    return 0;
+}
+
+// objects loaded back from the disk tier do not know how they are encoded until somebody looks
+static void resolve_encoding(cache_entry_t *entry) {
+    if (entry->encoding != CACHE_ENCODING_UNKNOWN || entry->state != ENTRY_COMPLETE) return;
+    char head[BUFFER_SIZE];
+    response_t response;
+    entry->encoding = read_cached_headers(entry, head, sizeof(head), &response) < 0
+                          ? CACHE_ENCODING_OTHER : response_encoding(&response);
+}
+
+// sends a gzip stored response to a client that did not ask for gzip, inflating the body on the way out
+// the decoded length is not known up front, so the response ends when the connection is closed
+// returns 1 without sending anything for a chunked body, the framing is not gzip data and it goes out as stored
+// returns 0 on success, -1 on error
+static int send_gunzipped(cache_entry_t *entry, int client_fd) {
+    char head[BUFFER_SIZE];
+    response_t response;
+    ssize_t header_len = read_cached_headers(entry, head, sizeof(head), &response);
+    if (header_len < 0) return -1;
+    if (findHeader(response.headers, response.numHeaders, "Transfer-Encoding")) return 1;
+
+    char out[BUFFER_SIZE + 256];
+    size_t out_len = snprintf(out, sizeof(out), "HTTP/1.%d %d %.*s\r\n", response.minorVersion, response.status,
+                              (int)response.msg_len, response.msg);
+    for (size_t i = 0; i < response.numHeaders; i++) {
+        const struct phr_header *h = &response.headers[i];
+        if (!h->name || (h->name_len == 14 && strncasecmp(h->name, "Content-Length", 14) == 0) ||
+            (h->name_len == 16 && strncasecmp(h->name, "Content-Encoding", 16) == 0) ||
+            (h->name_len == 10 && strncasecmp(h->name, "Connection", 10) == 0)) {
+            continue;
+        }
+        // the decoded bytes differ from the ones the origin's strong validator was for
+        int weaken = h->name_len == 4 && strncasecmp(h->name, "ETag", 4) == 0 &&
+                     !(h->value_len >= 2 && strncmp(h->value, "W/", 2) == 0);
+        out_len += snprintf(out + out_len, sizeof(out) - out_len, "%.*s: %s%.*s\r\n",
+                            (int)h->name_len, h->name, weaken ? "W/" : "", (int)h->value_len, h->value);
+        if (out_len >= sizeof(out)) return -1;
+    }
+    out_len += snprintf(out + out_len, sizeof(out) - out_len, "Connection: close\r\n\r\n");
+    if (out_len >= sizeof(out)) return -1;
+    if (send_buffer(client_fd, out, out_len) < 0) return -1;
+
+    z_stream zs = {0};
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+        log_error("could not initialise inflate for %s", entry->url);
+        return -1;
+    }
+    uint8_t in[8192], plain[16384];
+    ssize_t offset = header_len;
+    int status = Z_OK, ret = 0;
+    while (status != Z_STREAM_END) {
+        if (zs.avail_in == 0) {
+            ssize_t bytes_read = cache_entry_read(entry, in, offset, sizeof(in));
+            if (bytes_read <= 0) {
+                if (bytes_read == 0) log_error("gzip body of %s is truncated", entry->url);
+                ret = -1;
+                break;
+            }
+            offset += bytes_read;
+            zs.next_in = in;
+            zs.avail_in = bytes_read;
+        }
+        zs.next_out = plain;
+        zs.avail_out = sizeof(plain);
+        status = inflate(&zs, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END) {
+            log_error("could not inflate %s: %s", entry->url, zs.msg ? zs.msg : "unknown error");
+            ret = -1;
+            break;
+        }
+        size_t produced = sizeof(plain) - zs.avail_out;
+        if (produced && send_buffer(client_fd, plain, produced) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    inflateEnd(&zs);
+    return ret;
+}
+
+// returns 0 on success, -1 on error
+int handle_cached_request(cache_entry_t *entry, int client_fd, const struct phr_header *range_header, int gzip_ok) {
+    if (entry->state == ENTRY_COMPLETE) {
+        // ranges of the gzip bytes mean nothing to such a client, it gets the whole decoded object
+        if (!gzip_ok && entry->encoding == CACHE_ENCODING_GZIP) {
+            int ret = send_gunzipped(entry, client_fd);
+            if (ret != 1) return ret;
+        }
+        if (range_header) {
+            int ret = handle_cached_range(entry, client_fd, range_header);
+            if (ret != 1) return ret;
+        }
+        if (entry->disk_fd >= 0) {
+            return send_entry_range(entry, client_fd, 0, entry->total_size);
+        }
+        // compacted small objects go out in one send without a copy
+        size_t size;
+        const void *body = cache_entry_contiguous(entry, &size);
+        if (body) {
+            return send_buffer(client_fd, body, size) < 0 ? -1 : 0;
+        }
+    }
+
     ssize_t offset = 0;
     char buffer[8192];
     ssize_t bytes_read;
@@ -177,6 +457,184 @@ int handle_cached_request(cache_entry_t *entry, int client_fd) {
     return 0;
 }
 
+// drops a parked reader and closes its connection
+void close_parked_request(connection_ctx_t *conn) {
+    cache_entry_unwatch(conn->entry, &conn->watcher);
+    cache_entry_release(conn->entry);
+    conn->entry = NULL;
+    if (conn->sock_fd >= 0) disconnect(conn->sock_fd);
+    conn->sock_fd = -1;
+}
+
+// streams whatever the entry has published to a coalesced reader
+// once the reader catches up with the writer it is parked until the entry's watcher fires, so the worker
+// keeps serving its other clients instead of blocking on the filling connection
+void resume_request(connection_ctx_t *conn) {
+    char buffer[8192];
+    while (1) {
+        ssize_t bytes_read = cache_entry_read_nowait(conn->entry, buffer, conn->offset, sizeof(buffer));
+        if (bytes_read == CACHE_READ_WOULD_BLOCK) {
+            if (cache_entry_watch(conn->entry, &conn->watcher, conn->offset) == 1) continue;
+            conn->parked_at = time(NULL);
+            return;
+        }
+        if (bytes_read <= 0) {
+            if (bytes_read == -1) log_error("cache failed");
+            break;
+        }
+        if (send_buffer(conn->sock_fd, buffer, bytes_read) < 0) {
+            log_error("could not send cached data to client");
+            break;
+        }
+        conn->offset += bytes_read;
+        cache_stats_bytes(conn->cache, 1, bytes_read);
+    }
+    close_parked_request(conn);
+}
+
+// returns the number of seconds an error response may be cached for, 0 if it must not be cached
+// Cache-Control from the origin wins over the configured default but is capped at NEGATIVE_TTL_MAX
+static time_t negative_ttl(http_cache_t *cache, response_t *response) {
+    switch (response->status) {
+        case 404: case 410: case 500: case 502: case 503: case 504:
+            break;
+        default:
+            return 0;
+    }
+    if (cache->negative_ttl <= 0) return 0;
+
+    struct phr_header *cc = findHeader(response->headers, response->numHeaders, "Cache-Control");
+    if (!cc) return cache->negative_ttl;
+
+    char value[256];
+    size_t len = cc->value_len < sizeof(value) - 1 ? cc->value_len : sizeof(value) - 1;
+    memcpy(value, cc->value, len);
+    value[len] = '\0';
+
+    if (strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private")) {
+        return 0;
+    }
+    const char *max_age = strcasestr(value, "s-maxage=");
+    if (max_age) {
+        max_age += 9;
+    } else if ((max_age = strcasestr(value, "max-age="))) {
+        max_age += 8;
+    } else {
+        return cache->negative_ttl;
+    }
+    long ttl = strtol(max_age, NULL, 10);
+    if (ttl <= 0) return 0;
+    return ttl > NEGATIVE_TTL_MAX ? NEGATIVE_TTL_MAX : ttl;
+}
+
+// stops caching a response that turned out not to be cacheable, the client keeps receiving it
+// readers already attached to the entry see it cancelled
+static void abandon_cache_fill(cache_entry_t **entry) {
+    log_info("no longer caching %s, passing it through", (*entry)->url);
+    cache_entry_cancel(*entry);
+    cache_entry_release(*entry);
+    *entry = NULL;
+}
+
+// purges are only taken from the machine the proxy runs on
+static int is_loopback_peer(int sock) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(sock, (struct sockaddr *)&addr, &len) == -1) return 0;
+    if (addr.ss_family == AF_INET) {
+        return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        const struct in6_addr *a = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(a) ||
+               (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return 0;
+}
+
+// answers a PURGE or PREFETCH with a short text body and closes the connection
+static void send_admin_reply(connection_ctx_t *conn, request_t *request, const char *status, const char *body) {
+    char out[512];
+    int out_len = snprintf(out, sizeof(out),
+                           "HTTP/1.%d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+                           "Connection: close\r\n\r\n%s",
+                           request->minorVersion, status, strlen(body), body);
+    if (send_buffer(conn->sock_fd, out, out_len) < 0) {
+        log_error("failed to send %s response", status);
+    }
+    disconnect(conn->sock_fd);
+    conn->sock_fd = -1;
+}
+
+// PURGE <url> drops cached copies of the url
+// X-Purge-Scope: url (default), host for everything under scheme://host/, or prefix for every url starting with it
+// X-Purge-Mode: hard (default) frees the objects, soft only marks them stale
+static void handle_purge(connection_ctx_t *conn, request_t *request) {
+    const char *status = "200 OK";
+    char body[128];
+    char key[MAX_URL_LENGTH];
+
+    if (!is_loopback_peer(conn->sock_fd)) {
+        status = "403 Forbidden";
+        snprintf(body, sizeof(body), "purge is only allowed from loopback\n");
+    } else if (request->pathLen == 0 || request->pathLen >= sizeof(key)) {
+        status = "400 Bad Request";
+        snprintf(body, sizeof(body), "bad purge url\n");
+    } else {
+        memcpy(key, request->path, request->pathLen);
+        key[request->pathLen] = '\0';
+
+        cache_purge_scope_t scope = CACHE_PURGE_URL;
+        int soft = 0;
+        struct phr_header *scope_header = findHeader(request->headers, request->numHeaders, "X-Purge-Scope");
+        struct phr_header *mode_header = findHeader(request->headers, request->numHeaders, "X-Purge-Mode");
+        if (scope_header && scope_header->value_len == 4 && strncasecmp(scope_header->value, "host", 4) == 0) {
+            // cut the url down to scheme://host/
+            char *host = strstr(key, "://");
+            char *path = strchr(host ? host + 3 : key, '/');
+            if (path) path[1] = '\0';
+            else strncat(key, "/", sizeof(key) - strlen(key) - 1);
+            scope = CACHE_PURGE_PREFIX;
+        } else if (scope_header && scope_header->value_len == 6 &&
+                   strncasecmp(scope_header->value, "prefix", 6) == 0) {
+            scope = CACHE_PURGE_PREFIX;
+        }
+        if (mode_header && mode_header->value_len == 4 && strncasecmp(mode_header->value, "soft", 4) == 0) {
+            soft = 1;
+        }
+
+        size_t purged = cache_purge(conn->cache, key, scope, soft);
+        snprintf(body, sizeof(body), "purged %zu objects\n", purged);
+    }
+    send_admin_reply(conn, request, status, body);
+}
+
+// PREFETCH <url> queues the url for the background warmup fetcher and returns right away
+static void handle_prefetch(connection_ctx_t *conn, request_t *request) {
+    const char *status = "202 Accepted";
+    char body[128] = "queued\n";
+    char url[MAX_URL_LENGTH];
+
+    if (!is_loopback_peer(conn->sock_fd)) {
+        status = "403 Forbidden";
+        snprintf(body, sizeof(body), "prefetch is only allowed from loopback\n");
+    } else if (!warmup) {
+        status = "503 Service Unavailable";
+        snprintf(body, sizeof(body), "warmup is not running\n");
+    } else if (request->pathLen == 0 || request->pathLen >= sizeof(url)) {
+        status = "400 Bad Request";
+        snprintf(body, sizeof(body), "bad prefetch url\n");
+    } else {
+        memcpy(url, request->path, request->pathLen);
+        url[request->pathLen] = '\0';
+        if (warmup_add(warmup, url) == -1) {
+            status = "503 Service Unavailable";
+            snprintf(body, sizeof(body), "url is not absolute http or the warmup queue is full\n");
+        }
+    }
+    send_admin_reply(conn, request, status, body);
+}
+
 void process_request(connection_ctx_t *conn) {
     int client_sock_fd = conn->sock_fd;
     http_cache_t *cache = conn->cache;
@@ -234,6 +692,15 @@ void process_request(connection_ctx_t *conn) {
     // log_debug("request received and parsed: %s", buffer);
     // request is now received from client and parsed ==================================================================
 
+    if (request.methodLen == 5 && strncmp(request.method, "PURGE", 5) == 0) {
+        handle_purge(conn, &request);
+        return;
+    }
+    if (request.methodLen == 8 && strncmp(request.method, "PREFETCH", 8) == 0) {
+        handle_prefetch(conn, &request);
+        return;
+    }
+
     // Only GET are accepted
     if (strncmp(request.method, "GET", 3) != 0 ) {//&& strncmp(request.method, "HEAD", 4) != 0) {
         // todo possibly forward unsupported requests without any work
@@ -278,13 +745,66 @@ void process_request(connection_ctx_t *conn) {
     url[request.pathLen] = '\0';
     // strcat(url, request.path);
 
+    struct phr_header *range_header = findHeader(request.headers, request.numHeaders, "Range");
+    int gzip_ok = accepts_gzip(&request);
+
+    // hot small objects are answered from the worker's own copy without touching the shared entry
+    // the generation is read before the shared lookup so a copy taken below can tell if it raced with a replacement
+    uint32_t url_hash = cache_hash_url(url);
+    uint64_t generation = cache_generation(cache, url_hash);
+    if (conn->l1 && !range_header) {
+        const l1_object_t *hot = l1_lookup(conn->l1, cache, url, url_hash);
+        if (hot && (gzip_ok || !hot->gzip)) {
+            cache_stats_request(cache, 1);
+            cache_stats_bytes(cache, 1, hot->size);
+            if (send_buffer(client_sock_fd, hot->data, hot->size) < 0) {
+                log_error("failed to send per-worker cached object");
+            }
+            disconnect(client_sock_fd);
+            conn->sock_fd = -1;
+            return;
+        }
+    }
+
     pthread_mutex_lock(&searchCreateMutex);
 
-    cache_entry_t *entry = cache_lookup(cache, url);
-    if (entry) {
+    cache_entry_t *entry = cache_lookup_local(cache, url);
+    if (!entry) {
+        // the lower tiers are read without the lock so a slow promotion does not stall every other lookup
+        pthread_mutex_unlock(&searchCreateMutex);
+        entry = cache_lookup_tiers(cache, url);
+        pthread_mutex_lock(&searchCreateMutex);
+        // another connection may have started filling the entry meanwhile, follow it instead of fetching twice
+        if (!entry) entry = cache_lookup_local(cache, url);
+    }
+    if (entry && entry->state == ENTRY_INCOMPLETE) {
+        pthread_mutex_unlock(&searchCreateMutex);
+
+        // another connection is still filling the entry, follow it from the worker's event loop
+        cache_stats_request(cache, 1);
+        conn->entry = entry;
+        conn->offset = 0;
+        resume_request(conn);
+    } else if (entry) {
         pthread_mutex_unlock(&searchCreateMutex);
+        cache_stats_request(cache, 1);
 
-        int ret = handle_cached_request(entry, client_sock_fd);
+        resolve_encoding(entry);
+        const l1_object_t *hot = NULL;
+        if (conn->l1 && !range_header) {
+            hot = l1_admit(conn->l1, cache, entry, generation);
+            if (hot && hot->gzip && !gzip_ok) hot = NULL;
+        }
+        int ret;
+        if (hot) {
+            ret = send_buffer(client_sock_fd, hot->data, hot->size) < 0 ? -1 : 0;
+        } else {
+            ret = handle_cached_request(entry, client_sock_fd, range_header, gzip_ok);
+        }
+        // partial responses are left out of the byte count, their length is not known here
+        if (ret == 0 && !range_header) {
+            cache_stats_bytes(cache, 1, hot ? hot->size : (size_t)entry->total_size);
+        }
         cache_entry_release(entry);
         if (ret == -1) {
             log_error("failed to handle cached request");
@@ -295,6 +815,11 @@ void process_request(connection_ctx_t *conn) {
         // return;
     } else {
         // If no cache entry was found ============================================================================
+        cache_stats_request(cache, 0);
+
+        // the time to the end of the response headers is what a later hit saves, GDSF weighs it as the fetch cost
+        struct timespec fetch_start;
+        clock_gettime(CLOCK_MONOTONIC, &fetch_start);
 
         int remote_sock_fd;
         if ((remote_sock_fd = resolve_and_connect(hostname, 80)) == -1) {
@@ -371,13 +896,27 @@ void process_request(connection_ctx_t *conn) {
         // log_debug("response parsed from %s", buffer);
 
         int do_cache = 1;
+        time_t ttl = 0;
         if (response.status != 200 && response.status != 304) {
-            do_cache = 0;
-            pthread_mutex_unlock(&searchCreateMutex);
+            // errors are cached briefly so a storm on a broken url is absorbed here instead of at the origin
+            ttl = negative_ttl(cache, &response);
+            if (ttl <= 0) {
+                do_cache = 0;
+                pthread_mutex_unlock(&searchCreateMutex);
+            }
         }
 
         ssize_t content_len = get_content_len(response.headers, response.numHeaders);
 
+        // objects outside the configured size window are passed through without touching the cache
+        // the entry will hold the headers too, so they count against the window as well
+        if (do_cache && content_len != -1 && !cache_admits_size(cache, header_len + content_len)) {
+            log_debug("not caching %s: %zd bytes with headers is outside the cacheable range", url,
+                      header_len + content_len);
+            do_cache = 0;
+            pthread_mutex_unlock(&searchCreateMutex);
+        }
+
         // this is a hack really -=-=-=-=-=-
         // if (content_len <= 0) {
         //     do_cache = 0;
@@ -397,28 +936,45 @@ void process_request(connection_ctx_t *conn) {
                 return;
             }
         }
+        if (do_cache) {
+            struct timespec fetch_end;
+            clock_gettime(CLOCK_MONOTONIC, &fetch_end);
+            cache_entry_set_fetch_cost(entry, (fetch_end.tv_sec - fetch_start.tv_sec) * 1000.0 +
+                                              (fetch_end.tv_nsec - fetch_start.tv_nsec) / 1e6);
+        }
+        if (do_cache) {
+            entry->encoding = response_encoding(&response);
+            if (is_compressible(&response))
+                cache_entry_set_compressible(entry, header_len);
+        }
+        if (do_cache && ttl > 0) {
+            cache_entry_set_ttl(entry, ttl);
+            log_debug("caching %d response for %s for %ld s", response.status, url, (long)ttl);
+        }
         // if (entry)
         if (do_cache)
             pthread_mutex_unlock(&searchCreateMutex); // cache entry now created
 
         log_debug("content-length is %d", content_len);
 
-        if (do_cache) {
-            if (cache_entry_append_chunk(entry, buffer, total_bytes_recieved)) {
-                //todo error checking
-            }
+        if (do_cache && cache_entry_append_chunk(entry, buffer, total_bytes_recieved) == -1) {
+            abandon_cache_fill(&entry);
+            do_cache = 0;
         }
 
         // pass the received response header and maybe part of response body
         bytes_sent = send_buffer(client_sock_fd, buffer, total_bytes_recieved);
         if (bytes_sent == -1) {
-            cache_entry_release(entry);
-            cache_entry_cancel(entry);
+            if (do_cache) {
+                cache_entry_cancel(entry);
+                cache_entry_release(entry);
+            }
             disconnect(client_sock_fd);
             disconnect(remote_sock_fd);
             conn->sock_fd = -1;
             return;
         }
+        cache_stats_bytes(cache, 0, bytes_sent);
         log_debug("first part of response forwarded to client");
 
         log_debug("starting recv from remote send to client loop");
@@ -428,8 +984,8 @@ void process_request(connection_ctx_t *conn) {
                 bytes_recieved = recv(remote_sock_fd, buffer, BUFFER_SIZE, 0);
                 if (bytes_recieved <= 0) {
                     if (do_cache) {
-                        cache_entry_release(entry);
                         cache_entry_cancel(entry);
+                        cache_entry_release(entry);
                     }
                     if (bytes_recieved == -1)
                         log_error("recv: %s", strerror(errno));
@@ -442,18 +998,18 @@ void process_request(connection_ctx_t *conn) {
                 }
 
                 remaining -= bytes_recieved;
+                cache_stats_bytes(cache, 0, bytes_recieved);
 
-                if (do_cache) {
-                    if (cache_entry_append_chunk(entry, buffer, bytes_recieved)) {
-                        //todo error checking
-                    }
+                if (do_cache && cache_entry_append_chunk(entry, buffer, bytes_recieved) == -1) {
+                    abandon_cache_fill(&entry);
+                    do_cache = 0;
                 }
 
                 bytes_sent = send_buffer(client_sock_fd, buffer, bytes_recieved);
                 if (bytes_sent == -1) {
                     if (do_cache) {
-                        cache_entry_release(entry);
                         cache_entry_cancel(entry);
+                        cache_entry_release(entry);
                     }
                     disconnect(client_sock_fd);
                     disconnect(remote_sock_fd);
@@ -495,6 +1051,14 @@ void process_request(connection_ctx_t *conn) {
                     return;
                 }
 
+                cache_stats_bytes(cache, 0, bytes_recieved);
+
+                // unknown length, so the size limit can only be enforced while streaming
+                if (do_cache && cache_entry_append_chunk(entry, buffer, bytes_recieved) == -1) {
+                    abandon_cache_fill(&entry);
+                    do_cache = 0;
+                }
+
                 bytes_sent = send_buffer(client_sock_fd, buffer, bytes_recieved);
                 if (bytes_sent == -1) {
                     if (do_cache) {
@@ -526,7 +1090,34 @@ static void sigterm_handler(int signum) {
     log_info("%s", msg);
 }
 
-void proxy_start(const uint16_t server_port) {
+// raises the soft descriptor limit to the hard one and sizes the connection cap to fit in it
+// a client fetching a miss holds a second descriptor towards the origin, so each is counted twice
+static uint32_t connection_limit(uint32_t configured) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        log_warn("getrlimit() failed: %s", strerror(errno));
+        return configured ? configured : 1024;
+    }
+    if (limit.rlim_cur < limit.rlim_max && limit.rlim_max != RLIM_INFINITY) {
+        rlim_t soft = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            log_warn("could not raise the descriptor limit to %lu: %s", (unsigned long)limit.rlim_max, strerror(errno));
+            limit.rlim_cur = soft;
+        }
+    }
+
+    rlim_t fits = limit.rlim_cur > 2 * FD_RESERVE ? (limit.rlim_cur - FD_RESERVE) / 2 : FD_RESERVE;
+    if (fits > UINT32_MAX) fits = UINT32_MAX;
+    if (configured > fits)
+        log_warn("%u connections need more than the %lu descriptors allowed", configured, (unsigned long)limit.rlim_cur);
+    uint32_t max_connections = configured ? configured : (uint32_t)fits;
+    log_info("accepting up to %u connections", max_connections);
+    return max_connections;
+}
+
+void proxy_start(const proxy_config_t *config) {
+    const uint16_t server_port = config->port;
     log_set_level(LOG_INFO);
 
     struct sigaction sa = {0};
@@ -540,70 +1131,157 @@ void proxy_start(const uint16_t server_port) {
 
     threadpool_t *tp_client = NULL;
     http_cache_t *cache = NULL;
-    int32_t server_sockfd = 0;
+    int32_t server_sockfd = -1;
     struct sockaddr_in server_addr = {};
-    struct sockaddr_in client_addr = {};
-    constexpr socklen_t client_addr_len = sizeof(client_addr);
 
-    server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sockfd < 0) {
-        log_fatal("socket() fail");
+    // without the accept thread every worker opens a listener of its own once the processes are forked
+    if (config->accept_thread) {
+        server_sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (server_sockfd < 0) {
+            log_fatal("socket() fail");
+            return;
+        }
+
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(server_port);
+
+        if (bind(server_sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) != 0) {
+            log_fatal("bind() failed: %s", strerror(errno));
+            close(server_sockfd);
+            return;
+        }
+
+        if (listen(server_sockfd, SERVER_SOCKET_LISTENER_QUEUE_COUNT) != 0) {
+            log_fatal("listen() failed: %s", strerror(errno));
+            close(server_sockfd);
+            return;
+        }
+    }
+
+    // the disk tier's segment files belong to a single process
+    cache_config_t cache_config = config->cache;
+    if (config->processes > 1 && cache_config.disk_dir) {
+        log_fatal("the disk tier cannot be used with more than one process");
+        if (server_sockfd >= 0) close(server_sockfd);
         return;
     }
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(server_port);
+    // forked before any thread exists, every process accepts on the inherited listener or joins the workers' group
+    // and they share cached objects through the shared tier
+    char shared_name[64];
+    int own_shared = 0, is_child = 0;
+    size_t process_index = 0;
+    pid_t *children = NULL;
+    size_t num_children = 0;
+    if (config->processes > 1) {
+        if (!cache_config.shared_name) {
+            snprintf(shared_name, sizeof(shared_name), "/http_proxy.%d", getpid());
+            cache_config.shared_name = shared_name;
+            own_shared = 1;
+        }
+        children = calloc(config->processes - 1, sizeof(pid_t));
+        for (size_t i = 1; children && i < config->processes; i++) {
+            pid_t pid = fork();
+            if (pid == -1) {
+                log_error("fork() failed: %s", strerror(errno));
+                break;
+            }
+            if (pid == 0) {
+                // children go down with the parent
+                prctl(PR_SET_PDEATHSIG, SIGINT);
+                free(children);
+                children = NULL;
+                num_children = 0;
+                // the region goes away with the parent, a child exiting early must not pull it from its siblings
+                own_shared = 0;
+                is_child = 1;
+                process_index = i;
+                log_info("process %d serving", getpid());
+                break;
+            }
+            children[num_children++] = pid;
+        }
+    }
 
-    if (bind(server_sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) != 0) {
-        log_fatal("bind() failed: %s", strerror(errno));
-        close(server_sockfd);
-        return;
+    // the processes split the cpus between them, each keeping a different one for accepting
+    const numa_topology_t *topo = numa_topology();
+    threadpool_config_t pool_config = {
+        .workers = config->workers,
+        .pin_workers = config->pin_workers,
+        .accept_cpu = -1,
+        .max_connections = connection_limit(config->max_connections),
+        .listen_port = config->accept_thread ? 0 : server_port,
+        // with several processes in the group a cpu's index would only ever pick the first one's listeners
+        .steer_to_cpu = config->processes == 1,
+        .cache = NULL,
+    };
+    int dedicated_accept = config->dedicated_accept && config->accept_thread;
+    if (!pool_config.workers && config->processes > 1) {
+        int share = topo->num_cpus / (int)config->processes - dedicated_accept;
+        pool_config.workers = share > MIN_AUTO_WORKERS ? share : MIN_AUTO_WORKERS;
     }
+    if (dedicated_accept && topo->num_cpus > 1)
+        pool_config.accept_cpu = numa_nth_cpu(&topo->allowed, CPU_COUNT(&topo->allowed) - 1 - (int)process_index);
 
-    if (listen(server_sockfd, SERVER_SOCKET_LISTENER_QUEUE_COUNT) != 0) {
-        log_fatal("listen() failed: %s", strerror(errno));
-        close(server_sockfd);
-        return;
+    // the cache comes first, workers accepting on their own listeners hand it to their clients from the start
+    cache = http_cache_init(&cache_config);
+    if (!cache) {
+        log_fatal("http_cache_init()");
+        goto end;
     }
+    pool_config.cache = cache;
 
-    tp_client = threadpool_init(client_worker_main);
+    tp_client = threadpool_init(config->io_uring ? uring_worker_main : client_worker_main, &pool_config);
     if (!tp_client) {
         log_fatal("threadpool_init()");
         goto end;
     }
 
-    cache = http_cache_init(1000 * 1024 * 1024); //1000 MB cache max size
-    if (!cache) {
-        log_fatal("http_cache_init()");
-        goto end;
+    // the warmup fetches through this very port, the backlog holds its connections until they are accepted
+    if (config->warmup_concurrency)
+        warmup = warmup_start(cache, server_port, config->warmup_concurrency, config->warmup_rate);
+    if (warmup && config->warmup_file && !is_child) {
+        warmup_load_file(warmup, config->warmup_file);
     }
 
 
+    // everything started from here on would inherit the accept thread's affinity, so it is set last
+    if (pool_config.accept_cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(pool_config.accept_cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            log_warn("could not move the accept thread to cpu %d", pool_config.accept_cpu);
+    }
 
-    // Accept loop: assign each client to a worker
-    while (1) {
-        const int client_fd = accept(server_sockfd, (struct sockaddr *) &client_addr, (socklen_t *) &client_addr_len);
-        if (client_fd < 0) {
-            if (errno == EINTR) goto loop_end;
-            log_error("accept() error: %s", strerror(errno));
+    // Accept loop: drain the listener whenever it is ready and spread each batch over the workers
+    // when the workers accept on their own this thread only waits for the signal
+    // which may well be delivered to a worker, so the poll times out to look at the flag
+    struct pollfd listener = {.fd = server_sockfd, .events = POLLIN};
+    while (keep_running) {
+        int ret = poll(&listener, server_sockfd >= 0, ACCEPT_POLL_TIMEOUT_MS);
+        if (ret < 0) {
+            if (errno != EINTR) log_error("poll() error: %s", strerror(errno));
             continue;
         }
-
-        if (threadpool_add_client(tp_client, client_fd, cache) < 0) {
-            log_warn("All workers are full; closing client fd %d.", client_fd);
-            close(client_fd);
-        }
-
-        log_debug("added client fd %d", client_fd);
-        loop_end:
-        if (!keep_running) break;
+        // out of descriptors the listener stays ready, it is given a rest instead of being polled in a loop
+        if (ret > 0 && threadpool_accept(tp_client, server_sockfd, cache) == -1)
+            usleep(ACCEPT_PAUSE_MS * 1000);
     }
 
 end:
+    for (size_t i = 0; i < num_children; i++)
+        kill(children[i], SIGINT);
+    warmup_stop(&warmup);
     threadpool_shutdown(&tp_client);
     http_cache_shutdown(&cache);
     if (server_sockfd >= 0) {
         close(server_sockfd);
     }
+    for (size_t i = 0; i < num_children; i++)
+        waitpid(children[i], NULL, 0);
+    free(children);
+    if (own_shared)
+        shm_tier_unlink(shared_name);
 }
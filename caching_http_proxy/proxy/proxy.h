@@ -6,7 +6,9 @@
 #include "../third_party/picohttpparser.h"
 #include "../threading/threadpool.h"
 
-#define SERVER_SOCKET_LISTENER_QUEUE_COUNT 128
+#define SERVER_SOCKET_LISTENER_QUEUE_COUNT 4096  // the kernel clamps it to net.core.somaxconn
+#define ACCEPT_POLL_TIMEOUT_MS 1000   // longest the accept loop takes to notice a signal another thread received
+#define FD_RESERVE 64                 // descriptors kept back from clients for the listener, cache files and logs
 #define BUFFER_SIZE 8192
 #define MAX_METHOD_NAME_LEN 32
 #define MAX_URL_NAME_LEN 2048
@@ -23,6 +25,21 @@ typedef struct _request_t {
     int minorVersion;
 } request_t;
 
+typedef struct _proxy_config_t {
+    uint16_t port;
+    cache_config_t cache;
+    const char *warmup_file;      // urls to prefetch at startup, one per line, NULL for none
+    size_t warmup_concurrency;    // 0 disables the warmup fetcher and PREFETCH
+    double warmup_rate;           // fetches started per second at most
+    size_t processes;             // processes accepting on the listener, more than one share a memory tier
+    uint32_t max_connections;     // open client connections at most, 0 sizes it from the descriptor limit
+    uint32_t workers;             // worker threads per process, 0 sizes it from the usable cpus
+    int pin_workers;              // pin each worker to one cpu
+    int accept_thread;            // accept on one thread and hand clients over instead of a listener per worker
+    int dedicated_accept;         // keep a cpu for the accept thread instead of sharing it with the workers
+    int io_uring;                 // workers wait on an io_uring of their own instead of poll()
+} proxy_config_t;
+
 typedef struct _response_t {
     int minorVersion;
     int status;
@@ -32,7 +49,9 @@ typedef struct _response_t {
     size_t numHeaders;
 } response_t;
 
-void proxy_start(const uint16_t server_port);
+void proxy_start(const proxy_config_t *config);
 void process_request(connection_ctx_t *conn);
+void resume_request(connection_ctx_t *conn);
+void close_parked_request(connection_ctx_t *conn);
 
 #endif
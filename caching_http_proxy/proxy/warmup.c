@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include "warmup.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "../third_party/log.h"
+
+// waits for the rate limiter to hand out the next start slot
+// returns 0 when the fetch may start, -1 if the warmup is being stopped
+static int pace(warmup_t *warmup) {
+    pthread_mutex_lock(&warmup->lock);
+    struct timespec now, slot;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (warmup->next_start.tv_sec < now.tv_sec ||
+        (warmup->next_start.tv_sec == now.tv_sec && warmup->next_start.tv_nsec < now.tv_nsec)) {
+        warmup->next_start = now;
+    }
+    slot = warmup->next_start;
+    long step = 1e9 / warmup->rate;
+    warmup->next_start.tv_nsec += step % 1000000000L;
+    warmup->next_start.tv_sec += step / 1000000000L + warmup->next_start.tv_nsec / 1000000000L;
+    warmup->next_start.tv_nsec %= 1000000000L;
+
+    int ret = 0;
+    while (warmup->running) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > slot.tv_sec || (now.tv_sec == slot.tv_sec && now.tv_nsec >= slot.tv_nsec)) break;
+        pthread_cond_timedwait(&warmup->cond, &warmup->lock, &slot);
+    }
+    if (!warmup->running) ret = -1;
+    pthread_mutex_unlock(&warmup->lock);
+    return ret;
+}
+
+// requests url from the proxy over loopback and reads the response to the end
+// returns the response status, or -1 if the fetch failed
+static int fetch(warmup_t *warmup, const char *url) {
+    const char *host = strstr(url, "://");
+    host = host ? host + 3 : url;
+    size_t host_len = strcspn(host, "/?#");
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        log_error("warmup socket failed: %s", strerror(errno));
+        return -1;
+    }
+    struct timeval tv = {.tv_sec = WARMUP_TIMEOUT, .tv_usec = 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(warmup->port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_error("warmup could not connect to the proxy: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    // gzip is accepted so text objects cross loopback in the form they are stored in
+    char request[MAX_URL_LENGTH + 256];
+    int len = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %.*s\r\nAccept-Encoding: gzip\r\n\r\n",
+                       url, (int)host_len, host);
+    if (len < 0 || (size_t)len >= sizeof(request) || send(sock, request, len, MSG_NOSIGNAL) != len) {
+        close(sock);
+        return -1;
+    }
+
+    char buffer[16384];
+    size_t total = 0;
+    int status = -1;
+    ssize_t ret;
+    while ((ret = recv(sock, buffer, sizeof(buffer) - 1, 0)) != 0) {
+        if (ret == -1) {
+            if (errno == EINTR && warmup->running) continue;
+            log_warn("warmup fetch of %s stopped: %s", url, strerror(errno));
+            status = -1;
+            break;
+        }
+        if (total == 0) {
+            buffer[ret] = '\0';
+            if (sscanf(buffer, "HTTP/1.%*d %d", &status) != 1) status = -1;
+        }
+        total += ret;
+    }
+    close(sock);
+    return ret == 0 ? status : -1;
+}
+
+static void *warmup_thread_func(void *arg) {
+    warmup_t *warmup = (warmup_t *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&warmup->lock);
+        while (!warmup->head && warmup->running)
+            pthread_cond_wait(&warmup->cond, &warmup->lock);
+        if (!warmup->running) {
+            pthread_mutex_unlock(&warmup->lock);
+            break;
+        }
+        warmup_url_t *item = warmup->head;
+        warmup->head = item->next;
+        if (!warmup->head) warmup->tail = NULL;
+        warmup->queued--;
+        size_t left = warmup->queued;
+        pthread_mutex_unlock(&warmup->lock);
+
+        // objects already cached are not fetched again, ones on disk are pulled back into memory by the lookup
+        cache_entry_t *entry = cache_lookup(warmup->cache, item->url);
+        if (entry) {
+            cache_entry_release(entry);
+            warmup->skipped++;
+        } else if (pace(warmup) == 0) {
+            int status = fetch(warmup, item->url);
+            if (status >= 200 && status < 400) {
+                warmup->fetched++;
+            } else {
+                warmup->failed++;
+                log_debug("warmup of %s failed with status %d", item->url, status);
+            }
+        }
+        free(item->url);
+        free(item);
+
+        if (left == 0) {
+            log_info("warmup queue drained: %zu fetched, %zu already cached, %zu failed",
+                     warmup->fetched, warmup->skipped, warmup->failed);
+        }
+    }
+    return NULL;
+}
+
+warmup_t *warmup_start(http_cache_t *cache, uint16_t port, size_t concurrency, double rate) {
+    warmup_t *warmup = calloc(1, sizeof(warmup_t));
+    if (!warmup) {
+        log_fatal("could not allocate warmup");
+        return NULL;
+    }
+    warmup->cache = cache;
+    warmup->port = port;
+    warmup->rate = rate > 0 ? rate : WARMUP_RATE;
+    warmup->threads = calloc(concurrency, sizeof(pthread_t));
+    if (!warmup->threads) {
+        log_fatal("could not allocate warmup threads");
+        free(warmup);
+        return NULL;
+    }
+
+    // the rate limiter sleeps on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&warmup->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&warmup->lock, NULL);
+    warmup->running = 1;
+
+    for (size_t i = 0; i < concurrency; i++) {
+        if (pthread_create(&warmup->threads[i], NULL, warmup_thread_func, warmup) != 0) {
+            log_error("failed to create warmup thread");
+            break;
+        }
+        warmup->num_threads++;
+    }
+    if (warmup->num_threads == 0) {
+        warmup_stop(&warmup);
+        return NULL;
+    }
+    return warmup;
+}
+
+// stops the fetchers, urls still queued are dropped
+// fetches in flight are waited for, so the proxy must still be serving when this is called
+void warmup_stop(warmup_t **warmup_ptr) {
+    if (!warmup_ptr || !*warmup_ptr) {
+        return;
+    }
+    warmup_t *warmup = *warmup_ptr;
+
+    pthread_mutex_lock(&warmup->lock);
+    warmup->running = 0;
+    pthread_cond_broadcast(&warmup->cond);
+    pthread_mutex_unlock(&warmup->lock);
+    for (size_t i = 0; i < warmup->num_threads; i++) {
+        pthread_join(warmup->threads[i], NULL);
+    }
+
+    if (warmup->queued)
+        log_info("warmup stopped with %zu urls left", warmup->queued);
+    while (warmup->head) {
+        warmup_url_t *item = warmup->head;
+        warmup->head = item->next;
+        free(item->url);
+        free(item);
+    }
+
+    pthread_mutex_destroy(&warmup->lock);
+    pthread_cond_destroy(&warmup->cond);
+    free(warmup->threads);
+    free(warmup);
+    *warmup_ptr = NULL;
+}
+
+// queues an absolute http url for prefetching
+// returns 0 on success, -1 if the url is unusable or the queue is full
+int warmup_add(warmup_t *warmup, const char *url) {
+    if (strncmp(url, "http://", 7) != 0 || strlen(url) >= MAX_URL_LENGTH) return -1;
+
+    warmup_url_t *item = malloc(sizeof(warmup_url_t));
+    char *copy = strdup(url);
+    if (!item || !copy) {
+        free(item);
+        free(copy);
+        log_error("could not allocate warmup url");
+        return -1;
+    }
+    item->url = copy;
+    item->next = NULL;
+
+    pthread_mutex_lock(&warmup->lock);
+    if (warmup->queued >= WARMUP_QUEUE_MAX) {
+        pthread_mutex_unlock(&warmup->lock);
+        free(copy);
+        free(item);
+        return -1;
+    }
+    if (warmup->tail)
+        warmup->tail->next = item;
+    else
+        warmup->head = item;
+    warmup->tail = item;
+    warmup->queued++;
+    // the rate limiter sleeps on the same condition, a signal could land on one of its waiters
+    pthread_cond_broadcast(&warmup->cond);
+    pthread_mutex_unlock(&warmup->lock);
+    return 0;
+}
+
+// queues the first http url found on every line of path
+// plain url lists and access logs with the url somewhere in the request line both work
+// returns the number of urls queued, -1 if the file cannot be read
+ssize_t warmup_load_file(warmup_t *warmup, const char *path) {
+    FILE *file = fopen(path, "re");
+    if (!file) {
+        log_error("could not open warmup list %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t added = 0;
+    while (getline(&line, &cap, file) != -1) {
+        char *url = strstr(line, "http://");
+        if (!url) continue;
+        url[strcspn(url, " \t\r\n\"'")] = '\0';
+        if (warmup_add(warmup, url) == 0) added++;
+    }
+    free(line);
+    fclose(file);
+
+    log_info("warmup queued %zd urls from %s", added, path);
+    return added;
+}
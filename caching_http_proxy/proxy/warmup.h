@@ -0,0 +1,48 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../caching/httpcache.h"
+
+#define WARMUP_CONCURRENCY 4     // fetches in flight at once
+#define WARMUP_RATE 50           // fetches started per second at most
+#define WARMUP_QUEUE_MAX 100000  // urls waiting, further ones are dropped
+#define WARMUP_TIMEOUT 30        // seconds a single fetch may stall before it is abandoned
+
+typedef struct _warmup_url_t {
+    char *url;
+    struct _warmup_url_t *next;
+} warmup_url_t;
+
+// background fetcher priming the cache, it requests urls from the proxy itself over loopback
+// so every object goes through the normal fill path, admission rules included
+typedef struct warmup {
+    http_cache_t *cache;
+    uint16_t port;                 // where the proxy listens
+    double rate;
+
+    warmup_url_t *head;
+    warmup_url_t *tail;
+    size_t queued;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct timespec next_start;    // token bucket of one, under lock
+    volatile int running;
+
+    pthread_t *threads;
+    size_t num_threads;
+
+    _Atomic size_t fetched;
+    _Atomic size_t skipped;        // already cached
+    _Atomic size_t failed;
+} warmup_t;
+
+warmup_t *warmup_start(http_cache_t *cache, uint16_t port, size_t concurrency, double rate);
+void warmup_stop(warmup_t **warmup);
+int warmup_add(warmup_t *warmup, const char *url);
+ssize_t warmup_load_file(warmup_t *warmup, const char *path);
+
+#endif // WARMUP_H
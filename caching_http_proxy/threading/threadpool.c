@@ -1,105 +1,580 @@
+#define _GNU_SOURCE
 #include "threadpool.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "../caching/numa.h"
 #include "../proxy/proxy.h"
 #include "../third_party/log.h"
+#include "uring.h"
+
+// user_data of the ring's requests that are not a connection's poll, no context lives at these addresses
+// the cancels complete with 0
+#define URING_WAKE 1
+#define URING_ACCEPT 2
+#define URING_LISTEN 3
+
+// a new context comes from the pool if there is one
+// every accepting thread takes the pool whole into a spare list of its own and allocates from that
+static connection_ctx_t *alloc_context(threadpool_t *tp, connection_ctx_t **spare) {
+    if (!*spare)
+        *spare = atomic_exchange_explicit(&tp->free_contexts, NULL, memory_order_acquire);
+    connection_ctx_t *conn = *spare;
+    if (!conn)
+        return calloc(1, sizeof(connection_ctx_t));
+    *spare = conn->handoff_next;
+    atomic_fetch_sub_explicit(&tp->pooled, 1, memory_order_relaxed);
+    memset(conn, 0, sizeof(*conn));
+    return conn;
+}
 
-void *client_worker_main(void *arg) {
-    worker_data_t *worker = (worker_data_t *)arg;
+// called by the workers, consumers only ever taking the whole list leaves no room for ABA
+static void release_context(threadpool_t *tp, connection_ctx_t *conn) {
+    if (atomic_fetch_add_explicit(&tp->pooled, 1, memory_order_relaxed) >= CONN_POOL_MAX) {
+        atomic_fetch_sub_explicit(&tp->pooled, 1, memory_order_relaxed);
+        free(conn);
+        return;
+    }
+    conn->handoff_next = atomic_load_explicit(&tp->free_contexts, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&tp->free_contexts, &conn->handoff_next, conn,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+}
 
-    while (1) {
-        pthread_mutex_lock(&worker->lock);
+static void free_context_list(connection_ctx_t *conn) {
+    while (conn) {
+        connection_ctx_t *next = conn->handoff_next;
+        free(conn);
+        conn = next;
+    }
+}
 
-        // If we have no clients, wait for new ones or for a shutdown
-        while (worker->nfds == 0 && !worker->is_shutdown) {
-            pthread_cond_wait(&worker->worker_notify, &worker->lock);
+// returns -1 if a full deque could not grow, the owner then runs the task itself
+static int deque_push(worker_data_t *worker, connection_ctx_t *conn) {
+    task_deque_t *deque = &worker->ready;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->len == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : CONN_TABLE_INITIAL;
+        connection_ctx_t **tasks = malloc(capacity * sizeof(connection_ctx_t *));
+        if (!tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
         }
+        for (size_t i = 0; i < deque->len; i++)
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    deque->tasks[(deque->head + deque->len++) % deque->capacity] = conn;
+    pthread_mutex_unlock(&deque->lock);
+    atomic_fetch_add(&worker->pool->queued, 1);
+    return 0;
+}
 
-        // If shutting down
-        if (worker->is_shutdown) {
-            pthread_mutex_unlock(&worker->lock);
-            break;
+// the owner takes its newest task, the one whose socket data is most likely still in cache
+static connection_ctx_t *deque_pop(worker_data_t *worker) {
+    task_deque_t *deque = &worker->ready;
+    connection_ctx_t *conn = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->len > 0)
+        conn = deque->tasks[(deque->head + --deque->len) % deque->capacity];
+    pthread_mutex_unlock(&deque->lock);
+    if (conn) atomic_fetch_sub(&worker->pool->queued, 1);
+    return conn;
+}
+
+// thieves take the oldest task, which has waited longest for its owner
+static connection_ctx_t *deque_steal(worker_data_t *victim) {
+    task_deque_t *deque = &victim->ready;
+    connection_ctx_t *conn = NULL;
+    // a failed trylock means the owner or another thief is at it, there are other victims to try
+    if (pthread_mutex_trylock(&deque->lock) != 0) return NULL;
+    if (deque->len > 0) {
+        conn = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->len--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    if (conn) atomic_fetch_sub(&victim->pool->queued, 1);
+    return conn;
+}
+
+// workers on the same node are robbed first, their connections use the same cache shard
+static connection_ctx_t *steal_task(worker_data_t *worker) {
+    threadpool_t *tp = worker->pool;
+    if (atomic_load(&tp->queued) == 0) return NULL;
+
+    for (int same_node = 1; same_node >= 0; same_node--) {
+        for (uint32_t i = 1; i < tp->num_workers; i++) {
+            worker_data_t *victim = &tp->worker_data[(worker->index + i) % tp->num_workers];
+            if ((victim->node == worker->node) != same_node) continue;
+            connection_ctx_t *conn = deque_steal(victim);
+            if (conn) return conn;
         }
+    }
+    return NULL;
+}
 
-        // Make a local copy of poll fds & connections
-        struct pollfd fds_local[MAX_CLIENTS_PER_THREAD];
-        connection_ctx_t *conn_local[MAX_CLIENTS_PER_THREAD];
-        nfds_t nfds_local = worker->nfds;
+// wakes one worker that has nothing to do so it can steal the tasks just queued
+static void wake_idle_worker(worker_data_t *worker) {
+    threadpool_t *tp = worker->pool;
+    for (uint32_t i = 1; i < tp->num_workers; i++) {
+        worker_data_t *peer = &tp->worker_data[(worker->index + i) % tp->num_workers];
+        if (!atomic_load(&peer->idle)) continue;
+        eventfd_write(peer->wake_fd, 1);
+        return;
+    }
+}
 
-        memcpy(fds_local, worker->fds, nfds_local * sizeof(struct pollfd));
-        memcpy(conn_local, worker->connections, nfds_local * sizeof(connection_ctx_t *));
+// whether the owner should queue conn, revents is what poll reported for its socket
+static int connection_ready(connection_ctx_t *conn, short revents) {
+    if (conn->entry) {
+        // parked reader, only its watcher wakes it up, hang ups and errors drop it
+        return (revents & (POLLERR | POLLHUP | POLLNVAL)) || conn->watcher.ready ||
+               time(NULL) - conn->parked_at > READ_WAIT_TIMEOUT;
+    }
+    return revents & (POLLERR | POLLNVAL | POLLIN | POLLHUP);
+}
 
-        pthread_mutex_unlock(&worker->lock);
+static void run_task(worker_data_t *worker, connection_ctx_t *conn) {
+    short revents = conn->revents;
+    // the per-worker copies are not shared, the thread running the task brings its own
+    conn->l1 = worker->l1;
+
+    if (conn->entry) {
+        if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            close_parked_request(conn);
+        } else if (conn->watcher.ready) {
+            resume_request(conn);
+        } else if (time(NULL) - conn->parked_at > READ_WAIT_TIMEOUT) {
+            log_error("cache read timed out");
+            close_parked_request(conn);
+        }
+    } else if (revents & (POLLERR | POLLNVAL)) {
+        if (revents & POLLERR) {
+            log_error("POLLERR error");
+            // Mark the socket as closed
+            close(conn->sock_fd);
+        }
+        if (revents & POLLNVAL) log_error("POLLNVAL error");
+        conn->sock_fd = -1;
+    } else if (revents & POLLIN) {
+        process_request(conn);
+    }
+    else if (revents & POLLHUP) {
+        /*
+        this is like this beacuse:
+        POLLHUP
+        Hang up (only returned in revents; ignored in events).  Note that when reading from a channel such as a pipe or  a  stream
+        socket,  this  event merely indicates that the peer closed its end of the channel.  Subsequent reads from the channel will
+        return 0 (end of file) only after all outstanding data in the channel has been consumed.
+        */
+        // Mark as closed
+        close(conn->sock_fd);
+        conn->sock_fd = -1;
+    }
 
-        int ret = poll(fds_local, nfds_local, 10);
-        if (ret < 0) {
-            log_error("poll() error: %s\n", strerror(errno));
+    atomic_store_explicit(&conn->busy, 0, memory_order_release);
+}
+
+static int grow_tables(worker_data_t *worker) {
+    size_t capacity = worker->capacity * 2;
+    struct pollfd *fds = realloc(worker->fds, (capacity + 2) * sizeof(struct pollfd));
+    if (!fds) return -1;
+    worker->fds = fds;
+    connection_ctx_t **connections = realloc(worker->connections, capacity * sizeof(connection_ctx_t *));
+    if (!connections) return -1;
+    worker->connections = connections;
+    worker->capacity = capacity;
+    return 0;
+}
+
+// the connection's socket is closed already, its context goes back to the pool
+static void forget_connection(worker_data_t *worker, connection_ctx_t *conn) {
+    release_context(worker->pool, conn);
+    atomic_fetch_sub_explicit(&worker->load, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&worker->pool->connections, 1, memory_order_relaxed);
+}
+
+// the connection's load is counted already, it is closed if the tables cannot take it
+static void track_connection(worker_data_t *worker, connection_ctx_t *conn) {
+    if (worker->nfds == worker->capacity && grow_tables(worker) == -1) {
+        log_error("no memory for more connections, closing client fd %d", conn->sock_fd);
+        close(conn->sock_fd);
+        forget_connection(worker, conn);
+        return;
+    }
+    worker->connections[worker->nfds++] = conn;
+}
+
+// moves the clients handed over by the accept thread into the poll set, in the order they arrived
+static void adopt_incoming(worker_data_t *worker) {
+    connection_ctx_t *list = atomic_exchange_explicit(&worker->incoming, NULL, memory_order_acquire);
+    connection_ctx_t *oldest = NULL;
+    while (list) {
+        connection_ctx_t *next = list->handoff_next;
+        list->handoff_next = oldest;
+        oldest = list;
+        list = next;
+    }
+    for (connection_ctx_t *conn = oldest, *next; conn; conn = next) {
+        next = conn->handoff_next;
+        track_connection(worker, conn);
+    }
+}
+
+// the count is taken first for the whole batch, clients that put it over the limit are given back
+// returns how many of the n clients may stay
+static uint32_t reserve_connections(threadpool_t *tp, uint32_t n) {
+    uint32_t open = atomic_fetch_add_explicit(&tp->connections, n, memory_order_relaxed);
+    uint32_t granted = open >= tp->max_connections ? 0 : tp->max_connections - open;
+    if (granted > n) granted = n;
+    if (granted < n)
+        atomic_fetch_sub_explicit(&tp->connections, n - granted, memory_order_relaxed);
+    return granted;
+}
+
+// out of descriptors the pending connection stays queued and the listener keeps polling ready
+// the reserve descriptor is given up for a moment to take it off the queue and close it
+// returns -1 if no client was dropped, the queue was empty or a concurrent accept took the freed descriptor first
+// io_uring accepts fail before they look at the queue, so an empty one does not mean the listener is fine again
+static int shed_connection(threadpool_t *tp, int listen_fd) {
+    pthread_mutex_lock(&tp->reserve_lock);
+    if (tp->reserve_fd >= 0) close(tp->reserve_fd);
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd >= 0) close(fd);
+    tp->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    pthread_mutex_unlock(&tp->reserve_lock);
+    return fd >= 0 ? 0 : -1;
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// a worker out of descriptors leaves its listener alone for a while, polling it would only report it ready again
+static int accepting(worker_data_t *worker) {
+    return worker->listen_fd >= 0 && (!worker->accept_paused_until || now_ms() >= worker->accept_paused_until);
+}
+
+// takes up to max clients off a non-blocking listener, returns how many
+// the clients stay blocking, the workers serve them with blocking sends and recvs
+// starved is set if the process is out of descriptors and no client could be dropped
+static int accept_batch(threadpool_t *tp, int listen_fd, int *fds, int max, int *starved) {
+    int n = 0;
+    while (n < max) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            fds[n++] = fd;
             continue;
         }
-        else if (ret == 0) {
-            // Timeout, no events
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if (errno == EMFILE || errno == ENFILE) {
+            log_warn("out of file descriptors, dropping a client");
+            if (shed_connection(tp, listen_fd) == -1) *starved = 1;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_error("accept() error: %s", strerror(errno));
+        }
+        break;
+    }
+    return n;
+}
+
+static void refuse_clients(const int *fds, int n) {
+    for (int i = 0; i < n; i++) {
+        log_warn("Connection limit reached; closing client fd %d.", fds[i]);
+        close(fds[i]);
+    }
+}
+
+static void init_connection(worker_data_t *worker, connection_ctx_t *conn, int client_fd, http_cache_t *cache) {
+    atomic_fetch_add_explicit(&worker->load, 1, memory_order_relaxed);
+    conn->sock_fd = client_fd;
+    conn->cache = cache_node_shard(cache, worker->node);
+    conn->watcher.wake_fd = worker->wake_fd;
+    conn->l1 = worker->l1;
+}
+
+// a client the worker accepted itself, its place under the connection limit is reserved already
+static void add_accepted(worker_data_t *worker, int client_fd) {
+    threadpool_t *tp = worker->pool;
+    connection_ctx_t *conn = alloc_context(tp, &worker->spare_contexts);
+    if (!conn) {
+        log_error("no memory for client fd %d", client_fd);
+        close(client_fd);
+        atomic_fetch_sub_explicit(&tp->connections, 1, memory_order_relaxed);
+        return;
+    }
+    init_connection(worker, conn, client_fd, worker->cache);
+    track_connection(worker, conn);
+    log_debug("worker %u accepted client fd %d", worker->index, client_fd);
+}
+
+// takes the clients waiting on the worker's own listener straight into its poll set
+// a batch at a time, so a connection storm does not keep the worker from its clients
+static void accept_clients(worker_data_t *worker) {
+    threadpool_t *tp = worker->pool;
+    int fds[ACCEPT_BATCH];
+    int starved = 0;
+    int n = accept_batch(tp, worker->listen_fd, fds, ACCEPT_BATCH, &starved);
+    uint32_t granted = reserve_connections(tp, n);
+    refuse_clients(fds + granted, n - granted);
+
+    for (uint32_t i = 0; i < granted; i++)
+        add_accepted(worker, fds[i]);
+    if (starved)
+        worker->accept_paused_until = now_ms() + ACCEPT_PAUSE_MS;
+}
+
+// returns 1 if conn went to the deque, 0 if the worker had to run it right away
+static int queue_task(worker_data_t *worker, connection_ctx_t *conn, short revents) {
+    conn->revents = revents;
+    atomic_store(&conn->busy, 1);
+    if (deque_push(worker, conn) == 0) return 1;
+    run_task(worker, conn);
+    return 0;
+}
+
+// own tasks first, then whatever the other workers have not got to yet
+static void run_tasks(worker_data_t *worker) {
+    connection_ctx_t *task;
+    while ((task = deque_pop(worker)) || (task = steal_task(worker))) {
+        run_task(worker, task);
+    }
+}
+
+// Clean up closed connections, ones another worker is still running or with a poll in flight wait for the next round
+// the last connection takes the place of a closed one, the order of the tables does not matter
+static void forget_closed(worker_data_t *worker) {
+    for (nfds_t i = 0; i < worker->nfds; i++) {
+        // If sock_fd < 0, connection was closed while processing
+        connection_ctx_t *conn = worker->connections[i];
+        if (!atomic_load_explicit(&conn->busy, memory_order_acquire) && conn->sock_fd < 0 && !conn->armed) {
+            forget_connection(worker, conn);
+            worker->connections[i--] = worker->connections[--worker->nfds];
+        }
+    }
+}
+
+// polls the worker's own connections and queues the ready ones as tasks
+// the tasks are run by this worker or by idle ones stealing them, so one slow transfer does not hold up the rest
+void *client_worker_main(void *arg) {
+    worker_data_t *worker = (worker_data_t *)arg;
+    threadpool_t *tp = worker->pool;
+
+    while (!worker->is_shutdown) {
+        adopt_incoming(worker);
+        nfds_t nfds = worker->nfds;
+
+        // busy connections are being run as a task, poll skips negative fds
+        // parked readers are not interested in their socket until the entry wakes them
+        for (nfds_t i = 0; i < nfds; i++) {
+            connection_ctx_t *conn = worker->connections[i];
+            int busy = atomic_load_explicit(&conn->busy, memory_order_acquire);
+            worker->fds[i].fd = busy ? -1 : conn->sock_fd;
+            worker->fds[i].events = busy || conn->entry ? 0 : POLLIN;
+            worker->fds[i].revents = 0;
+        }
+        // the wake up eventfd goes after the clients, followed by the listener if the worker has one
+        worker->fds[nfds].fd = worker->wake_fd;
+        worker->fds[nfds].events = POLLIN;
+        worker->fds[nfds].revents = 0;
+        int listening = accepting(worker);
+        worker->fds[nfds + 1].fd = worker->listen_fd;
+        worker->fds[nfds + 1].events = POLLIN;
+        worker->fds[nfds + 1].revents = 0;
+
+        // a timeout still falls through so parked readers get their deadline checked
+        // with tasks waiting to be stolen the poll only picks up what is ready already
+        // without clients only the eventfd can bring work, new clients and tasks to steal both fire it
+        int timeout = atomic_load(&tp->queued) ? 0 : nfds ? 10 : -1;
+        if (worker->listen_fd >= 0 && !listening && timeout < 0) timeout = ACCEPT_PAUSE_MS;
+        atomic_store(&worker->idle, 1);
+        int ret = poll(worker->fds, nfds + 1 + listening, timeout);
+        atomic_store(&worker->idle, 0);
+        if (ret < 0) {
+            if (errno != EINTR) log_error("poll() error: %s\n", strerror(errno));
             continue;
         }
 
-        // Process each readable socket
-        for (int i = 0; i < nfds_local; i++) {
-            if (fds_local[i].revents & (POLLERR | POLLNVAL)) {
-                if (fds_local[i].revents & POLLERR) {
-                    log_error("POLLERR error");
-                    // Mark the socket as closed
-                    close(conn_local[i]->sock_fd);
-                }
-                if (fds_local[i].revents & POLLNVAL) log_error("POLLNVAL error");
-                conn_local[i]->sock_fd = -1;
-            } else if (fds_local[i].revents & POLLIN) {
-                process_request(conn_local[i]);
-            }
-            else if (fds_local[i].revents & POLLHUP) {
-                /*
-                this is like this beacuse:
-                POLLHUP
-                Hang up (only returned in revents; ignored in events).  Note that when reading from a channel such as a pipe or  a  stream
-                socket,  this  event merely indicates that the peer closed its end of the channel.  Subsequent reads from the channel will
-                return 0 (end of file) only after all outstanding data in the channel has been consumed.
-                */
-                // Mark as closed
-                close(conn_local[i]->sock_fd);
-                conn_local[i]->sock_fd = -1;
+        if (worker->fds[nfds].revents & POLLIN) {
+            eventfd_t count;
+            eventfd_read(worker->wake_fd, &count);
+        }
+
+        size_t queued = 0;
+        for (nfds_t i = 0; i < nfds; i++) {
+            connection_ctx_t *conn = worker->connections[i];
+            if (worker->fds[i].fd < 0 || !connection_ready(conn, worker->fds[i].revents)) continue;
+            queued += queue_task(worker, conn, worker->fds[i].revents);
+        }
+        if (queued > 1)
+            wake_idle_worker(worker);
+
+        // new clients join the poll set for the next round
+        if (listening && worker->fds[nfds + 1].revents & POLLIN)
+            accept_clients(worker);
+
+        run_tasks(worker);
+        forget_closed(worker);
+    }
+
+    return NULL;
+}
+
+// one shot polls on the clients, a client is only handed to a task once its poll has completed
+static void arm_connection(uring_t *ring, connection_ctx_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) return;
+    // parked readers only hear about hang ups and errors, their entry wakes them through the eventfd
+    uring_prep_poll(sqe, conn->sock_fd, conn->entry ? 0 : POLLIN, (uint64_t)(uintptr_t)conn, 0);
+    conn->armed = 1;
+}
+
+// a client accepted by the ring, or a failed multishot accept that has to be armed again
+static void uring_accepted(worker_data_t *worker, int res) {
+    if (res >= 0) {
+        if (reserve_connections(worker->pool, 1) == 1)
+            add_accepted(worker, res);
+        else
+            refuse_clients(&res, 1);
+    } else if (res == -EMFILE || res == -ENFILE) {
+        log_warn("out of file descriptors, dropping a client");
+        if (shed_connection(worker->pool, worker->listen_fd) == -1)
+            worker->accept_paused_until = now_ms() + ACCEPT_PAUSE_MS;
+    } else if (res != -ECANCELED && res != -EINTR && res != -ECONNABORTED) {
+        log_error("accept() error: %s", strerror(-res));
+    }
+}
+
+// the readiness loop of client_worker_main on an io_uring of the worker's own
+// idle clients keep a poll in flight instead of going into a poll set every round, the eventfd is polled
+// and the listener accepted on by multishot requests, so a round takes a single io_uring_enter
+// the requests are served by the same blocking process_request, tasks and stealing work as in the poll loop
+void *uring_worker_main(void *arg) {
+    worker_data_t *worker = (worker_data_t *)arg;
+    threadpool_t *tp = worker->pool;
+
+    uring_t ring;
+    if (uring_init(&ring, URING_ENTRIES) == -1) {
+        log_warn("io_uring unavailable, worker %u polls instead", worker->index);
+        return client_worker_main(arg);
+    }
+
+    // kernels without multishot accept fail it with EINVAL, the listener is then polled and drained in batches
+    int wake_armed = 0, accept_armed = 0, accept_multishot = 1;
+    while (!worker->is_shutdown) {
+        adopt_incoming(worker);
+
+        struct io_uring_sqe *sqe;
+        if (!wake_armed && (sqe = uring_get_sqe(&ring))) {
+            uring_prep_poll(sqe, worker->wake_fd, POLLIN, URING_WAKE, 1);
+            wake_armed = 1;
+        }
+        if (!accept_armed && accepting(worker) && (sqe = uring_get_sqe(&ring))) {
+            if (accept_multishot)
+                uring_prep_accept(sqe, worker->listen_fd, URING_ACCEPT);
+            else
+                uring_prep_poll(sqe, worker->listen_fd, POLLIN, URING_LISTEN, 1);
+            accept_armed = 1;
+        }
+
+        // parked readers whose entry woke them or ran out of time are run without waiting for their socket,
+        // a poll still in flight for one is cancelled and the context kept until it has completed
+        size_t queued = 0;
+        for (nfds_t i = 0; i < worker->nfds; i++) {
+            connection_ctx_t *conn = worker->connections[i];
+            if (atomic_load_explicit(&conn->busy, memory_order_acquire) || conn->sock_fd < 0) continue;
+            if (conn->entry && connection_ready(conn, 0)) {
+                if (conn->armed && (sqe = uring_get_sqe(&ring)))
+                    uring_prep_cancel(sqe, (uint64_t)(uintptr_t)conn);
+                queued += queue_task(worker, conn, 0);
+            } else if (!conn->armed) {
+                arm_connection(&ring, conn);
             }
         }
 
-        // Clean up closed connections
-        pthread_mutex_lock(&worker->lock);
-        memcpy(worker->fds, fds_local, nfds_local * sizeof(struct pollfd));
-        memcpy(worker->connections, conn_local, nfds_local * sizeof(connection_ctx_t *));
-
-        for (int i = 0; i < worker->nfds; i++) {
-            // If sock_fd < 0, connection was closed while processing
-            if (worker->connections[i]->sock_fd < 0) {
-                free(worker->connections[i]);
-                // Shift the array left by one element to fill the gap
-                memmove(worker->fds + i, worker->fds + i + 1,(worker->nfds - 1 - i) * sizeof(worker->fds[0]));
-                memmove(worker->connections + i, worker->connections + i + 1, (worker->nfds - 1 - i) * sizeof(worker->connections[0]));
-                worker->nfds--;
-                i--; // re-check same index after shift
+        // same timeouts as the poll loop, parked readers need their deadline checked
+        int timeout = queued || atomic_load(&tp->queued) ? 0 : worker->nfds ? 10 : -1;
+        if (worker->listen_fd >= 0 && !accepting(worker) && timeout < 0) timeout = ACCEPT_PAUSE_MS;
+        atomic_store(&worker->idle, 1);
+        int ret = uring_submit_and_wait(&ring, timeout);
+        atomic_store(&worker->idle, 0);
+        if (ret < 0) {
+            log_error("io_uring_enter() error: %s", strerror(errno));
+            continue;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring))) {
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            int more = cqe->flags & IORING_CQE_F_MORE;
+            uring_cqe_seen(&ring);
+
+            if (user_data == URING_WAKE) {
+                eventfd_t count;
+                eventfd_read(worker->wake_fd, &count);
+                wake_armed = more;
+            } else if (user_data == URING_ACCEPT || user_data == URING_LISTEN) {
+                if (user_data == URING_LISTEN) {
+                    if (res > 0) accept_clients(worker);
+                } else if (res == -EINVAL) {
+                    log_warn("no multishot accept, worker %u polls its listener", worker->index);
+                    accept_multishot = 0;
+                } else {
+                    uring_accepted(worker, res);
+                }
+                accept_armed = more;
+                // a multishot request still running on a listener that ran out of descriptors is stopped
+                if (more && !accepting(worker) && (sqe = uring_get_sqe(&ring)))
+                    uring_prep_cancel(sqe, user_data);
+            } else if (user_data != 0) {
+                connection_ctx_t *conn = (connection_ctx_t *)(uintptr_t)user_data;
+                conn->armed = 0;
+                // a cancelled poll, or one that raced with the cancel, the task queued for it has the connection
+                if (res < 0 || atomic_load_explicit(&conn->busy, memory_order_acquire) || conn->sock_fd < 0) continue;
+                if (connection_ready(conn, (short)res))
+                    queued += queue_task(worker, conn, (short)res);
             }
         }
-        pthread_mutex_unlock(&worker->lock);
+        if (queued > 1)
+            wake_idle_worker(worker);
+
+        run_tasks(worker);
+        forget_closed(worker);
     }
 
-    // free resources
-    pthread_mutex_lock(&worker->lock);
+    // closing the ring ends the polls still in flight, the contexts are freed with the pool
+    uring_exit(&ring);
+    return NULL;
+}
+
+// runs once every worker has stopped, a connection may have been run by any of them
+static void free_connections(worker_data_t *worker) {
+    // clients handed over too late to be adopted are freed with the rest
+    adopt_incoming(worker);
 
     // Free all remaining connections
     for (int i = 0; i < worker->nfds; i++) {
         if (worker->connections[i] != NULL) {
             // Close socket if it's still open
-            if (worker->connections[i]->sock_fd >= 0) {
+            if (worker->connections[i]->entry) {
+                close_parked_request(worker->connections[i]);
+            } else if (worker->connections[i]->sock_fd >= 0) {
                 close(worker->connections[i]->sock_fd);
             }
             // Free the connection context
@@ -109,30 +584,23 @@ void *client_worker_main(void *arg) {
     }
     // Reset the number of file descriptors
     worker->nfds = 0;
-    // Clear the arrays
-    // memset(worker->fds, 0, sizeof(struct pollfd) * MAX_CLIENTS_PER_THREAD);
-    // memset(worker->connections, 0, sizeof(connection_ctx_t*) * MAX_CLIENTS_PER_THREAD);
-    pthread_mutex_unlock(&worker->lock);
-    return NULL;
 }
 
+// reads the published loads only, the accept thread never waits on a worker
 static worker_data_t *pick_worker(threadpool_t *tp) {
-    static int last_worker; // Keeps track of the last worker picked
+    static int last_worker; // Keeps track of the last worker picked, only the accept thread picks
 
-    int start_index = (last_worker + 1) % MAX_WORKER_THREADS; // Rotate starting point
+    int start_index = (last_worker + 1) % tp->num_workers; // Rotate starting point
     int best_worker = -1;
     uint32_t min_load = UINT_MAX;
 
-    for (int i = 0; i < MAX_WORKER_THREADS; i++) {
-        int current_index = (start_index + i) % MAX_WORKER_THREADS;
-        worker_data_t *w = &tp->worker_data[current_index];
-
-        pthread_mutex_lock(&w->lock);
-        if (w->nfds < min_load) {
-            min_load = w->nfds;
+    for (uint32_t i = 0; i < tp->num_workers; i++) {
+        int current_index = (start_index + i) % tp->num_workers;
+        uint32_t load = atomic_load_explicit(&tp->worker_data[current_index].load, memory_order_relaxed);
+        if (load < min_load) {
+            min_load = load;
             best_worker = current_index;
         }
-        pthread_mutex_unlock(&w->lock);
     }
 
     // Update the last picked worker
@@ -141,56 +609,214 @@ static worker_data_t *pick_worker(threadpool_t *tp) {
     return &tp->worker_data[best_worker];
 }
 
+// pushes a worker's share of the batch onto its incoming stack in one go and fires its eventfd once
+// the chain is newest first like the stack, the worker adopts it on its next round
+static void hand_over(worker_data_t *worker, connection_ctx_t *newest, connection_ctx_t *oldest) {
+    oldest->handoff_next = atomic_load_explicit(&worker->incoming, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&worker->incoming, &oldest->handoff_next, newest,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+    eventfd_write(worker->wake_fd, 1);
+}
 
-static int add_client_to_worker(worker_data_t *worker, int client_fd, http_cache_t *cache) {
-    pthread_mutex_lock(&worker->lock);
+// drains the listener a batch at a time, each batch is split between the least loaded workers
+// returns the number of clients taken off the listener, refused ones included
+// -1 if the process ran out of descriptors and could not even drop a client, the caller leaves the listener be for a while
+int threadpool_accept(threadpool_t *tp, int listen_fd, http_cache_t *cache) {
+    if (!tp) {
+        return -1;
+    }
+
+    int fds[ACCEPT_BATCH];
+    int total = 0, n, starved = 0;
+    do {
+        n = accept_batch(tp, listen_fd, fds, ACCEPT_BATCH, &starved);
+        uint32_t granted = reserve_connections(tp, n);
+        refuse_clients(fds + granted, n - granted);
+
+        for (uint32_t i = 0; i < granted; i++) {
+            connection_ctx_t *conn = alloc_context(tp, &tp->spare_contexts);
+            if (!conn) {
+                log_error("no memory for client fd %d", fds[i]);
+                close(fds[i]);
+                atomic_fetch_sub_explicit(&tp->connections, 1, memory_order_relaxed);
+                continue;
+            }
+            // the load is counted right away, so the next pick already sees it
+            worker_data_t *worker = pick_worker(tp);
+            init_connection(worker, conn, fds[i], cache);
+            conn->handoff_next = tp->batch_newest[worker->index];
+            if (!conn->handoff_next) tp->batch_oldest[worker->index] = conn;
+            tp->batch_newest[worker->index] = conn;
+            log_debug("added client fd %d", fds[i]);
+        }
+        for (uint32_t i = 0; i < tp->num_workers; i++) {
+            if (!tp->batch_newest[i]) continue;
+            hand_over(&tp->worker_data[i], tp->batch_newest[i], tp->batch_oldest[i]);
+            tp->batch_newest[i] = NULL;
+        }
+        total += n;
+    } while (n == ACCEPT_BATCH);
+
+    return starved ? -1 : total;
+}
 
-    if (worker->nfds >= MAX_CLIENTS_PER_THREAD) {
-        pthread_mutex_unlock(&worker->lock);
-        return -1; // This worker is at capacity
+// the cpus worker i may run on, its node's without the accept cpu, or a single one of those when pinning
+// returns 0 if the worker may run anywhere the process may
+static int worker_cpus(const threadpool_config_t *config, uint32_t i, cpu_set_t *set) {
+    const numa_topology_t *topo = numa_topology();
+    int node = i % topo->num_nodes;
+    if (topo->num_nodes < 2 && !config->pin_workers && config->accept_cpu < 0) return 0;
+
+    *set = topo->cpus[node];
+    if (config->accept_cpu >= 0 && CPU_COUNT(set) > 1)
+        CPU_CLR(config->accept_cpu, set);
+    if (config->pin_workers) {
+        // consecutive workers of a node take consecutive cpus of it
+        int cpu = numa_nth_cpu(set, i / topo->num_nodes);
+        CPU_ZERO(set);
+        CPU_SET(cpu, set);
     }
+    return 1;
+}
 
-    ulong idx = worker->nfds++;
-    worker->fds[idx].fd = client_fd;
-    worker->fds[idx].events = POLLIN;
-    worker->fds[idx].revents = 0;
+// the listeners of all workers form one SO_REUSEPORT group, the kernel spreads new connections over them
+static int open_listener(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_fatal("socket() fail");
+        return -1;
+    }
 
-    connection_ctx_t *conn = calloc(1, sizeof(connection_ctx_t));
-    if (!conn) {
-        // If allocation fails, revert nfds and return -1
-        worker->fds[idx].fd = -1;
-        worker->nfds--;
-        pthread_mutex_unlock(&worker->lock);
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        log_fatal("SO_REUSEPORT failed: %s", strerror(errno));
+        close(fd);
         return -1;
     }
-    conn->sock_fd = client_fd;
-    conn->cache = cache;
 
-    worker->connections[idx] = conn;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons(port),
+    };
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        log_fatal("bind() failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, SERVER_SOCKET_LISTENER_QUEUE_COUNT) != 0) {
+        log_fatal("listen() failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
-    // Signal the worker in case it was waiting for new connections
-    pthread_cond_signal(&worker->worker_notify);
-    pthread_mutex_unlock(&worker->lock);
+// order[cpu] is the worker pinned to that cpu, listeners join the group in this order
+// returns 0 unless every worker is pinned to its own cpu and those are exactly cpus 0 to num_workers - 1
+static int steering_order(const threadpool_config_t *config, uint32_t num_workers, uint32_t *order) {
+    if (!config->pin_workers) return 0;
+    for (uint32_t cpu = 0; cpu < num_workers; cpu++)
+        order[cpu] = UINT32_MAX;
+    for (uint32_t i = 0; i < num_workers; i++) {
+        cpu_set_t set;
+        if (!worker_cpus(config, i, &set)) return 0;
+        int cpu = numa_nth_cpu(&set, 0);
+        if (cpu < 0 || (uint32_t)cpu >= num_workers || order[cpu] != UINT32_MAX) return 0;
+        order[cpu] = i;
+    }
+    return 1;
+}
 
+// the group picks the listener whose index the program returns, the cpu that took the connection's packets
+// with the listeners in cpu order the connection stays on the cpu its interrupt ran on
+static int attach_steering(int fd) {
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+        log_warn("could not steer connections by cpu, the kernel hashes them: %s", strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
-int threadpool_add_client(threadpool_t *tp, int client_fd, http_cache_t *cache) {
-    if (!tp) {
-        return -1;
+static void close_listeners(threadpool_t *tp) {
+    for (uint32_t i = 0; i < tp->num_workers; i++) {
+        if (tp->worker_data[i].listen_fd >= 0)
+            close(tp->worker_data[i].listen_fd);
+        tp->worker_data[i].listen_fd = -1;
     }
+}
 
-    worker_data_t *worker = pick_worker(tp);
-    if (!worker) {
-        return -1;
+// a listener for every worker, opened before any of them polls
+static int open_listeners(threadpool_t *tp, const threadpool_config_t *config) {
+    uint32_t *order = calloc(tp->num_workers, sizeof(uint32_t));
+    if (!order) return -1;
+    int steer = config->steer_to_cpu && steering_order(config, tp->num_workers, order);
+
+    for (uint32_t k = 0; k < tp->num_workers; k++) {
+        worker_data_t *worker = &tp->worker_data[steer ? order[k] : k];
+        worker->listen_fd = open_listener(config->listen_port);
+        if (worker->listen_fd < 0) {
+            free(order);
+            close_listeners(tp);
+            return -1;
+        }
+        worker->cache = config->cache;
+    }
+    if (steer && attach_steering(tp->worker_data[order[0]].listen_fd) == 0)
+        log_info("connections are accepted by the worker on the cpu they arrive on");
+    free(order);
+    return 0;
+}
+
+// stops and joins the first started workers, then closes and frees everything the pool holds
+// also undoes a partly set up pool, so whatever was not created yet must still be NULL or -1
+static void destroy_pool(threadpool_t *tp, uint32_t started) {
+    for (uint32_t i = 0; i < started; i++) {
+        tp->worker_data[i].is_shutdown = 1;
+        eventfd_write(tp->worker_data[i].wake_fd, 1);
     }
 
-    int ret = add_client_to_worker(worker, client_fd, cache);
+    for (uint32_t i = 0; i < started; ++i) {
+        pthread_join(tp->worker_threads[i], NULL);
+    }
+
+    for (uint32_t i = 0; tp->worker_data && i < tp->num_workers; ++i) {
+        worker_data_t *worker = &tp->worker_data[i];
+        free_connections(worker);
+        pthread_mutex_destroy(&worker->ready.lock);
+        free(worker->ready.tasks);
+        free(worker->fds);
+        free(worker->connections);
+        if (worker->wake_fd >= 0)
+            close(worker->wake_fd);
+        if (worker->listen_fd >= 0)
+            close(worker->listen_fd);
+        free_context_list(worker->spare_contexts);
+        l1_cache_destroy(&worker->l1);
+    }
 
-    return ret;
+    free(tp->worker_threads);
+    free(tp->worker_data);
+    free(tp->batch_newest);
+    free(tp->batch_oldest);
+    if (tp->reserve_fd >= 0)
+        close(tp->reserve_fd);
+    pthread_mutex_destroy(&tp->reserve_lock);
+    free_context_list(tp->spare_contexts);
+    free_context_list(tp->free_contexts);
+    free(tp);
 }
 
-threadpool_t *threadpool_init(void *(*worker_function)(void *)) {
+threadpool_t *threadpool_init(void *(*worker_function)(void *), const threadpool_config_t *config) {
     if (!worker_function) {
         log_fatal("Worker function cannot be NULL\n");
         return NULL;
@@ -201,48 +827,95 @@ threadpool_t *threadpool_init(void *(*worker_function)(void *)) {
         log_fatal("no mem");
         return NULL;
     }
+    tp->reserve_fd = -1;
+    pthread_mutex_init(&tp->reserve_lock, NULL);
+    uint32_t started = 0;
+
+    // one worker per cpu the quota and the affinity mask leave, minus the one the accept thread keeps
+    tp->num_workers = config->workers;
+    if (tp->num_workers == 0) {
+        int cpus = numa_topology()->num_cpus - (config->accept_cpu >= 0);
+        tp->num_workers = cpus > MIN_AUTO_WORKERS ? cpus : MIN_AUTO_WORKERS;
+    }
+    tp->max_connections = config->max_connections;
+    tp->worker_threads = calloc(tp->num_workers, sizeof(pthread_t));
+    tp->worker_data = calloc(tp->num_workers, sizeof(worker_data_t));
+    tp->batch_newest = calloc(tp->num_workers, sizeof(connection_ctx_t *));
+    tp->batch_oldest = calloc(tp->num_workers, sizeof(connection_ctx_t *));
+
+    // what destroy_pool looks at is set for every worker first, so any failure below can hand the pool to it
+    for (uint32_t i = 0; tp->worker_data && i < tp->num_workers; i++) {
+        pthread_mutex_init(&tp->worker_data[i].ready.lock, NULL);
+        tp->worker_data[i].wake_fd = -1;
+        tp->worker_data[i].listen_fd = -1;
+    }
 
-    tp->worker_data = calloc(MAX_WORKER_THREADS, sizeof(worker_data_t));
-
-    if (!tp->worker_data) {
+    if (!tp->worker_threads || !tp->worker_data || !tp->batch_newest || !tp->batch_oldest) {
         log_fatal("Allocation error\n");
-        free(tp);
-        return NULL;
+        goto fail;
     }
 
-    for (uint32_t i = 0; i < MAX_WORKER_THREADS; i++) {
-        pthread_mutex_init(&tp->worker_data[i].lock, NULL);
-        pthread_cond_init(&tp->worker_data[i].worker_notify, NULL);
+    // without it running out of descriptors leaves the listeners ready with nothing to accept
+    tp->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (tp->reserve_fd == -1)
+        log_warn("no reserve descriptor, clients cannot be dropped when descriptors run out: %s", strerror(errno));
+
+    // every worker is set up before any runs, they look at each other's deques from the start
+    for (uint32_t i = 0; i < tp->num_workers; i++) {
+        tp->worker_data[i].index = i;
+        tp->worker_data[i].pool = tp;
+        tp->worker_data[i].node = i % numa_topology()->num_nodes;
         tp->worker_data[i].nfds = 0;
+        tp->worker_data[i].capacity = CONN_TABLE_INITIAL;
+        tp->worker_data[i].fds = malloc((CONN_TABLE_INITIAL + 2) * sizeof(struct pollfd));
+        tp->worker_data[i].connections = malloc(CONN_TABLE_INITIAL * sizeof(connection_ctx_t *));
+        if (!tp->worker_data[i].fds || !tp->worker_data[i].connections) {
+            log_fatal("Failed to allocate connection tables for worker %d\n", i);
+            goto fail;
+        }
         tp->worker_data[i].is_shutdown = 0;
-        if (pthread_create(&tp->worker_threads[i], NULL, worker_function, &tp->worker_data[i]) != 0) {
-            log_fatal("Failed to create worker thread %d\n", i);
-            perror("pthread_create");
-            free(tp->worker_data);
-            free(tp);
-            return NULL;
+        tp->worker_data[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (tp->worker_data[i].wake_fd == -1) {
+            log_fatal("Failed to create wake up eventfd for worker %d: %s\n", i, strerror(errno));
+            goto fail;
         }
+        // the worker runs fine without it, every hit just goes to the shared cache
+        tp->worker_data[i].l1 = l1_cache_init();
     }
 
-    return tp;
-}
-
-void threadpool_shutdown(threadpool_t **tp) {
-    if (!tp || !*tp) return;
-    for (uint32_t i = 0; i < MAX_WORKER_THREADS; i++) {
-        (*tp)->worker_data[i].is_shutdown = 1;
-        pthread_cond_signal(&(*tp)->worker_data[i].worker_notify);
+    if (config->listen_port && open_listeners(tp, config) == -1) {
+        log_fatal("Failed to open the worker listeners\n");
+        goto fail;
     }
 
-    for (uint32_t i = 0; i < MAX_WORKER_THREADS; ++i) {
-        pthread_join((*tp)->worker_threads[i], NULL);
-        pthread_cond_destroy(&(*tp)->worker_data[i].worker_notify);
-        pthread_mutex_destroy(&(*tp)->worker_data[i].lock);
+    for (; started < tp->num_workers; started++) {
+        pthread_attr_t attr;
+        cpu_set_t cpus;
+        pthread_attr_init(&attr);
+        if (worker_cpus(config, started, &cpus))
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        int ret = pthread_create(&tp->worker_threads[started], &attr, worker_function, &tp->worker_data[started]);
+        pthread_attr_destroy(&attr);
+        if (ret != 0) {
+            log_fatal("Failed to create worker thread %u: %s\n", started, strerror(ret));
+            goto fail;
+        }
     }
 
-    free((*tp)->worker_data);
+    log_info("%u workers%s%s%s", tp->num_workers, config->pin_workers ? ", each pinned to a cpu" : "",
+             config->accept_cpu >= 0 ? ", accepting on a cpu of its own" : "",
+             config->listen_port ? ", each accepting on a listener of its own" : "");
+    return tp;
+
+fail:
+    // the workers already running are stopped before the data they use goes away
+    destroy_pool(tp, started);
+    return NULL;
+}
 
-    free(*tp);
+void threadpool_shutdown(threadpool_t **tp) {
+    if (!tp || !*tp) return;
+    destroy_pool(*tp, (*tp)->num_workers);
     *tp = NULL;
 
     log_info("threadpool shutdown successfully");
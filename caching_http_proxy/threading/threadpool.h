@@ -2,40 +2,113 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <poll.h>
 
 #include "../caching/httpcache.h"
+#include "../caching/l1cache.h"
 
-#define MAX_WORKER_THREADS 8
-#define MAX_CLIENTS_PER_THREAD 64
+#define MIN_AUTO_WORKERS 4          // origin fetches block their worker, so even one cpu gets a few
+#define CONN_TABLE_INITIAL 64       // connections a worker has room for before its tables first grow
+#define CONN_POOL_MAX 4096          // closed connection contexts kept for reuse
+#define ACCEPT_BATCH 32             // clients taken off a listener at a time, a worker serves its others in between
+#define ACCEPT_PAUSE_MS 100         // a listener is left alone this long when not even a client could be dropped
 
 typedef struct _con_ctx {
     int sock_fd;
     http_cache_t *cache;
+    l1_cache_t *l1;                // hot small objects private to the worker running the connection, may be NULL
     //int is_forwarded;
+
+    // coalesced reader parked on an in-progress entry, NULL while the connection is handled normally
+    cache_entry_t *entry;
+    ssize_t offset;                // next body byte to send
+    time_t parked_at;              // last time the reader caught up with the writer
+    cache_watcher_t watcher;       // wakes the owning worker through its eventfd
+
+    // set by the owner when it queues the connection as a task, cleared by whichever worker ran it
+    // the owner neither polls nor frees a busy connection, so its state is only touched by one thread at a time
+    _Atomic int busy;
+    short revents;                 // poll result the task was queued for
+    int armed;                     // a poll on the socket is in flight in the owner's io_uring, owner only
+
+    struct _con_ctx *handoff_next; // link in a worker's incoming queue, or in the pool once closed
 } connection_ctx_t;
 
+// ready connections of one worker, the owner pushes and pops at the tail, idle workers steal from the head
+typedef struct _task_deque {
+    connection_ctx_t **tasks;      // ring of capacity slots, grown by the owner when full
+    size_t capacity;
+    size_t head;
+    size_t len;
+    pthread_mutex_t lock;
+} task_deque_t;
+
+// the connection arrays are private to the worker thread, everything else reaches it through atomics and wake_fd
 typedef struct _worker_data {
-    struct pollfd fds[MAX_CLIENTS_PER_THREAD];
-    connection_ctx_t *connections[MAX_CLIENTS_PER_THREAD];
+    struct pollfd *fds;            // one per connection plus the eventfd and the listener
+    connection_ctx_t **connections;
     nfds_t nfds;
+    size_t capacity;               // connections both tables have room for, doubled when exceeded
+    connection_ctx_t *_Atomic incoming; // clients from the accept thread not adopted yet, newest first
+    _Atomic uint32_t load;         // connections owned or incoming, published for pick_worker
+    int wake_fd;                   // eventfd polled next to the clients, fired for parked readers, new clients,
+                                   // work to steal and shutdown
+    int listen_fd;                 // SO_REUSEPORT listener of the worker's own, -1 when the accept thread hands clients over
+    http_cache_t *cache;           // given to the clients accepted on listen_fd
+    connection_ctx_t *spare_contexts; // taken from the pool for those clients and not handed out yet
+    int64_t accept_paused_until;   // monotonic ms, out of descriptors listen_fd is not polled before then
+    l1_cache_t *l1;
+    int node;                      // NUMA node index the worker runs on, its clients use that node's cache shard
+    uint32_t index;
+    struct _threadpool *pool;
+    task_deque_t ready;
+    _Atomic int idle;              // waiting for clients or in poll, worth waking when there is work to steal
     _Atomic uint32_t is_shutdown;
-    pthread_mutex_t lock;
-    pthread_cond_t worker_notify;
 } worker_data_t;
 
+typedef struct _threadpool_config_t {
+    uint32_t workers;              // worker threads, 0 starts one per usable cpu
+    int pin_workers;               // each worker on a single cpu instead of anywhere on its NUMA node
+    int accept_cpu;                // cpu kept for the accept thread, -1 shares every cpu with the workers
+    uint32_t max_connections;      // open client connections of all workers together
+    uint16_t listen_port;          // each worker accepts on a listener of its own, 0 leaves it to threadpool_accept
+    int steer_to_cpu;              // a connection goes to the listener of the worker pinned to the cpu it came in on
+    http_cache_t *cache;           // cache of the clients the workers accept
+} threadpool_config_t;
+
 typedef struct _threadpool {
-    pthread_t worker_threads[MAX_WORKER_THREADS];
+    uint32_t num_workers;
+    pthread_t *worker_threads;
     worker_data_t *worker_data;
+    _Atomic uint32_t queued;       // tasks in all deques, lets workers without clients sleep until there is some
+
+    // open client connections, accepting stops at max_connections
+    _Atomic uint32_t connections;
+    uint32_t max_connections;
+
+    // contexts of closed connections, workers push them and whoever accepts takes the whole list
+    connection_ctx_t *_Atomic free_contexts;
+    connection_ctx_t *spare_contexts;  // accept thread only, taken from free_contexts and not handed out yet
+    _Atomic uint32_t pooled;       // contexts in both lists
+
+    // accept thread only, the part of a batch each worker gets, chained newest first
+    connection_ctx_t **batch_newest;
+    connection_ctx_t **batch_oldest;
+
+    // descriptor given up to drop a client when the process runs out of them
+    int reserve_fd;
+    pthread_mutex_t reserve_lock;
     // uint32_t is_shutdown;
 } threadpool_t;
 
-threadpool_t *threadpool_init(void *(*worker_function)(void *));
+threadpool_t *threadpool_init(void *(*worker_function)(void *), const threadpool_config_t *config);
 
 void *client_worker_main(void *arg);
+void *uring_worker_main(void *arg);
 // int add_client_to_worker(worker_data_t *worker, int client_fd, http_cache_t *cache);
 void threadpool_shutdown(threadpool_t **tp);
-int threadpool_add_client(threadpool_t *tp, int client_fd, http_cache_t *cache);
+int threadpool_accept(threadpool_t *tp, int listen_fd, http_cache_t *cache);
 
 #endif
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "../third_party/log.h"
+
+static int enter(uring_t *ring, uint32_t to_submit, uint32_t min_complete, uint32_t flags, void *arg, size_t arg_size) {
+    int ret = (int)syscall(SYS_io_uring_enter, ring->fd, to_submit, min_complete, flags, arg, arg_size);
+    if (ret > 0) ring->sq_pending -= (uint32_t)ret < ring->sq_pending ? (uint32_t)ret : ring->sq_pending;
+    return ret;
+}
+
+static void unmap(uring_t *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+// returns -1 if the kernel has no io_uring, or one too old for waiting with a timeout
+int uring_init(uring_t *ring, uint32_t entries) {
+    memset(ring, 0, sizeof(*ring));
+
+    // a single issuer that runs the completion work itself when it waits, the worker thread is the only user
+    struct io_uring_params params = {.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN};
+    ring->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        ring->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+    }
+    if (ring->fd < 0) {
+        log_debug("io_uring_setup() failed: %s", strerror(errno));
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        log_debug("io_uring cannot wait with a timeout on this kernel");
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        log_error("could not map io_uring: %s", strerror(errno));
+        unmap(ring);
+        close(ring->fd);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (_Atomic uint32_t *)(sq + params.sq_off.head);
+    ring->sq_tail = (_Atomic uint32_t *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    ring->cq_head = (_Atomic uint32_t *)(cq + params.cq_off.head);
+    ring->cq_tail = (_Atomic uint32_t *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // slot i of the array always names sqe i, entries are used in ring order
+    for (uint32_t i = 0; i <= ring->sq_mask; i++)
+        ring->sq_array[i] = i;
+    return 0;
+}
+
+// closing the ring cancels whatever is still outstanding in it
+void uring_exit(uring_t *ring) {
+    if (ring->fd < 0) return;
+    unmap(ring);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+// a cleared entry, published to the kernel with the next uring_submit_and_wait
+// a full ring is submitted right away, NULL only if the kernel took none of it
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    uint32_t tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) > ring->sq_mask) {
+        if (enter(ring, ring->sq_pending, 0, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            log_error("io_uring_enter() failed: %s", strerror(errno));
+            return NULL;
+        }
+        if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) > ring->sq_mask) return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    ring->sq_pending++;
+    return sqe;
+}
+
+// submits the filled entries and waits for a completion, 0 only collects what is there, -1 waits without limit
+// a single syscall either way, returns -1 on errors other than the wait running out or a signal
+int uring_submit_and_wait(uring_t *ring, int timeout_ms) {
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+    };
+    struct io_uring_getevents_arg arg = {
+        .sigmask = 0,
+        .sigmask_sz = _NSIG / 8,
+        .ts = timeout_ms > 0 ? (uint64_t)(uintptr_t)&ts : 0,
+    };
+    int ret = enter(ring, ring->sq_pending, timeout_ms == 0 ? 0 : 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                    &arg, sizeof(arg));
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) return -1;
+    return 0;
+}
+
+// the oldest completion not seen yet, NULL if there is none
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+}
+
+// completes with the poll result in res, a multishot poll keeps completing until it reports no IORING_CQE_F_MORE
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, uint32_t events, uint64_t user_data, int multishot) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+}
+
+// multishot, every client accepted completes with its descriptor in res
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+// the request with the given user_data completes with -ECANCELED, the cancel itself completes with user_data 0
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0;
+}
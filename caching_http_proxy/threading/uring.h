@@ -0,0 +1,43 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256           // submission slots of a worker's ring, a full ring is submitted early
+
+// a worker's io_uring, set up with the raw syscalls and used by the thread that created it only
+typedef struct _uring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;                 // same mapping as sq_ring on kernels with a single mmap
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    _Atomic uint32_t *sq_head;     // advanced by the kernel as it consumes entries
+    _Atomic uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t *sq_array;
+    uint32_t sq_pending;           // entries filled since the last io_uring_enter
+
+    _Atomic uint32_t *cq_head;
+    _Atomic uint32_t *cq_tail;     // advanced by the kernel as it posts completions
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+int uring_init(uring_t *ring, uint32_t entries);
+void uring_exit(uring_t *ring);
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+int uring_submit_and_wait(uring_t *ring, int timeout_ms);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, uint32_t events, uint64_t user_data, int multishot);
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t user_data);
+
+#endif // URING_H